@@ -21,10 +21,47 @@ CONFIG(debug, debug|release) {
     QZSTREAM_BIN_DIR = $$QZSTREAM_BIN_DIR/debug
 } 
 
-win32|emscripten {
+# zlib-ng built with ZLIB_COMPAT replaces zlib for all streams
+qzstream_zlib_ng {
+    !isEmpty(ZLIB_NG_DIR) {
+        INCLUDEPATH += $$ZLIB_NG_DIR/include
+        LIBS += -L$$ZLIB_NG_DIR/lib
+    }
+    LIBS += -lz
+} else:win32|emscripten {
     INCLUDEPATH += $$[QT_INSTALL_HEADERS]/QtZlib
 } else {
     LIBS += -lz
 }
 
+# libdeflate becomes available as a block codec backend
+qzstream_libdeflate {
+    !isEmpty(LIBDEFLATE_DIR) {
+        INCLUDEPATH += $$LIBDEFLATE_DIR/include
+        LIBS += -L$$LIBDEFLATE_DIR/lib
+    }
+    DEFINES += QZSTREAM_WITH_LIBDEFLATE
+    LIBS += -ldeflate
+}
+
+# zstd payloads in CCZ data
+qzstream_zstd {
+    !isEmpty(ZSTD_DIR) {
+        INCLUDEPATH += $$ZSTD_DIR/include
+        LIBS += -L$$ZSTD_DIR/lib
+    }
+    DEFINES += QZSTREAM_WITH_ZSTD
+    LIBS += -lzstd
+}
+
+# LZ4 frame payloads in CCZ data
+qzstream_lz4 {
+    !isEmpty(LZ4_DIR) {
+        INCLUDEPATH += $$LZ4_DIR/include
+        LIBS += -L$$LZ4_DIR/lib
+    }
+    DEFINES += QZSTREAM_WITH_LZ4
+    LIBS += -llz4
+}
+
 DEFINES += ZLIB_CONST
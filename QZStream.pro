@@ -7,7 +7,11 @@ lib.file = lib/QZStream.pro
 ccz_imageformat_plugin.depends = lib
 
 !emscripten {
-    SUBDIRS += tests
+    SUBDIRS += tests benchmarks image_benchmarks
     tests.file = tests/QZStreamTests.pro
     tests.depends = ccz_imageformat_plugin
+    benchmarks.file = benchmarks/QZStreamBenchmarks.pro
+    benchmarks.depends = ccz_imageformat_plugin
+    image_benchmarks.file = image_benchmarks/QZStreamImageBenchmarks.pro
+    image_benchmarks.depends = ccz_imageformat_plugin
 }
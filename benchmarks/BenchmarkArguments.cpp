@@ -0,0 +1,36 @@
+﻿#include "BenchmarkArguments.h"
+
+QStringList benchmarkArguments(int argc, char *argv[])
+{
+	QStringList arguments;
+	bool hasFormat = false;
+	for (int i = 0; i < argc; i++)
+	{
+		auto argument = QString::fromLocal8Bit(argv[i]);
+		if (argument == "-txt" || argument == "-csv" || argument == "-xml" ||
+			argument == "-lightxml" || argument == "-junitxml" ||
+			argument == "-teamcity" || argument == "-tap")
+		{
+			hasFormat = true;
+		}
+
+		arguments.append(argument);
+	}
+
+	bool hasOutput = false;
+	for (int i = 1; i < arguments.size(); i++)
+	{
+		if (arguments.at(i - 1) != "-o")
+			continue;
+
+		// Output files without a format suffix use the format option
+		hasOutput = true;
+		if (!hasFormat && !arguments.at(i).contains(','))
+			arguments[i].append(",csv");
+	}
+
+	if (!hasFormat && !hasOutput)
+		arguments.append("-csv");
+
+	return arguments;
+}
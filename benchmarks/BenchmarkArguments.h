@@ -0,0 +1,7 @@
+﻿#pragma once
+
+#include <QStringList>
+
+// Command line of QTest::qExec() that writes results as CSV
+// unless a format is given, for example -o results.xml,xml
+QStringList benchmarkArguments(int argc, char *argv[]);
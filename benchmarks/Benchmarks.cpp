@@ -0,0 +1,471 @@
+﻿#include "Benchmarks.h"
+
+#include "QZStream.h"
+#include "QCCZStream.h"
+
+#include <QBuffer>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QtTest>
+
+#define QADD_COLUMN(type, name) QTest::addColumn<type>(#name)
+
+enum
+{
+	LARGE_SOURCE_SIZE = 64 * 1024 * 1024,
+	READ_BLOCK_SIZE = 65536,
+	SMALL_WRITE_RECORD_COUNT = 1024 * 1024,
+	SMALL_READ_RECORD_COUNT = 1024 * 1024,
+	// Sizes above are skipped unless QZSTREAM_BENCHMARK_MAX_SIZE
+	// raises the limit, up to 1 GB. The large source is limited
+	// the same way, but kept at least a checkpoint interval.
+	DEFAULT_MAX_SIZE = 16 * 1024 * 1024,
+	CCZ_CHUNK_SIZE = 1024 * 1024,
+	RANDOM_SEEK_COUNT = 16,
+	CHECKPOINT_INTERVAL = 1024 * 1024
+};
+
+void Benchmarks::initTestCase()
+{
+	QVERIFY(mDir.isValid());
+
+	auto sourceBytes = sampleBytes(int(qBound(qint64(CHECKPOINT_INTERVAL),
+		maxBenchmarkSize(), qint64(LARGE_SOURCE_SIZE))));
+	mSourceSize = sourceBytes.size();
+
+	{
+		QBuffer buffer(&mCompressed);
+		QZCompressor compress(&buffer, Z_DEFAULT_COMPRESSION);
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+		QCOMPARE(compress.write(sourceBytes), mSourceSize);
+		compress.close();
+		QVERIFY(!compress.hasError());
+	}
+
+	mFilePath = QDir(mDir.path()).filePath("large.z");
+	QFile file(mFilePath);
+	QVERIFY(file.open(QIODevice::WriteOnly));
+	QCOMPARE(file.write(mCompressed), qint64(mCompressed.size()));
+}
+
+void Benchmarks::compress_data()
+{
+	addCodecRows();
+}
+
+void Benchmarks::compress()
+{
+	QFETCH(int, size);
+	QFETCH(int, entropy);
+	QFETCH(int, level);
+	QFETCH(int, container);
+
+	auto sourceBytes = sampleBytes(size, entropy);
+
+	QByteArray bytes;
+	QBENCHMARK
+	{
+		bytes = compressBytes(sourceBytes, level, container);
+	}
+	QVERIFY(!bytes.isEmpty());
+}
+
+void Benchmarks::decompress_data()
+{
+	addCodecRows();
+}
+
+void Benchmarks::decompress()
+{
+	QFETCH(int, size);
+	QFETCH(int, entropy);
+	QFETCH(int, level);
+	QFETCH(int, container);
+
+	auto bytes = compressBytes(sampleBytes(size, entropy), level, container);
+	QVERIFY(!bytes.isEmpty());
+
+	QByteArray block(READ_BLOCK_SIZE, Qt::Uninitialized);
+
+	QBENCHMARK
+	{
+		QBuffer buffer(&bytes);
+		QScopedPointer<QZDecompressor> decompress(newDecompressor(container));
+		decompress->setIODevice(&buffer);
+		if (container == CONTAINER_ZLIB)
+			decompress->setUncompressedSize(size);
+		QVERIFY(decompress->open(QIODevice::ReadOnly));
+
+		qint64 total = 0;
+		while (!decompress->atEnd())
+		{
+			auto readBytes = decompress->read(block.data(), block.size());
+			QVERIFY(readBytes > 0);
+			total += readBytes;
+		}
+		QCOMPARE(total, qint64(size));
+
+		decompress->close();
+		QVERIFY(!decompress->hasError());
+	}
+}
+
+void Benchmarks::readPattern_data()
+{
+	QADD_COLUMN(int, pattern);
+
+	QTest::newRow("sequential") << (int) READ_SEQUENTIAL;
+	QTest::newRow("random") << (int) READ_RANDOM;
+	QTest::newRow("random_indexed") << (int) READ_RANDOM_INDEXED;
+}
+
+void Benchmarks::readPattern()
+{
+	QFETCH(int, pattern);
+
+	QBuffer buffer(&mCompressed);
+	QZDecompressor decompress(&buffer, mSourceSize);
+	if (pattern == READ_RANDOM_INDEXED)
+		decompress.setCheckpointInterval(CHECKPOINT_INTERVAL);
+	QVERIFY(decompress.open(QIODevice::ReadOnly));
+
+	QByteArray block(READ_BLOCK_SIZE, Qt::Uninitialized);
+	auto readAll = [&decompress, &block]() {
+		qint64 total = 0;
+		while (!decompress.atEnd())
+		{
+			auto readBytes = decompress.read(block.data(), block.size());
+			if (readBytes <= 0)
+				break;
+
+			total += readBytes;
+		}
+		return total;
+	};
+
+	// The index is built by the first pass
+	if (pattern == READ_RANDOM_INDEXED)
+		QCOMPARE(readAll(), mSourceSize);
+
+	QBENCHMARK
+	{
+		if (pattern == READ_SEQUENTIAL)
+		{
+			QVERIFY(decompress.seek(0));
+			QCOMPARE(readAll(), mSourceSize);
+		} else
+		{
+			quint32 seed = 12345;
+			for (int i = 0; i < RANDOM_SEEK_COUNT; i++)
+			{
+				seed = seed * 1103515245 + 12345;
+				auto pos = qint64(seed % quint32(mSourceSize - block.size()));
+				QVERIFY(decompress.seek(pos));
+				QCOMPARE(decompress.read(block.data(), block.size()),
+					qint64(block.size()));
+			}
+		}
+	}
+
+	decompress.close();
+	QVERIFY(!decompress.hasError());
+}
+
+void Benchmarks::readSmall_data()
+{
+	QADD_COLUMN(int, method);
+	QADD_COLUMN(int, cacheSize);
+
+	QTest::newRow("get_char") << (int) READ_GET_CHAR << 32768;
+	QTest::newRow("get_char_uncached") << (int) READ_GET_CHAR << 0;
+	QTest::newRow("data_stream") << (int) READ_DATA_STREAM << 32768;
+	QTest::newRow("data_stream_uncached") << (int) READ_DATA_STREAM << 0;
+}
+
+void Benchmarks::readSmall()
+{
+	QFETCH(int, method);
+	QFETCH(int, cacheSize);
+
+	QByteArray recordBytes;
+	{
+		QBuffer buffer(&recordBytes);
+		QVERIFY(buffer.open(QIODevice::WriteOnly));
+		QDataStream stream(&buffer);
+		for (int i = 0; i < SMALL_READ_RECORD_COUNT; i++)
+		{
+			stream << qint32(i) << quint8(i & 0x7F) << quint16(i % 1000);
+		}
+	}
+
+	auto bytes = compressBytes(recordBytes, Z_DEFAULT_COMPRESSION,
+		CONTAINER_ZLIB);
+	QVERIFY(!bytes.isEmpty());
+
+	QBENCHMARK
+	{
+		QBuffer buffer(&bytes);
+		QZDecompressor decompress(&buffer, recordBytes.size());
+		decompress.setCacheSize(cacheSize);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+
+		if (method == READ_GET_CHAR)
+		{
+			qint64 count = 0;
+			char c;
+			while (decompress.getChar(&c))
+			{
+				count++;
+			}
+			QCOMPARE(count, qint64(recordBytes.size()));
+		} else
+		{
+			QDataStream stream(&decompress);
+			qint32 index;
+			quint8 flags;
+			quint16 value;
+			for (int i = 0; i < SMALL_READ_RECORD_COUNT; i++)
+			{
+				stream >> index >> flags >> value;
+			}
+			QCOMPARE(stream.status(), QDataStream::Ok);
+		}
+
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+	}
+}
+
+void Benchmarks::decompressSource_data()
+{
+	QADD_COLUMN(int, sourceType);
+	QADD_COLUMN(bool, directInput);
+	QADD_COLUMN(int, readAheadBlocks);
+
+	QTest::newRow("file_mapped") << (int) SOURCE_FILE << true << 0;
+	QTest::newRow("file_copied") << (int) SOURCE_FILE << false << 0;
+	QTest::newRow("buffer_direct") << (int) SOURCE_BUFFER << true << 0;
+	QTest::newRow("buffer_copied") << (int) SOURCE_BUFFER << false << 0;
+	QTest::newRow("file_mapped_read_ahead") << (int) SOURCE_FILE << true << 8;
+}
+
+void Benchmarks::decompressSource()
+{
+	QFETCH(int, sourceType);
+	QFETCH(bool, directInput);
+	QFETCH(int, readAheadBlocks);
+
+	QFile file(mFilePath);
+	QBuffer buffer(&mCompressed);
+	QIODevice *source = sourceType == SOURCE_FILE
+		? static_cast<QIODevice *>(&file)
+		: static_cast<QIODevice *>(&buffer);
+
+	QByteArray block(READ_BLOCK_SIZE, Qt::Uninitialized);
+
+	QBENCHMARK
+	{
+		QVERIFY(source->open(QIODevice::ReadOnly));
+
+		QZDecompressor decompress(source, mSourceSize);
+		decompress.setDirectInputEnabled(directInput);
+		decompress.setReadAheadBlockCount(readAheadBlocks);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+
+		qint64 total = 0;
+		while (!decompress.atEnd())
+		{
+			auto readBytes = decompress.read(block.data(), block.size());
+			QVERIFY(readBytes > 0);
+			total += readBytes;
+		}
+		QCOMPARE(total, mSourceSize);
+
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+		source->close();
+	}
+}
+
+void Benchmarks::compressSmallWrites_data()
+{
+	QADD_COLUMN(int, inputBufferSize);
+
+	QTest::newRow("unbuffered") << 0;
+	QTest::newRow("buffer_4k") << 4096;
+	QTest::newRow("buffer_64k") << 65536;
+}
+
+void Benchmarks::compressSmallWrites()
+{
+	QFETCH(int, inputBufferSize);
+
+	QFile file(QDir(mDir.path()).filePath("small_writes.z"));
+
+	QBENCHMARK
+	{
+		QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+
+		QZCompressor compress(&file);
+		compress.setInputBufferSize(inputBufferSize);
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+
+		// QDataStream writes each field separately
+		QDataStream stream(&compress);
+		for (int i = 0; i < SMALL_WRITE_RECORD_COUNT; i++)
+		{
+			stream << qint32(i) << quint8(i & 0x7F) << quint16(i % 1000);
+		}
+		QCOMPARE(stream.status(), QDataStream::Ok);
+
+		compress.close();
+		QVERIFY(!compress.hasError());
+		file.close();
+	}
+}
+
+void Benchmarks::addCodecRows()
+{
+	QADD_COLUMN(int, size);
+	QADD_COLUMN(int, entropy);
+	QADD_COLUMN(int, level);
+	QADD_COLUMN(int, container);
+
+	static const char *entropyNames[] = {"low", "text", "random"};
+
+	for (int size : benchmarkSizes())
+	{
+		QByteArray sizeName;
+		if (size >= 1024 * 1024 * 1024)
+			sizeName = QByteArray::number(size >> 30) + "g";
+		else if (size >= 1024 * 1024)
+			sizeName = QByteArray::number(size >> 20) + "m";
+		else
+			sizeName = QByteArray::number(size >> 10) + "k";
+
+		for (int entropy = ENTROPY_LOW; entropy <= ENTROPY_RANDOM; entropy++)
+		{
+			for (int level : {1, 6, 9})
+			{
+				auto name = sizeName + "_" + entropyNames[entropy] +
+					"_level" + QByteArray::number(level);
+				QTest::newRow(name.constData())
+					<< size << entropy << level << (int) CONTAINER_ZLIB;
+			}
+		}
+
+		QTest::newRow((sizeName + "_text_level6_ccz").constData())
+			<< size << (int) ENTROPY_TEXT << 6 << (int) CONTAINER_CCZ;
+		QTest::newRow((sizeName + "_text_level6_ccz_chunked").constData())
+			<< size << (int) ENTROPY_TEXT << 6
+			<< (int) CONTAINER_CCZ_CHUNKED;
+	}
+}
+
+qint64 Benchmarks::maxBenchmarkSize()
+{
+	qint64 maxSize = DEFAULT_MAX_SIZE;
+	auto maxSizeValue = qgetenv("QZSTREAM_BENCHMARK_MAX_SIZE");
+	if (!maxSizeValue.isEmpty())
+		maxSize = maxSizeValue.toLongLong();
+
+	return qMin(maxSize, qint64(1) << 30);
+}
+
+QList<int> Benchmarks::benchmarkSizes()
+{
+	auto maxSize = maxBenchmarkSize();
+
+	// 1 KB to 1 GB
+	QList<int> sizes;
+	for (qint64 size = 1024; size <= maxSize; size *= 16)
+	{
+		sizes.append(int(size));
+	}
+
+	return sizes;
+}
+
+QByteArray Benchmarks::sampleBytes(int size, int entropy)
+{
+	static const char *words[] = {"alpha ", "beta ", "gamma ", "delta ",
+		"epsilon ", "zeta ", "eta ", "theta ", "iota ", "kappa\n"};
+
+	QByteArray result;
+	result.reserve(size);
+
+	quint32 seed = 12345;
+	switch (entropy)
+	{
+		case ENTROPY_LOW:
+			// Long runs of few values
+			while (result.size() < size)
+			{
+				seed = seed * 1103515245 + 12345;
+				result.append(
+					QByteArray(int((seed >> 16) % 256), char((seed >> 24) & 3)));
+			}
+			break;
+
+		case ENTROPY_RANDOM:
+			result.resize(size);
+			for (int i = 0; i < size; i++)
+			{
+				seed = seed * 1103515245 + 12345;
+				result[i] = char(seed >> 24);
+			}
+			break;
+
+		default:
+			while (result.size() < size)
+			{
+				seed = seed * 1103515245 + 12345;
+				result.append(words[(seed >> 16) % 10]);
+				result.append(char(seed >> 24));
+			}
+			break;
+	}
+
+	result.truncate(size);
+	return result;
+}
+
+QByteArray Benchmarks::compressBytes(
+	const QByteArray &bytes, int level, int container)
+{
+	QByteArray result;
+	QBuffer buffer(&result);
+
+	QScopedPointer<QZCompressor> compress;
+	if (container == CONTAINER_ZLIB)
+	{
+		compress.reset(new QZCompressor(&buffer, level));
+	} else
+	{
+		auto cczCompress = new QCCZCompressor(&buffer, level);
+		if (container == CONTAINER_CCZ_CHUNKED)
+			cczCompress->setChunkSize(CCZ_CHUNK_SIZE);
+		compress.reset(cczCompress);
+	}
+
+	if (!compress->open(QIODevice::WriteOnly) ||
+		compress->write(bytes) != bytes.size())
+	{
+		return QByteArray();
+	}
+
+	compress->close();
+	if (compress->hasError())
+		return QByteArray();
+
+	return result;
+}
+
+QZDecompressor *Benchmarks::newDecompressor(int container)
+{
+	if (container == CONTAINER_ZLIB)
+		return new QZDecompressor;
+
+	return new QCCZDecompressor;
+}
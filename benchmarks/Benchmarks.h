@@ -0,0 +1,80 @@
+﻿#pragma once
+
+#include <QObject>
+#include <QList>
+#include <QTemporaryDir>
+
+class QZDecompressor;
+
+class Benchmarks : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void initTestCase();
+
+	void compress_data();
+	void compress();
+
+	void decompress_data();
+	void decompress();
+
+	void readPattern_data();
+	void readPattern();
+
+	void readSmall_data();
+	void readSmall();
+
+	void decompressSource_data();
+	void decompressSource();
+
+	void compressSmallWrites_data();
+	void compressSmallWrites();
+
+private:
+	enum
+	{
+		SOURCE_FILE,
+		SOURCE_BUFFER
+	};
+
+	enum
+	{
+		ENTROPY_LOW,
+		ENTROPY_TEXT,
+		ENTROPY_RANDOM
+	};
+
+	enum
+	{
+		CONTAINER_ZLIB,
+		CONTAINER_CCZ,
+		CONTAINER_CCZ_CHUNKED
+	};
+
+	enum
+	{
+		READ_SEQUENTIAL,
+		READ_RANDOM,
+		READ_RANDOM_INDEXED
+	};
+
+	enum
+	{
+		READ_GET_CHAR,
+		READ_DATA_STREAM
+	};
+
+	static void addCodecRows();
+	static qint64 maxBenchmarkSize();
+	static QList<int> benchmarkSizes();
+	static QByteArray sampleBytes(int size, int entropy = ENTROPY_TEXT);
+	static QByteArray compressBytes(
+		const QByteArray &bytes, int level, int container);
+	static QZDecompressor *newDecompressor(int container);
+
+	QTemporaryDir mDir;
+	QString mFilePath;
+	QByteArray mCompressed;
+	qint64 mSourceSize;
+};
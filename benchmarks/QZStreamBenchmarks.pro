@@ -0,0 +1,25 @@
+QT       += testlib
+QT       -= gui
+
+TARGET = QZStreamBenchmarks
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+CONFIG += warn_off
+unix {
+    QMAKE_CXXFLAGS_WARN_OFF -= -w
+    QMAKE_CXXFLAGS += -Wall
+}
+
+HEADERS += \
+    BenchmarkArguments.h \
+    Benchmarks.h
+
+SOURCES += \
+    main.cpp \
+    BenchmarkArguments.cpp \
+    Benchmarks.cpp
+
+include(../QZStreamDepend.pri)
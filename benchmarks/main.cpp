@@ -0,0 +1,12 @@
+﻿#include <QtTest>
+#include "Benchmarks.h"
+#include "BenchmarkArguments.h"
+
+int main(int argc, char *argv[])
+{
+	QTEST_SET_MAIN_SOURCE_PATH
+
+	Benchmarks benchmarks;
+
+	return QTest::qExec(&benchmarks, benchmarkArguments(argc, argv));
+}
@@ -0,0 +1,30 @@
+﻿#pragma once
+
+#include "QCCZStream.h"
+
+// Payload compression of the image container handler
+
+enum
+{
+	// Image writers send scanlines and small headers
+	CCZ_INPUT_BUFFER_SIZE = 16384
+};
+
+// Level of the CCZ compression type for a QImageWriter compression ratio
+inline int compressionRatioToLevel(int ratio, int compressionType)
+{
+	if (ratio < 0)
+		return -1;
+
+	switch (compressionType)
+	{
+		case CCZ::COMPRESSION_ZSTD:
+			return qMax((qMin(ratio, 100) * 19) / 100, 1);
+
+		// LZ4-HC levels
+		case CCZ::COMPRESSION_LZ4:
+			return 3 + (qMin(ratio, 100) * 9) / 100;
+	}
+
+	return (qMin(ratio, 100) * 9) / 91;
+}
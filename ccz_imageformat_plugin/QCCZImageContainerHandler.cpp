@@ -8,19 +8,27 @@
 #include <QFileInfo>
 #include <QBuffer>
 
-#include "QCCZStream.h"
+#include "QCCZImageContainerCompression.h"
 #undef compress
 #include <set>
 #include <atomic>
+#include <limits>
+
+// Description text key selecting the CCZ payload compression
+static const QString CCZ_CompressionKey = QStringLiteral("CCZ-Compression");
+// Description text key selecting QZCompressor::setPreset() for zlib
+static const QString CCZ_PresetKey = QStringLiteral("CCZ-Preset");
 
 QCCZImageContainerHandler::QCCZImageContainerHandler()
 	: mTransformations(TransformationNone)
 	, mReader(nullptr)
 	, mDecompressor(nullptr)
+	, mStoredPayload(nullptr)
 	, mWriter(nullptr)
 	, mCompressor(nullptr)
 	, mQuality(-1)
 	, mCompressionRatio(-1)
+	, mCompressionType(CCZ::COMPRESSION_ZLIB)
 	, mGamma(0.f)
 	, mOptimizedWrite(false)
 	, mProgressiveScanWrite(false)
@@ -32,6 +40,7 @@ QCCZImageContainerHandler::QCCZImageContainerHandler()
 QCCZImageContainerHandler::~QCCZImageContainerHandler()
 {
 	delete mReader;
+	delete mStoredPayload;
 	delete mDecompressor;
 	delete mWriter;
 	delete mCompressor;
@@ -96,8 +105,12 @@ bool QCCZImageContainerHandler::write(const QImage &image)
 	if (!ensureWritable())
 		return false;
 
-	mCompressor->setCompressionLevel(
-		compressionRatioToLevel(mCompressionRatio));
+	// Compression ratio overrides the level of a preset
+	if (mCompressionRatio >= 0 || mPreset.isEmpty())
+	{
+		mCompressor->setCompressionLevel(
+			compressionRatioToLevel(mCompressionRatio, mCompressionType));
+	}
 
 	mWriter->setQuality(mQuality);
 	mWriter->setGamma(mGamma);
@@ -127,6 +140,13 @@ QVariant QCCZImageContainerHandler::option(ImageOption option) const
 				description.append(
 					key + QStringLiteral(": ") + mReader->text(key));
 			}
+
+			auto compressionType = mDecompressor->compressionType();
+			if (compressionType != CCZ::COMPRESSION_ZLIB)
+			{
+				description.append(CCZ_CompressionKey + QStringLiteral(": ") +
+					QLatin1String(CCZ::compressionName(compressionType)));
+			}
 			return description.join(QStringLiteral("\n\n"));
 		}
 
@@ -254,7 +274,31 @@ void QCCZImageContainerHandler::setOption(
 
 		case Description:
 		{
-			mDescription = value.toString();
+			// Compression keys are not passed to the image writer
+			QStringList description;
+			mCompressionType = CCZ::COMPRESSION_ZLIB;
+			mPreset.clear();
+			for (const auto &text :
+				value.toString().split(QStringLiteral("\n\n")))
+			{
+				auto key = text.section(QLatin1Char(':'), 0, 0).trimmed();
+				auto name = text.section(QLatin1Char(':'), 1).trimmed();
+				if (key == CCZ_CompressionKey)
+				{
+					mCompressionType = CCZ::compressionType(name.toLatin1());
+					continue;
+				}
+
+				if (key == CCZ_PresetKey)
+				{
+					mPreset = name.toLatin1();
+					continue;
+				}
+
+				description.append(text);
+			}
+
+			mDescription = description.join(QStringLiteral("\n\n"));
 			break;
 		}
 
@@ -448,14 +492,6 @@ void QCCZImageContainerHandler::setSubType(const QByteArray &t)
 	}
 }
 
-int QCCZImageContainerHandler::compressionRatioToLevel(int ratio)
-{
-	if (ratio < 0)
-		return -1;
-
-	return (qMin(ratio, 100) * 9) / 91;
-}
-
 bool QCCZImageContainerHandler::ensureWritable()
 {
 	if (!mWriter && !mCompressor)
@@ -488,8 +524,19 @@ bool QCCZImageContainerHandler::ensureWritable()
 				QImageWriter::supportedImageFormats();
 			if (writableFormats.contains(mWriteFormat))
 			{
-				mCompressor = new QCCZCompressor(
-					device(), compressionRatioToLevel(mCompressionRatio));
+				mCompressor = new QCCZCompressor(device(),
+					compressionRatioToLevel(
+						mCompressionRatio, mCompressionType));
+				mCompressor->setCompressionType(mCompressionType);
+				mCompressor->setInputBufferSize(CCZ_INPUT_BUFFER_SIZE);
+				// Presets tune deflate only
+				if (!mPreset.isEmpty() &&
+					(mCompressionType != CCZ::COMPRESSION_ZLIB ||
+						!mCompressor->setPreset(mPreset)))
+				{
+					return false;
+				}
+
 				if (!mCompressor->open(QIODevice::WriteOnly))
 				{
 					return false;
@@ -527,7 +574,21 @@ bool QCCZImageContainerHandler::scanDevice() const
 	}
 
 	Q_ASSERT(!mReader);
-	mReader = new QImageReader(mDecompressor);
+	QIODevice *imageDevice = mDecompressor;
+
+	// Stored images are read straight from mapped memory
+	auto storedData = mDecompressor->storedData();
+	if (storedData &&
+		mDecompressor->size() <= std::numeric_limits<int>::max())
+	{
+		mStoredPayload = new QBuffer;
+		mStoredPayload->setData(QByteArray::fromRawData(
+			storedData, int(mDecompressor->size())));
+		if (mStoredPayload->open(QIODevice::ReadOnly))
+			imageDevice = mStoredPayload;
+	}
+
+	mReader = new QImageReader(imageDevice);
 
 	bool ok = mReader->canRead();
 	mAutoTransform = ok && mReader->autoTransform();
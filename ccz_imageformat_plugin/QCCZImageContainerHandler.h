@@ -5,6 +5,7 @@
 #include <QSharedPointer>
 #include <QRect>
 
+class QBuffer;
 class QImageReader;
 class QImageWriter;
 class QCCZDecompressor;
@@ -14,6 +15,7 @@ class QCCZImageContainerHandler : public QImageIOHandler
 {
 	QByteArray mWriteFormat;
 	QByteArray mWriteSubType;
+	QByteArray mPreset;
 	QRect mClipRect;
 	QSize mScaledSize;
 	QRect mScaledClipRect;
@@ -22,10 +24,12 @@ class QCCZImageContainerHandler : public QImageIOHandler
 
 	mutable QImageReader *mReader;
 	mutable QCCZDecompressor *mDecompressor;
+	mutable QBuffer *mStoredPayload;
 	QImageWriter *mWriter;
 	QCCZCompressor *mCompressor;
 	int mQuality;
 	int mCompressionRatio;
+	int mCompressionType;
 	float mGamma;
 	bool mOptimizedWrite;
 	bool mProgressiveScanWrite;
@@ -59,7 +63,6 @@ public:
 private:
 	static const QList<QByteArray> &supportedSubTypes();
 	QByteArray subType() const;
-	static int compressionRatioToLevel(int ratio);
 
 	bool ensureWritable();
 	bool ensureScanned() const;
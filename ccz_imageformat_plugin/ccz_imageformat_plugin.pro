@@ -1,4 +1,4 @@
-VERSION = 1.0.2
+VERSION = 1.1.0
 
 TARGET = qcczimagecontainer
 
@@ -39,7 +39,8 @@ msvc {
 
 HEADERS += \
     QCCZImageContainerPlugin.h \
-    QCCZImageContainerHandler.h
+    QCCZImageContainerHandler.h \
+    QCCZImageContainerCompression.h
 
 SOURCES += \
     QCCZImageContainerPlugin.cpp \
@@ -0,0 +1,343 @@
+﻿#include "ImageBenchmarks.h"
+
+#include "QCCZImageContainerCompression.h"
+
+#include <QBuffer>
+#include <QDir>
+#include <QFile>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QtTest>
+
+#define QADD_COLUMN(type, name) QTest::addColumn<type>(#name)
+
+enum
+{
+	// Sizes above are skipped unless QZSTREAM_BENCHMARK_MAX_SIZE
+	// raises the limit of 32 bit pixel data
+	DEFAULT_MAX_SIZE = 16 * 1024 * 1024,
+	DEFAULT_COMPRESSION_RATIO = 50
+};
+
+static const char *const IMAGE_FORMATS[] = {"bmp", "png", "jpg"};
+
+void ImageBenchmarks::initTestCase()
+{
+	QVERIFY(mDir.isValid());
+
+	auto writerFormats = QImageWriter::supportedImageFormats();
+	QVERIFY(writerFormats.contains("ccz"));
+
+	static const char *contentNames[] = {"photo", "flat"};
+	for (int size : imageSizes())
+	{
+		for (int content = CONTENT_PHOTO; content <= CONTENT_FLAT; content++)
+		{
+			auto image = generateImage(size, content);
+
+			for (auto format : IMAGE_FORMATS)
+			{
+				if (!writerFormats.contains(format))
+					continue;
+
+				CorpusImage corpus;
+				corpus.name = QByteArray(contentNames[content]) + "_" +
+					QByteArray::number(size) + "_" + format;
+				corpus.format = format;
+				corpus.image = image;
+				auto fileName = corpus.name + "." + format + ".ccz";
+				corpus.filePath =
+					QDir(mDir.path()).filePath(QString::fromLatin1(fileName));
+
+				QImageWriter writer(corpus.filePath);
+				writer.setCompression(DEFAULT_COMPRESSION_RATIO);
+				QVERIFY(writer.write(image));
+
+				QFile file(corpus.filePath);
+				QVERIFY(file.open(QIODevice::ReadOnly));
+				corpus.ccz = file.readAll();
+				corpus.payload = QCCZDecompressor::decompressBytes(corpus.ccz);
+				QVERIFY(!corpus.payload.isEmpty());
+
+				mCorpus.push_back(corpus);
+			}
+		}
+	}
+}
+
+void ImageBenchmarks::canRead_data()
+{
+	QADD_COLUMN(int, index);
+
+	for (int i = 0; i < int(mCorpus.size()); i++)
+	{
+		QTest::newRow(mCorpus[i].name.constData()) << i;
+	}
+}
+
+void ImageBenchmarks::canRead()
+{
+	QFETCH(int, index);
+
+	auto &corpus = mCorpus[index];
+
+	QBENCHMARK
+	{
+		QImageReader reader(corpus.filePath);
+		QVERIFY(reader.canRead());
+	}
+}
+
+void ImageBenchmarks::read_data()
+{
+	QADD_COLUMN(int, index);
+	QADD_COLUMN(int, stage);
+	QADD_COLUMN(int, option);
+
+	for (int i = 0; i < int(mCorpus.size()); i++)
+	{
+		auto &name = mCorpus[i].name;
+		QTest::newRow((name + "_total").constData())
+			<< i << (int) STAGE_TOTAL << (int) OPTION_NONE;
+		QTest::newRow((name + "_decompress").constData())
+			<< i << (int) STAGE_DECOMPRESS << (int) OPTION_NONE;
+		QTest::newRow((name + "_decode").constData())
+			<< i << (int) STAGE_DECODE << (int) OPTION_NONE;
+		QTest::newRow((name + "_total_clip_rect").constData())
+			<< i << (int) STAGE_TOTAL << (int) OPTION_CLIP_RECT;
+		QTest::newRow((name + "_total_scaled_size").constData())
+			<< i << (int) STAGE_TOTAL << (int) OPTION_SCALED_SIZE;
+	}
+}
+
+void ImageBenchmarks::read()
+{
+	QFETCH(int, index);
+	QFETCH(int, stage);
+	QFETCH(int, option);
+
+	auto &corpus = mCorpus[index];
+	auto size = corpus.image.size();
+
+	switch (stage)
+	{
+		case STAGE_TOTAL:
+		{
+			QRect clipRect;
+			QSize scaledSize;
+			if (option == OPTION_CLIP_RECT)
+			{
+				clipRect = QRect(size.width() / 4, size.height() / 4,
+					size.width() / 2, size.height() / 2);
+			} else if (option == OPTION_SCALED_SIZE)
+			{
+				scaledSize = size / 2;
+			}
+
+			QImage image;
+			QBENCHMARK
+			{
+				QImageReader reader(corpus.filePath);
+				reader.setClipRect(clipRect);
+				reader.setScaledSize(scaledSize);
+				image = reader.read();
+			}
+
+			QVERIFY(!image.isNull());
+			break;
+		}
+
+		case STAGE_DECOMPRESS:
+		{
+			// CCZ payload read the way the plugin streams it
+			QByteArray payload;
+			QBENCHMARK
+			{
+				QFile file(corpus.filePath);
+				QVERIFY(file.open(QIODevice::ReadOnly));
+				QCCZDecompressor decompress(&file);
+				QVERIFY(decompress.open(QIODevice::ReadOnly));
+				payload = decompress.readAll();
+				decompress.close();
+				QVERIFY(!decompress.hasError());
+			}
+
+			QCOMPARE(payload, corpus.payload);
+			break;
+		}
+
+		case STAGE_DECODE:
+		{
+			QImage image;
+			QBENCHMARK
+			{
+				image = QImage::fromData(
+					corpus.payload, corpus.format.constData());
+			}
+
+			QCOMPARE(image.size(), size);
+			break;
+		}
+	}
+}
+
+void ImageBenchmarks::write_data()
+{
+	QADD_COLUMN(int, index);
+	QADD_COLUMN(int, stage);
+	QADD_COLUMN(int, compressionRatio);
+
+	for (int i = 0; i < int(mCorpus.size()); i++)
+	{
+		auto &name = mCorpus[i].name;
+		QTest::newRow((name + "_encode").constData())
+			<< i << (int) STAGE_ENCODE << -1;
+
+		for (int ratio : {0, 50, 100})
+		{
+			auto suffix = QByteArray("_ratio") + QByteArray::number(ratio);
+			QTest::newRow((name + "_total" + suffix).constData())
+				<< i << (int) STAGE_TOTAL << ratio;
+			QTest::newRow((name + "_compress" + suffix).constData())
+				<< i << (int) STAGE_COMPRESS << ratio;
+		}
+	}
+}
+
+void ImageBenchmarks::write()
+{
+	QFETCH(int, index);
+	QFETCH(int, stage);
+	QFETCH(int, compressionRatio);
+
+	auto &corpus = mCorpus[index];
+
+	switch (stage)
+	{
+		case STAGE_TOTAL:
+		{
+			QBENCHMARK
+			{
+				QBuffer buffer;
+				QVERIFY(buffer.open(QIODevice::WriteOnly));
+				QImageWriter writer(&buffer, "ccz");
+				writer.setSubType(corpus.format);
+				writer.setCompression(compressionRatio);
+				QVERIFY(writer.write(corpus.image));
+			}
+			break;
+		}
+
+		case STAGE_ENCODE:
+		{
+			QBENCHMARK
+			{
+				QBuffer buffer;
+				QVERIFY(buffer.open(QIODevice::WriteOnly));
+				QImageWriter writer(&buffer, corpus.format);
+				QVERIFY(writer.write(corpus.image));
+			}
+			break;
+		}
+
+		case STAGE_COMPRESS:
+		{
+			// Streaming compressor set up like the plugin writes it,
+			// fed about a scanline at a time like image writers do
+			int chunkSize = corpus.image.bytesPerLine();
+			QByteArray bytes;
+			QBENCHMARK
+			{
+				bytes.clear();
+				QBuffer buffer(&bytes);
+				QCCZCompressor compress(&buffer,
+					compressionRatioToLevel(
+						compressionRatio, CCZ::COMPRESSION_ZLIB));
+				compress.setInputBufferSize(CCZ_INPUT_BUFFER_SIZE);
+				QVERIFY(compress.open(QIODevice::WriteOnly));
+				auto size = corpus.payload.size();
+				for (int i = 0; i < size; i += chunkSize)
+				{
+					auto length = qMin(chunkSize, size - i);
+					QCOMPARE(compress.write(corpus.payload.constData() + i, length),
+						qint64(length));
+				}
+				compress.close();
+				QVERIFY(!compress.hasError());
+			}
+
+			QVERIFY(!bytes.isEmpty());
+			break;
+		}
+	}
+}
+
+QList<int> ImageBenchmarks::imageSizes()
+{
+	qint64 maxSize = DEFAULT_MAX_SIZE;
+	auto maxSizeValue = qgetenv("QZSTREAM_BENCHMARK_MAX_SIZE");
+	if (!maxSizeValue.isEmpty())
+		maxSize = maxSizeValue.toLongLong();
+
+	QList<int> sizes;
+	for (int size : {256, 1024, 2048, 4096, 8192})
+	{
+		if (qint64(size) * size * 4 > maxSize)
+			break;
+
+		sizes.append(size);
+	}
+
+	return sizes;
+}
+
+QImage ImageBenchmarks::generateImage(int size, int content)
+{
+	// Same pixels on every run and platform
+	quint32 seed = 12345;
+	auto nextRandom = [&seed]() {
+		seed = seed * 1103515245 + 12345;
+		return seed >> 16;
+	};
+
+	if (content == CONTENT_PHOTO)
+	{
+		// Gradients with noise
+		QImage image(size, size, QImage::Format_RGB32);
+		for (int y = 0; y < size; y++)
+		{
+			auto line = reinterpret_cast<QRgb *>(image.scanLine(y));
+			for (int x = 0; x < size; x++)
+			{
+				int noise = int(nextRandom() % 32) - 16;
+				line[x] = qRgb(qBound(0, x * 255 / size + noise, 255),
+					qBound(0, y * 255 / size + noise, 255),
+					qBound(0, (x + y) * 127 / size + noise, 255));
+			}
+		}
+		return image;
+	}
+
+	// Solid rectangles on a transparent background
+	QImage image(size, size, QImage::Format_ARGB32);
+	image.fill(Qt::transparent);
+	for (int i = 0; i < 64; i++)
+	{
+		int left = int(nextRandom() % uint(size));
+		int top = int(nextRandom() % uint(size));
+		int width = int(nextRandom() % uint(size / 4)) + 1;
+		int height = int(nextRandom() % uint(size / 4)) + 1;
+		auto color = qRgba(int(nextRandom() % 256), int(nextRandom() % 256),
+			int(nextRandom() % 256), 255);
+
+		for (int y = top; y < qMin(top + height, size); y++)
+		{
+			auto line = reinterpret_cast<QRgb *>(image.scanLine(y));
+			for (int x = left; x < qMin(left + width, size); x++)
+			{
+				line[x] = color;
+			}
+		}
+	}
+	return image;
+}
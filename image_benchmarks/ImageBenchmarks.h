@@ -0,0 +1,67 @@
+﻿#pragma once
+
+#include <QByteArray>
+#include <QImage>
+#include <QList>
+#include <QObject>
+#include <QTemporaryDir>
+
+#include <vector>
+
+class ImageBenchmarks : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void initTestCase();
+
+	void canRead_data();
+	void canRead();
+
+	void read_data();
+	void read();
+
+	void write_data();
+	void write();
+
+private:
+	enum
+	{
+		CONTENT_PHOTO,
+		CONTENT_FLAT
+	};
+
+	// Part of the work a row measures
+	enum
+	{
+		STAGE_TOTAL,
+		STAGE_DECOMPRESS,
+		STAGE_DECODE,
+		STAGE_ENCODE,
+		STAGE_COMPRESS
+	};
+
+	enum
+	{
+		OPTION_NONE,
+		OPTION_CLIP_RECT,
+		OPTION_SCALED_SIZE
+	};
+
+	struct CorpusImage
+	{
+		QByteArray name;
+		QByteArray format;
+		QImage image;
+		QString filePath;
+		// Inner format data and the whole CCZ file
+		QByteArray payload;
+		QByteArray ccz;
+	};
+
+	static QList<int> imageSizes();
+	static QImage generateImage(int size, int content);
+
+	QTemporaryDir mDir;
+	std::vector<CorpusImage> mCorpus;
+};
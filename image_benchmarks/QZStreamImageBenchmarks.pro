@@ -0,0 +1,31 @@
+QT       += testlib
+
+QT       += gui
+
+TARGET = QZStreamImageBenchmarks
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+CONFIG += warn_off
+unix {
+    QMAKE_CXXFLAGS_WARN_OFF -= -w
+    QMAKE_CXXFLAGS += -Wall
+}
+
+INCLUDEPATH += \
+    $$PWD/../benchmarks \
+    $$PWD/../ccz_imageformat_plugin
+
+HEADERS += \
+    ../benchmarks/BenchmarkArguments.h \
+    ../ccz_imageformat_plugin/QCCZImageContainerCompression.h \
+    ImageBenchmarks.h
+
+SOURCES += \
+    main.cpp \
+    ../benchmarks/BenchmarkArguments.cpp \
+    ImageBenchmarks.cpp
+
+include(../QZStreamDepend.pri)
@@ -0,0 +1,17 @@
+﻿#include <QtTest>
+#include "ImageBenchmarks.h"
+#include "BenchmarkArguments.h"
+
+#ifdef CCZ_IMAGEFORMAT_STATIC
+#include <QtPlugin>
+Q_IMPORT_PLUGIN(QCCZImageContainerPlugin)
+#endif
+
+int main(int argc, char *argv[])
+{
+	QTEST_SET_MAIN_SOURCE_PATH
+
+	ImageBenchmarks benchmarks;
+
+	return QTest::qExec(&benchmarks, benchmarkArguments(argc, argv));
+}
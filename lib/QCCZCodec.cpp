@@ -0,0 +1,589 @@
+﻿#include "QCCZCodec.h"
+
+#include "QCCZStream.h"
+#include "QZBackend.h"
+
+#include <QByteArray>
+
+#include <cstring>
+
+#ifdef QZSTREAM_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef QZSTREAM_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+namespace CCZ
+{
+Decoder::~Decoder()
+{
+}
+
+Encoder::~Encoder()
+{
+}
+} // namespace CCZ
+
+namespace
+{
+// zlib stream buffers and totals follow codec progress
+void advance(z_stream &zstream, size_t inSize, size_t outSize)
+{
+	zstream.next_in += inSize;
+	zstream.avail_in -= uInt(inSize);
+	zstream.total_in += uLong(inSize);
+	zstream.next_out += outSize;
+	zstream.avail_out -= uInt(outSize);
+	zstream.total_out += uLong(outSize);
+}
+
+void resetTotals(z_stream &zstream)
+{
+	zstream.msg = Z_NULL;
+	zstream.total_in = 0;
+	zstream.total_out = 0;
+}
+
+// Stored payload passes through, buffers may be null when empty
+void copy(z_stream &zstream, size_t size)
+{
+	if (size > 0)
+		memcpy(zstream.next_out, zstream.next_in, size);
+
+	advance(zstream, size, size);
+}
+
+class StoredDecoder : public CCZ::Decoder
+{
+public:
+	explicit StoredDecoder(qint64 size)
+		: mSize(size)
+	{
+	}
+
+	virtual int reset(z_stream &zstream) override
+	{
+		resetTotals(zstream);
+		return Z_OK;
+	}
+
+	virtual int decode(z_stream &zstream) override
+	{
+		// Data may follow the payload
+		auto left = mSize - qint64(zstream.total_out);
+		auto size = size_t(qMin(
+			qint64(qMin(zstream.avail_in, zstream.avail_out)), left));
+		copy(zstream, size);
+
+		return qint64(zstream.total_out) == mSize ? Z_STREAM_END : Z_OK;
+	}
+
+private:
+	qint64 mSize;
+};
+
+class StoredEncoder : public CCZ::Encoder
+{
+public:
+	virtual int reset(z_stream &zstream, int) override
+	{
+		resetTotals(zstream);
+		return Z_OK;
+	}
+
+	virtual int setLevel(int) override
+	{
+		return Z_OK;
+	}
+
+	virtual int encode(z_stream &zstream, int flush) override
+	{
+		copy(zstream, size_t(qMin(zstream.avail_in, zstream.avail_out)));
+
+		return flush == Z_FINISH && zstream.avail_in == 0 ? Z_STREAM_END
+														  : Z_OK;
+	}
+};
+
+#ifdef QZSTREAM_WITH_ZSTD
+int zstdError(z_stream &zstream, size_t result, int code)
+{
+	zstream.msg = ZSTD_getErrorName(result);
+	return code;
+}
+
+class ZstdDecoder : public CCZ::Decoder
+{
+public:
+	ZstdDecoder()
+		: mContext(ZSTD_createDCtx())
+	{
+	}
+
+	virtual ~ZstdDecoder() override
+	{
+		ZSTD_freeDCtx(mContext);
+	}
+
+	inline bool isValid() const
+	{
+		return mContext != nullptr;
+	}
+
+	virtual int reset(z_stream &zstream) override
+	{
+		resetTotals(zstream);
+
+		auto result = ZSTD_DCtx_reset(mContext, ZSTD_reset_session_only);
+		if (ZSTD_isError(result))
+			return zstdError(zstream, result, Z_STREAM_ERROR);
+
+		return Z_OK;
+	}
+
+	virtual int decode(z_stream &zstream) override
+	{
+		ZSTD_inBuffer in = {zstream.next_in, zstream.avail_in, 0};
+		ZSTD_outBuffer out = {zstream.next_out, zstream.avail_out, 0};
+		auto result = ZSTD_decompressStream(mContext, &out, &in);
+		advance(zstream, in.pos, out.pos);
+
+		if (ZSTD_isError(result))
+			return zstdError(zstream, result, Z_DATA_ERROR);
+
+		// Frame is decoded and flushed
+		return result == 0 ? Z_STREAM_END : Z_OK;
+	}
+
+private:
+	ZSTD_DCtx *mContext;
+};
+
+class ZstdEncoder : public CCZ::Encoder
+{
+public:
+	ZstdEncoder()
+		: mContext(ZSTD_createCCtx())
+	{
+	}
+
+	virtual ~ZstdEncoder() override
+	{
+		ZSTD_freeCCtx(mContext);
+	}
+
+	inline bool isValid() const
+	{
+		return mContext != nullptr;
+	}
+
+	virtual int reset(z_stream &zstream, int level) override
+	{
+		resetTotals(zstream);
+
+		auto result = ZSTD_CCtx_reset(mContext, ZSTD_reset_session_only);
+		if (!ZSTD_isError(result))
+			result = ZSTD_CCtx_setParameter(mContext, ZSTD_c_checksumFlag, 1);
+
+		if (ZSTD_isError(result))
+			return zstdError(zstream, result, Z_STREAM_ERROR);
+
+		return setLevel(level);
+	}
+
+	virtual int setLevel(int level) override
+	{
+		// Accepted inside a frame, but single threaded zstd only
+		// applies it from the next one
+		ZSTD_CCtx_setParameter(
+			mContext, ZSTD_c_compressionLevel, qMax(level, 0));
+		return Z_OK;
+	}
+
+	virtual int encode(z_stream &zstream, int flush) override
+	{
+		auto op = flush == Z_FINISH
+			? ZSTD_e_end
+			: (flush == Z_NO_FLUSH ? ZSTD_e_continue : ZSTD_e_flush);
+
+		// Flushing stops only when done or the output is full
+		size_t result;
+		do
+		{
+			ZSTD_inBuffer in = {zstream.next_in, zstream.avail_in, 0};
+			ZSTD_outBuffer out = {zstream.next_out, zstream.avail_out, 0};
+			result = ZSTD_compressStream2(mContext, &out, &in, op);
+			advance(zstream, in.pos, out.pos);
+
+			if (ZSTD_isError(result))
+				return zstdError(zstream, result, Z_STREAM_ERROR);
+		} while (
+			op != ZSTD_e_continue && result != 0 && zstream.avail_out > 0);
+
+		return op == ZSTD_e_end && result == 0 ? Z_STREAM_END : Z_OK;
+	}
+
+private:
+	ZSTD_CCtx *mContext;
+};
+#endif
+
+#ifdef QZSTREAM_WITH_LZ4
+enum
+{
+	LZ4_BLOCK_SIZE = 65536
+};
+
+int lz4Error(z_stream &zstream, size_t result, int code)
+{
+	zstream.msg = LZ4F_getErrorName(result);
+	return code;
+}
+
+class Lz4Decoder : public CCZ::Decoder
+{
+public:
+	Lz4Decoder()
+		: mContext(nullptr)
+	{
+		if (LZ4F_isError(
+				LZ4F_createDecompressionContext(&mContext, LZ4F_VERSION)))
+		{
+			mContext = nullptr;
+		}
+	}
+
+	virtual ~Lz4Decoder() override
+	{
+		if (mContext)
+			LZ4F_freeDecompressionContext(mContext);
+	}
+
+	inline bool isValid() const
+	{
+		return mContext != nullptr;
+	}
+
+	virtual int reset(z_stream &zstream) override
+	{
+		resetTotals(zstream);
+		LZ4F_resetDecompressionContext(mContext);
+		return Z_OK;
+	}
+
+	virtual int decode(z_stream &zstream) override
+	{
+		size_t inSize = zstream.avail_in;
+		size_t outSize = zstream.avail_out;
+		auto result = LZ4F_decompress(mContext, zstream.next_out, &outSize,
+			zstream.next_in, &inSize, nullptr);
+		advance(zstream, inSize, outSize);
+
+		if (LZ4F_isError(result))
+			return lz4Error(zstream, result, Z_DATA_ERROR);
+
+		return result == 0 ? Z_STREAM_END : Z_OK;
+	}
+
+private:
+	LZ4F_dctx *mContext;
+};
+
+// LZ4F needs room for a whole compressed block,
+// its output is staged and drained into the stream buffer
+class Lz4Encoder : public CCZ::Encoder
+{
+public:
+	Lz4Encoder()
+		: mContext(nullptr)
+		, mPendingOffset(0)
+		, mLevel(0)
+		, mFinished(false)
+	{
+		memset(&mPreferences, 0, sizeof(mPreferences));
+		if (LZ4F_isError(
+				LZ4F_createCompressionContext(&mContext, LZ4F_VERSION)))
+		{
+			mContext = nullptr;
+		}
+	}
+
+	virtual ~Lz4Encoder() override
+	{
+		if (mContext)
+			LZ4F_freeCompressionContext(mContext);
+	}
+
+	inline bool isValid() const
+	{
+		return mContext != nullptr;
+	}
+
+	virtual int reset(z_stream &zstream, int level) override
+	{
+		resetTotals(zstream);
+		setLevel(level);
+
+		memset(&mPreferences, 0, sizeof(mPreferences));
+		mPreferences.frameInfo.blockSizeID = LZ4F_max64KB;
+		mPreferences.frameInfo.contentChecksumFlag =
+			LZ4F_contentChecksumEnabled;
+		mPreferences.compressionLevel = mLevel;
+
+		mPending.resize(LZ4F_HEADER_SIZE_MAX);
+		auto result = LZ4F_compressBegin(
+			mContext, mPending.data(), size_t(mPending.size()), &mPreferences);
+		if (LZ4F_isError(result))
+			return lz4Error(zstream, result, Z_STREAM_ERROR);
+
+		mPending.resize(int(result));
+		mPendingOffset = 0;
+		mFinished = false;
+		return Z_OK;
+	}
+
+	virtual int setLevel(int level) override
+	{
+		// Levels from 3 select LZ4-HC
+		mLevel = qMax(level, 0);
+		return Z_OK;
+	}
+
+	virtual int encode(z_stream &zstream, int flush) override
+	{
+		while (true)
+		{
+			drain(zstream);
+			if (mPendingOffset < mPending.size())
+				return Z_OK;
+
+			size_t result;
+			if (zstream.avail_in > 0)
+			{
+				auto size = qMin(uInt(zstream.avail_in), uInt(LZ4_BLOCK_SIZE));
+				mPending.resize(
+					int(LZ4F_compressBound(size, &mPreferences)));
+				result = LZ4F_compressUpdate(mContext, mPending.data(),
+					size_t(mPending.size()), zstream.next_in, size, nullptr);
+				if (!LZ4F_isError(result))
+					advance(zstream, size, 0);
+			} else if (flush == Z_NO_FLUSH)
+			{
+				return Z_OK;
+			} else if (flush == Z_FINISH)
+			{
+				if (mFinished)
+					return Z_STREAM_END;
+
+				mPending.resize(int(LZ4F_compressBound(0, &mPreferences)));
+				result = LZ4F_compressEnd(mContext, mPending.data(),
+					size_t(mPending.size()), nullptr);
+				mFinished = true;
+			} else
+			{
+				mPending.resize(int(LZ4F_compressBound(0, &mPreferences)));
+				result = LZ4F_flush(mContext, mPending.data(),
+					size_t(mPending.size()), nullptr);
+				if (result == 0)
+					return Z_OK;
+			}
+
+			if (LZ4F_isError(result))
+				return lz4Error(zstream, result, Z_STREAM_ERROR);
+
+			mPending.resize(int(result));
+			mPendingOffset = 0;
+		}
+	}
+
+private:
+	void drain(z_stream &zstream)
+	{
+		auto size = qMin(
+			uInt(mPending.size() - mPendingOffset), zstream.avail_out);
+		memcpy(zstream.next_out, mPending.constData() + mPendingOffset, size);
+		mPendingOffset += int(size);
+		advance(zstream, 0, size);
+	}
+
+	LZ4F_cctx *mContext;
+	LZ4F_preferences_t mPreferences;
+	QByteArray mPending;
+	int mPendingOffset;
+	int mLevel;
+	bool mFinished;
+};
+#endif
+
+struct ThreadState
+{
+#ifdef QZSTREAM_WITH_ZSTD
+	ZSTD_DCtx *zstd;
+#endif
+#ifdef QZSTREAM_WITH_LZ4
+	LZ4F_dctx *lz4;
+#endif
+
+	ThreadState()
+	{
+#ifdef QZSTREAM_WITH_ZSTD
+		zstd = nullptr;
+#endif
+#ifdef QZSTREAM_WITH_LZ4
+		lz4 = nullptr;
+#endif
+	}
+
+	~ThreadState()
+	{
+#ifdef QZSTREAM_WITH_ZSTD
+		ZSTD_freeDCtx(zstd);
+#endif
+#ifdef QZSTREAM_WITH_LZ4
+		if (lz4)
+			LZ4F_freeDecompressionContext(lz4);
+#endif
+	}
+
+	static ThreadState &instance()
+	{
+		thread_local ThreadState state;
+		return state;
+	}
+};
+
+template <typename T>
+std::unique_ptr<T> validCodec(T *codec)
+{
+	std::unique_ptr<T> result(codec);
+	if (!result->isValid())
+		result.reset();
+
+	return result;
+}
+} // namespace
+
+namespace CCZ
+{
+std::unique_ptr<Decoder> createDecoder(int type, qint64 uncompressedSize)
+{
+	switch (type)
+	{
+		case COMPRESSION_NONE:
+			return std::unique_ptr<Decoder>(
+				new StoredDecoder(uncompressedSize));
+
+#ifdef QZSTREAM_WITH_ZSTD
+		case COMPRESSION_ZSTD:
+			return validCodec(new ZstdDecoder);
+#endif
+
+#ifdef QZSTREAM_WITH_LZ4
+		case COMPRESSION_LZ4:
+			return validCodec(new Lz4Decoder);
+#endif
+	}
+
+	return nullptr;
+}
+
+std::unique_ptr<Encoder> createEncoder(int type)
+{
+	switch (type)
+	{
+		case COMPRESSION_NONE:
+			return std::unique_ptr<Encoder>(new StoredEncoder);
+
+#ifdef QZSTREAM_WITH_ZSTD
+		case COMPRESSION_ZSTD:
+			return validCodec(new ZstdEncoder);
+#endif
+
+#ifdef QZSTREAM_WITH_LZ4
+		case COMPRESSION_LZ4:
+			return validCodec(new Lz4Encoder);
+#endif
+	}
+
+	return nullptr;
+}
+
+bool decompressPayload(int type, QZBackend *backend, const void *in,
+	size_t inSize, void *out, size_t outSize)
+{
+	switch (type)
+	{
+		case COMPRESSION_ZLIB:
+			return backend->decompressBlock(in, inSize, out, outSize);
+
+		case COMPRESSION_NONE:
+		{
+			if (inSize < outSize)
+				return false;
+
+			memcpy(out, in, outSize);
+			return true;
+		}
+
+#ifdef QZSTREAM_WITH_ZSTD
+		case COMPRESSION_ZSTD:
+		{
+			auto &state = ThreadState::instance();
+			if (!state.zstd)
+				state.zstd = ZSTD_createDCtx();
+
+			if (!state.zstd)
+				return false;
+
+			auto result =
+				ZSTD_decompressDCtx(state.zstd, out, outSize, in, inSize);
+			return !ZSTD_isError(result) && result == outSize;
+		}
+#endif
+
+#ifdef QZSTREAM_WITH_LZ4
+		case COMPRESSION_LZ4:
+		{
+			auto &state = ThreadState::instance();
+			if (!state.lz4 &&
+				LZ4F_isError(LZ4F_createDecompressionContext(
+					&state.lz4, LZ4F_VERSION)))
+			{
+				state.lz4 = nullptr;
+				return false;
+			}
+
+			LZ4F_resetDecompressionContext(state.lz4);
+
+			// Output is complete only with the frame end and checksum
+			size_t inCount = 0;
+			size_t outCount = 0;
+			while (true)
+			{
+				size_t inLeft = inSize - inCount;
+				size_t outLeft = outSize - outCount;
+				auto result = LZ4F_decompress(state.lz4,
+					static_cast<char *>(out) + outCount, &outLeft,
+					static_cast<const char *>(in) + inCount, &inLeft,
+					nullptr);
+				if (LZ4F_isError(result))
+					return false;
+
+				inCount += inLeft;
+				outCount += outLeft;
+
+				if (result == 0)
+					return outCount == outSize;
+
+				if (inLeft == 0 && outLeft == 0)
+					return false;
+			}
+		}
+#endif
+	}
+
+	return false;
+}
+} // namespace CCZ
@@ -0,0 +1,45 @@
+﻿#pragma once
+
+#include <QtGlobal>
+
+#include <memory>
+
+#include <zlib.h>
+
+class QZBackend;
+
+namespace CCZ
+{
+// Streaming codecs of CCZ payloads other than zlib.
+// Work on z_stream buffers and totals and return zlib codes.
+class Decoder
+{
+public:
+	virtual ~Decoder();
+
+	// Starts a new frame
+	virtual int reset(z_stream &zstream) = 0;
+	virtual int decode(z_stream &zstream) = 0;
+};
+
+class Encoder
+{
+public:
+	virtual ~Encoder();
+
+	// Starts a new frame
+	virtual int reset(z_stream &zstream, int level) = 0;
+	// Takes effect from the next frame at the latest
+	virtual int setLevel(int level) = 0;
+	virtual int encode(z_stream &zstream, int flush) = 0;
+};
+
+// Null for zlib and for types this build does not support.
+// Stored payloads end after 'uncompressedSize' bytes.
+std::unique_ptr<Decoder> createDecoder(int type, qint64 uncompressedSize);
+std::unique_ptr<Encoder> createEncoder(int type);
+
+// One-shot payload of exactly 'outSize' bytes with per thread state
+bool decompressPayload(int type, QZBackend *backend, const void *in,
+	size_t inSize, void *out, size_t outSize);
+} // namespace CCZ
@@ -1,9 +1,14 @@
 ﻿#include "QCCZStream.h"
 
+#include "QCCZCodec.h"
 #include "QZStream.h"
 
 #include <QBuffer>
 #include <QDataStream>
+#include <QtEndian>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
 
 static const char CCZ_Signature[] = "CCZ!";
 
@@ -11,23 +16,144 @@ enum
 {
 	CCZ_SIGNATURE_SIZE = sizeof(CCZ_Signature) - 1,
 	CCZ_VERSION = 2,
-	CCZ_COMPRESSION_ZLIB = 0
+	CCZ_VERSION_CHUNKED = 3,
+	CCZ_HEADER_SIZE = 16,
+	CCZ_CHUNKED_HEADER_SIZE = 32
 };
 
 // Format header
 struct CCZHeader
 {
 	char sig[CCZ_SIGNATURE_SIZE]; // signature. Should be 'CCZ!' 4 bytes
-	quint16 compression_type; // should 0 (See above for supported formats)
-	quint16 version; // should be 2
+	quint16 compression_type; // CCZ::CompressionType
+	quint16 version; // should be 2 or 3
 	quint32 reserved; // Reserved for users
-	quint32 len; // size of the uncompressed file
+	quint64 len; // size of the uncompressed file, 32 bit in version 2
 
+	// Version 3 only
+	quint32 chunk_size; // uncompressed size of each chunk but the last
+	quint64 table_offset; // chunk table offset from the start of CCZ data
+
+	inline int size() const;
+
+	void init(quint16 version, quint32 userValue, quint64 len);
+	bool readFrom(const char *data, qint64 size);
 	bool readFrom(QIODevice *device);
+	void writeTo(char *data) const;
+	bool writeTo(QIODevice *device) const;
 };
 
+int CCZHeader::size() const
+{
+	return version == CCZ_VERSION_CHUNKED ? CCZ_CHUNKED_HEADER_SIZE
+										  : CCZ_HEADER_SIZE;
+}
+
+void CCZHeader::init(quint16 version, quint32 userValue, quint64 len)
+{
+	memcpy(sig, CCZ_Signature, CCZ_SIGNATURE_SIZE);
+	compression_type = CCZ::COMPRESSION_ZLIB;
+	this->version = version;
+	reserved = userValue;
+	this->len = len;
+	chunk_size = 0;
+	table_offset = 0;
+}
+
 namespace CCZ
 {
+struct ChunkJob
+{
+	QByteArray input;
+	const Bytef *inputData;
+	qint64 inputSize;
+	QByteArray output;
+	QZBackend *backend;
+	int compressionType;
+	QSemaphore done;
+	bool ok;
+
+	void run();
+};
+
+void ChunkJob::run()
+{
+	ok = CCZ::decompressPayload(compressionType, backend, inputData,
+		size_t(inputSize), output.data(), size_t(output.size()));
+}
+
+class ChunkRunnable : public QRunnable
+{
+public:
+	explicit ChunkRunnable(const std::shared_ptr<ChunkJob> &job)
+		: mJob(job)
+	{
+	}
+
+	virtual void run() override
+	{
+		mJob->run();
+		mJob->done.release();
+	}
+
+private:
+	std::shared_ptr<ChunkJob> mJob;
+};
+
+bool isCompressionSupported(int type)
+{
+	switch (type)
+	{
+		case COMPRESSION_ZLIB:
+		case COMPRESSION_NONE:
+			return true;
+
+#ifdef QZSTREAM_WITH_ZSTD
+		case COMPRESSION_ZSTD:
+			return true;
+#endif
+
+#ifdef QZSTREAM_WITH_LZ4
+		case COMPRESSION_LZ4:
+			return true;
+#endif
+	}
+
+	return false;
+}
+
+QByteArray compressionName(int type)
+{
+	switch (type)
+	{
+		case COMPRESSION_ZLIB:
+			return QByteArrayLiteral("zlib");
+
+		case COMPRESSION_NONE:
+			return QByteArrayLiteral("none");
+
+		case COMPRESSION_ZSTD:
+			return QByteArrayLiteral("zstd");
+
+		case COMPRESSION_LZ4:
+			return QByteArrayLiteral("lz4");
+	}
+
+	return QByteArray();
+}
+
+int compressionType(const QByteArray &name)
+{
+	for (int type : {COMPRESSION_ZLIB, COMPRESSION_NONE, COMPRESSION_ZSTD,
+			 COMPRESSION_LZ4})
+	{
+		if (compressionName(type) == name)
+			return type;
+	}
+
+	return -1;
+}
+
 bool validateHeader(QIODevice *device)
 {
 	if (!device || !device->isReadable())
@@ -40,6 +166,16 @@ bool validateHeader(QIODevice *device)
 
 	return ok;
 }
+
+QZDecompressor *createDecompressor(QIODevice *device, QObject *parent)
+{
+	if (validateHeader(device))
+		return new QCCZDecompressor(device, parent);
+
+	auto decompressor = new QZDecompressor(device, -1, parent);
+	decompressor->setFormat(QZStream::FORMAT_AUTO);
+	return decompressor;
+}
 } // namespace CCZ
 
 QCCZDecompressor::QCCZDecompressor(QObject *parent)
@@ -50,6 +186,11 @@ QCCZDecompressor::QCCZDecompressor(QObject *parent)
 QCCZDecompressor::QCCZDecompressor(QIODevice *source, QObject *parent)
 	: QZDecompressor(source, -1, parent)
 	, mUserValue(0)
+	, mCompressionType(CCZ::COMPRESSION_ZLIB)
+	, mHeaderSize(CCZ_HEADER_SIZE)
+	, mChunkSize(0)
+	, mDataEnd(0)
+	, mFirstJobChunk(0)
 {
 }
 
@@ -63,13 +204,29 @@ void QCCZDecompressor::close()
 	if (!isOpen())
 		return;
 
+	if (isChunked() || isStoredAccess())
+	{
+		clearChunkJobs();
+		mIODevicePosition = mDataEnd;
+	}
+
 	QZDecompressor::close();
 
-	mIODeviceOriginalPosition -= sizeof(CCZHeader);
+	mIODeviceOriginalPosition -= mHeaderSize;
 }
 
 bool QCCZDecompressor::initOpen(OpenMode mode)
 {
+	mChunkSize = 0;
+	mChunks.clear();
+
+	if (format() != FORMAT_ZLIB)
+	{
+		mHasError = true;
+		setErrorString("CCZ data needs zlib format.");
+		return false;
+	}
+
 	if (QZDecompressor::initOpen(mode))
 	{
 		do
@@ -82,11 +239,35 @@ bool QCCZDecompressor::initOpen(OpenMode mode)
 				break;
 
 			mUserValue = header.reserved;
+			mCompressionType = header.compression_type;
+
+			setUncompressedSize(qint64(header.len));
+
+			mHeaderSize = header.size();
+			if (header.version == CCZ_VERSION_CHUNKED)
+			{
+				if (mIODevice->isSequential())
+				{
+					mHasError = true;
+					setErrorString(
+						"CCZ version 3 requires a random access source.");
+					return false;
+				}
+
+				if (!readChunkTable(
+						qint64(header.table_offset), header.chunk_size))
+				{
+					break;
+				}
 
-			setUncompressedSize(header.len);
+				mChunkSize = header.chunk_size;
+				mFirstJobChunk = 0;
+			}
 
-			mIODevicePosition += sizeof(CCZHeader);
+			mIODevicePosition += mHeaderSize;
 			mIODeviceOriginalPosition = mIODevicePosition;
+			if (mChunkSize == 0)
+				mDataEnd = mIODevicePosition + mUncompressedSize;
 
 			return true;
 		} while (true);
@@ -98,6 +279,400 @@ bool QCCZDecompressor::initOpen(OpenMode mode)
 	return false;
 }
 
+qint64 QCCZDecompressor::readData(char *data, qint64 maxlen)
+{
+	if (isStoredAccess())
+		return readStored(data, maxlen);
+
+	if (!isChunked())
+		return QZDecompressor::readData(data, maxlen);
+
+	auto pos = this->pos();
+	qint64 count = 0;
+	while (count < maxlen && pos < mUncompressedSize)
+	{
+		// Chunks have equal uncompressed sizes but the last one
+		auto index = int(pos / mChunkSize);
+		auto job = chunkJob(index);
+		if (!job)
+			break;
+
+		if (!job->ok)
+		{
+			mHasError = true;
+			setErrorString("Bad CCZ chunk.");
+			break;
+		}
+
+		auto offset = pos - mChunks[index].uncompressedOffset;
+		auto len = qMin(maxlen - count, qint64(job->output.size()) - offset);
+		memcpy(data + count, job->output.constData() + offset, size_t(len));
+		count += len;
+		pos += len;
+	}
+
+	if (count == 0 && mHasError)
+		return -1;
+
+	return count;
+}
+
+const char *QCCZDecompressor::storedData() const
+{
+	if (!isOpen() || !isStoredAccess() || !mDirectInput ||
+		mDataEnd > mDirectInputSize)
+	{
+		return nullptr;
+	}
+
+	return reinterpret_cast<const char *>(
+		mDirectInput + mIODeviceOriginalPosition);
+}
+
+bool QCCZDecompressor::isStoredAccess() const
+{
+	// Sequential sources go through the stored decoder
+	return mCompressionType == CCZ::COMPRESSION_NONE && !isChunked() &&
+		!isSequential();
+}
+
+qint64 QCCZDecompressor::readStored(char *data, qint64 maxlen)
+{
+	auto offset = mIODeviceOriginalPosition + pos();
+	auto len = qBound(qint64(0), mDataEnd - offset, maxlen);
+	if (len == 0)
+		return 0;
+
+	if (mDirectInput)
+	{
+		if (offset + len > mDirectInputSize)
+		{
+			mHasError = true;
+			setErrorString("CCZ data is truncated.");
+			return -1;
+		}
+
+		memcpy(data, mDirectInput + offset, size_t(len));
+		mIODevicePosition = offset + len;
+		return len;
+	}
+
+	auto startTime = statisticsTime();
+	if (!mIODevice->seek(offset))
+	{
+		mHasError = true;
+		setErrorString("IO device seek failed.");
+		return -1;
+	}
+
+	auto readBytes = mIODevice->read(data, len);
+	if (mStatisticsEnabled)
+	{
+		countIO(startTime);
+		mStatistics.seekCount++;
+	}
+
+	if (readBytes < 0)
+	{
+		mHasError = true;
+		setErrorString(mIODevice->errorString());
+		return -1;
+	}
+
+	mIODevicePosition = offset + readBytes;
+	return readBytes;
+}
+
+// Returns the table size or -1 when 'table' holds no valid chunk table
+static qint64 parseChunkTable(const char *table, qint64 available,
+	qint64 tableOffset, qint64 len, qint64 chunkSize,
+	std::vector<CCZ::Chunk> &chunks)
+{
+	if (available < qint64(sizeof(quint32)))
+		return -1;
+
+	auto count = qFromBigEndian<quint32>(table);
+	auto tableSize = qint64(sizeof(count)) + qint64(count) * 16;
+	if (qint64(count) != qMax((len + chunkSize - 1) / chunkSize, qint64(1)) ||
+		tableSize > available)
+	{
+		return -1;
+	}
+
+	chunks.clear();
+	chunks.reserve(count + 1);
+	auto entry = table + sizeof(count);
+	for (quint32 i = 0; i < count; i++, entry += 16)
+	{
+		auto compressedOffset = qFromBigEndian<quint64>(entry);
+		auto uncompressedOffset = qFromBigEndian<quint64>(entry + 8);
+
+		if (compressedOffset < CCZ_CHUNKED_HEADER_SIZE ||
+			compressedOffset > quint64(tableOffset) ||
+			uncompressedOffset != quint64(i) * quint64(chunkSize) ||
+			(!chunks.empty() &&
+				compressedOffset <= quint64(chunks.back().compressedOffset)))
+		{
+			return -1;
+		}
+
+		CCZ::Chunk chunk;
+		chunk.compressedOffset = qint64(compressedOffset);
+		chunk.uncompressedOffset = qint64(uncompressedOffset);
+		chunks.push_back(chunk);
+	}
+
+	CCZ::Chunk end;
+	end.compressedOffset = tableOffset;
+	end.uncompressedOffset = len;
+	chunks.push_back(end);
+
+	for (size_t i = 1; i < chunks.size(); i++)
+	{
+		if (chunks[i].compressedOffset - chunks[i - 1].compressedOffset >
+			std::numeric_limits<int>::max())
+		{
+			return -1;
+		}
+	}
+
+	return tableSize;
+}
+
+bool QCCZDecompressor::readChunkTable(qint64 tableOffset, qint64 chunkSize)
+{
+	// Called while positioned at the start of CCZ data
+	auto start = mIODevicePosition;
+	auto available = mIODevice->size() - start - tableOffset;
+
+	if (tableOffset < CCZ_CHUNKED_HEADER_SIZE || available < 0 ||
+		!mIODevice->seek(start + tableOffset))
+	{
+		return false;
+	}
+
+	// Data may continue after the table
+	auto table = mIODevice->read(sizeof(quint32));
+	if (table.size() == int(sizeof(quint32)))
+	{
+		auto tableSize = qint64(sizeof(quint32)) +
+			qint64(qFromBigEndian<quint32>(table.constData())) * 16;
+		if (tableSize > available)
+			return false;
+
+		table.append(mIODevice->read(tableSize - table.size()));
+	}
+
+	std::vector<CCZ::Chunk> chunks;
+	auto tableSize = parseChunkTable(table.constData(), table.size(),
+		tableOffset, mUncompressedSize, chunkSize, chunks);
+	if (tableSize < 0)
+		return false;
+
+	mChunks.swap(chunks);
+	mDataEnd = start + tableOffset + tableSize;
+	return true;
+}
+
+int QCCZDecompressor::decoderInit()
+{
+	if (mCompressionType == CCZ::COMPRESSION_ZLIB)
+		return QZDecompressor::decoderInit();
+
+	mDecoder = CCZ::createDecoder(mCompressionType, mUncompressedSize);
+	if (!mDecoder)
+		return Z_MEM_ERROR;
+
+	return mDecoder->reset(mZStream);
+}
+
+int QCCZDecompressor::decoderReset()
+{
+	if (mDecoder)
+		return mDecoder->reset(mZStream);
+
+	return QZDecompressor::decoderReset();
+}
+
+int QCCZDecompressor::decode(int flush)
+{
+	if (mDecoder)
+		return mDecoder->decode(mZStream);
+
+	return QZDecompressor::decode(flush);
+}
+
+int QCCZDecompressor::decoderEnd()
+{
+	if (mDecoder)
+	{
+		mDecoder.reset();
+		return Z_OK;
+	}
+
+	return QZDecompressor::decoderEnd();
+}
+
+bool QCCZDecompressor::canCheckpoint() const
+{
+	return mCompressionType == CCZ::COMPRESSION_ZLIB;
+}
+
+QByteArray QCCZDecompressor::decompressBytes(
+	const char *data, qint64 size, quint32 *userValue)
+{
+	CCZHeader header;
+	if (size < 0 || !header.readFrom(data, size) ||
+		header.len > quint64(MAX_BYTE_ARRAY_SIZE))
+	{
+		return QByteArray();
+	}
+
+	if (userValue)
+		*userValue = header.reserved;
+
+	auto backend = QZBackend::defaultBackend();
+	QByteArray result(int(header.len), Qt::Uninitialized);
+	if (header.version != CCZ_VERSION_CHUNKED)
+	{
+		auto headerSize = header.size();
+		if (!CCZ::decompressPayload(header.compression_type, backend,
+				data + headerSize, size_t(size - headerSize), result.data(),
+				size_t(result.size())))
+		{
+			return QByteArray();
+		}
+
+		return result;
+	}
+
+	auto tableOffset = qint64(header.table_offset);
+	if (tableOffset < CCZ_CHUNKED_HEADER_SIZE || tableOffset > size)
+		return QByteArray();
+
+	std::vector<CCZ::Chunk> chunks;
+	if (parseChunkTable(data + tableOffset, size - tableOffset, tableOffset,
+			qint64(header.len), header.chunk_size, chunks) < 0)
+	{
+		return QByteArray();
+	}
+
+	for (size_t i = 1; i < chunks.size(); i++)
+	{
+		auto &chunk = chunks[i - 1];
+		auto &next = chunks[i];
+		if (!CCZ::decompressPayload(header.compression_type, backend,
+				data + chunk.compressedOffset,
+				size_t(next.compressedOffset - chunk.compressedOffset),
+				result.data() + chunk.uncompressedOffset,
+				size_t(next.uncompressedOffset - chunk.uncompressedOffset)))
+		{
+			return QByteArray();
+		}
+	}
+
+	return result;
+}
+
+std::shared_ptr<CCZ::ChunkJob> QCCZDecompressor::chunkJob(int index)
+{
+	int jobCount = int(mChunkJobs.size());
+	if (index < mFirstJobChunk || index >= mFirstJobChunk + jobCount)
+	{
+		clearChunkJobs();
+		mFirstJobChunk = index;
+	} else
+	{
+		while (mFirstJobChunk < index)
+		{
+			auto &job = mChunkJobs.front();
+			job->done.acquire();
+			mChunkJobs.pop_front();
+			mFirstJobChunk++;
+		}
+	}
+
+	// Keep the pool busy decoding the chunks that follow
+	int endIndex = qMin(
+		index + qMax(QThreadPool::globalInstance()->maxThreadCount(), 1),
+		chunkCount());
+	while (mFirstJobChunk + int(mChunkJobs.size()) < endIndex)
+	{
+		auto job = startChunkJob(mFirstJobChunk + int(mChunkJobs.size()));
+		if (!job)
+			break;
+
+		mChunkJobs.push_back(job);
+	}
+
+	if (mChunkJobs.empty())
+		return nullptr;
+
+	auto job = mChunkJobs.front();
+	job->done.acquire();
+	job->done.release();
+	return job;
+}
+
+std::shared_ptr<CCZ::ChunkJob> QCCZDecompressor::startChunkJob(int index)
+{
+	auto &chunk = mChunks[index];
+	auto &next = mChunks[index + 1];
+	auto offset =
+		mIODeviceOriginalPosition - mHeaderSize + chunk.compressedOffset;
+
+	std::shared_ptr<CCZ::ChunkJob> job(new CCZ::ChunkJob);
+	job->inputSize = next.compressedOffset - chunk.compressedOffset;
+	job->output.resize(int(next.uncompressedOffset - chunk.uncompressedOffset));
+	job->backend = usedBackend();
+	job->compressionType = mCompressionType;
+	job->ok = false;
+
+	// Chunks are decoded by the thread pool, its time is not counted
+	countCodec(statisticsTime(), job->inputSize, job->output.size());
+
+	if (mDirectInput && offset + job->inputSize <= mDirectInputSize)
+	{
+		job->inputData = mDirectInput + offset;
+	} else
+	{
+		job->input.resize(int(job->inputSize));
+		auto startTime = statisticsTime();
+		bool ok = mIODevice->seek(offset) &&
+			mIODevice->read(job->input.data(), job->inputSize) ==
+				job->inputSize;
+		if (mStatisticsEnabled)
+		{
+			countIO(startTime);
+			mStatistics.seekCount++;
+		}
+
+		if (!ok)
+		{
+			mHasError = true;
+			setErrorString("CCZ chunk read failed.");
+			return nullptr;
+		}
+
+		job->inputData =
+			reinterpret_cast<const Bytef *>(job->input.constData());
+	}
+
+	QThreadPool::globalInstance()->start(new CCZ::ChunkRunnable(job));
+	return job;
+}
+
+void QCCZDecompressor::clearChunkJobs()
+{
+	// Jobs may still read mapped source memory
+	for (auto &job : mChunkJobs)
+	{
+		job->done.acquire();
+	}
+
+	mChunkJobs.clear();
+}
+
 QCCZCompressor::QCCZCompressor(QObject *parent)
 	: QCCZCompressor(nullptr, -1, parent)
 {
@@ -111,6 +686,9 @@ QCCZCompressor::QCCZCompressor(
 	, mTarget(nullptr)
 	, mSavePosition(0)
 	, mUserValue(0)
+	, mCompressionType(CCZ::COMPRESSION_ZLIB)
+	, mChunkSize(0)
+	, mChunkStart(0)
 {
 }
 
@@ -119,6 +697,31 @@ QCCZCompressor::~QCCZCompressor()
 	QCCZCompressor::close();
 }
 
+QByteArray QCCZCompressor::compressBytes(
+	const char *data, qint64 size, int compressionLevel, quint32 userValue)
+{
+	if (size < 0 || size > MAX_BYTE_ARRAY_SIZE)
+		return QByteArray();
+
+	auto backend = QZBackend::defaultBackend();
+	auto bound = backend->compressBlockBound(size_t(size));
+	if (bound > size_t(MAX_BYTE_ARRAY_SIZE - CCZ_HEADER_SIZE))
+		return QByteArray();
+
+	QByteArray result(int(CCZ_HEADER_SIZE + bound), Qt::Uninitialized);
+	auto written = backend->compressBlock(compressionLevel, data,
+		size_t(size), result.data() + CCZ_HEADER_SIZE, bound);
+	if (written == 0)
+		return QByteArray();
+
+	CCZHeader header;
+	header.init(CCZ_VERSION, userValue, quint64(size));
+	header.writeTo(result.data());
+
+	result.resize(int(CCZ_HEADER_SIZE + written));
+	return result;
+}
+
 bool QCCZCompressor::open(OpenMode mode)
 {
 	bool ok = QZCompressor::open(mode);
@@ -140,22 +743,219 @@ bool QCCZCompressor::open(OpenMode mode)
 bool QCCZCompressor::initOpen(OpenMode mode)
 {
 	mTarget = mIODevice;
+	if (format() != FORMAT_ZLIB)
+	{
+		mHasError = true;
+		setErrorString("CCZ data needs zlib format.");
+		return false;
+	}
+
+	if (!CCZ::isCompressionSupported(mCompressionType))
+	{
+		mHasError = true;
+		setErrorString("Unsupported CCZ compression type.");
+		return false;
+	}
+
+	if (!mDictionary.isEmpty() &&
+		mCompressionType != CCZ::COMPRESSION_ZLIB)
+	{
+		mHasError = true;
+		setErrorString("Preset dictionaries need zlib CCZ compression.");
+		return false;
+	}
+
 	if (!QZCompressor::initOpen(mode))
 		return false;
 
-	mBytes = new QByteArray;
-	mCCZBuffer = new QBuffer(mBytes);
-	mIODevice = mCCZBuffer;
 	mSavePosition = mIODeviceOriginalPosition;
-	mIODeviceOriginalPosition = 0;
 
-	bool bufferOpenOk = QZCompressor::initOpen(mode);
-	Q_ASSERT(bufferOpenOk);
-	Q_UNUSED(bufferOpenOk);
+	// Appending targets write at the end whatever the position is,
+	// so close() could not patch a placeholder header
+	bool buffered = mIODevice->isSequential() ||
+		0 != (mIODevice->openMode() & Append) ||
+		!mIODevice->seek(mIODevicePosition);
+	if (buffered)
+	{
+		// Header needs the final sizes, payload is kept until close()
+		mBytes = new QByteArray;
+		mCCZBuffer = new QBuffer(mBytes);
+		mIODevice = mCCZBuffer;
+		mIODeviceOriginalPosition = 0;
+
+		bool bufferOpenOk = QZCompressor::initOpen(mode);
+		Q_ASSERT(bufferOpenOk);
+		Q_UNUSED(bufferOpenOk);
+	} else
+	{
+		// Placeholder header, close() patches it
+		CCZHeader header;
+		header.init(mChunkSize > 0 ? CCZ_VERSION_CHUNKED : CCZ_VERSION,
+			mUserValue, 0);
+		if (!header.writeTo(mIODevice))
+		{
+			mHasError = true;
+			setErrorString("Target stream write failed.");
+			return false;
+		}
+
+		mIODeviceOriginalPosition += header.size();
+		mIODevicePosition = mIODeviceOriginalPosition;
+	}
+
+	mChunkStart = 0;
+	mChunks.clear();
+	if (mChunkSize > 0)
+	{
+		CCZ::Chunk chunk;
+		chunk.compressedOffset = CCZ_CHUNKED_HEADER_SIZE;
+		chunk.uncompressedOffset = 0;
+		mChunks.push_back(chunk);
+	}
+
+	return true;
+}
+
+void QCCZCompressor::setCompressionType(int type)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change compression type of an open stream!");
+		return;
+	}
+
+	mCompressionType = type;
+}
+
+void QCCZCompressor::setChunkSize(int size)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change chunk size of an open stream!");
+		return;
+	}
+
+	mChunkSize = qMax(size, 0);
+}
+
+qint64 QCCZCompressor::size() const
+{
+	return isOpen() ? mChunkStart + totalIn() : 0;
+}
+
+qint64 QCCZCompressor::writeData(const char *data, qint64 maxlen)
+{
+	if (mBytes)
+		reserveBytes(maxlen);
+
+	if (mChunkSize <= 0)
+		return QZCompressor::writeData(data, maxlen);
+
+	qint64 count = 0;
+	while (count < maxlen)
+	{
+		auto chunkLeft = mChunkSize - totalIn();
+		if (chunkLeft == 0)
+		{
+			if (!finishChunk())
+				break;
+
+			continue;
+		}
+
+		auto blockSize = qMin(maxlen - count, chunkLeft);
+		auto written = QZCompressor::writeData(data + count, blockSize);
+		if (written <= 0)
+			break;
+
+		count += written;
+		if (written < blockSize)
+			break;
+	}
+
+	if (count == 0 && mHasError)
+		return -1;
+
+	return count;
+}
+
+int QCCZCompressor::encoderInit()
+{
+	if (mCompressionType == CCZ::COMPRESSION_ZLIB)
+		return QZCompressor::encoderInit();
+
+	mEncoder = CCZ::createEncoder(mCompressionType);
+	if (!mEncoder)
+		return Z_MEM_ERROR;
+
+	return mEncoder->reset(mZStream, mCompressionLevel);
+}
+
+int QCCZCompressor::encoderReset()
+{
+	if (mEncoder)
+		return mEncoder->reset(mZStream, mCompressionLevel);
 
+	return QZCompressor::encoderReset();
+}
+
+int QCCZCompressor::encoderSetLevel()
+{
+	if (mEncoder)
+		return mEncoder->setLevel(mCompressionLevel);
+
+	return QZCompressor::encoderSetLevel();
+}
+
+int QCCZCompressor::encode(int flush)
+{
+	if (mEncoder)
+		return mEncoder->encode(mZStream, flush);
+
+	return QZCompressor::encode(flush);
+}
+
+int QCCZCompressor::encoderEnd()
+{
+	if (mEncoder)
+	{
+		mEncoder.reset();
+		return Z_OK;
+	}
+
+	return QZCompressor::encoderEnd();
+}
+
+bool QCCZCompressor::finishChunk()
+{
+	auto chunkSize = totalIn();
+	if (!finishStream() || !check(encoderReset()))
+		return false;
+
+	mChunkStart += chunkSize;
+
+	CCZ::Chunk chunk;
+	chunk.compressedOffset = CCZ_CHUNKED_HEADER_SIZE +
+		(mIODevicePosition - mIODeviceOriginalPosition);
+	chunk.uncompressedOffset = mChunkStart;
+	mChunks.push_back(chunk);
 	return true;
 }
 
+void QCCZCompressor::reserveBytes(qint64 inputSize)
+{
+	// Compressed output of one write fits without reallocations
+	auto bound = deflateBound(mEncoder ? nullptr : &mZStream,
+		uLong(qMin(inputSize, qint64(MAX_BYTE_ARRAY_SIZE))));
+	auto required = mIODevicePosition + qint64(bound) + BUFFER_SIZE;
+	if (required <= mBytes->capacity() || required > MAX_BYTE_ARRAY_SIZE)
+		return;
+
+	auto grown = qMin(qint64(mBytes->capacity()) * 2,
+		qint64(MAX_BYTE_ARRAY_SIZE));
+	mBytes->reserve(int(qMax(required, grown)));
+}
+
 void QCCZCompressor::close()
 {
 	if (!isOpen())
@@ -166,10 +966,10 @@ void QCCZCompressor::close()
 
 	QZCompressor::close();
 
-	Q_ASSERT(nullptr != mCCZBuffer);
-	Q_ASSERT(nullptr != mBytes);
 	Q_ASSERT(nullptr != mTarget);
+	Q_ASSERT((nullptr != mCCZBuffer) == (nullptr != mBytes));
 
+	auto payloadSize = mIODevicePosition - mIODeviceOriginalPosition;
 	mIODevice = mTarget;
 	mIODevicePosition = mSavePosition;
 	mIODeviceOriginalPosition = mSavePosition;
@@ -178,33 +978,46 @@ void QCCZCompressor::close()
 		bool result = false;
 		do
 		{
-			if (!ioDeviceSeekInit())
+			auto len = mChunkStart + totalIn();
+			if (mChunkSize <= 0 && len > std::numeric_limits<quint32>::max())
+				break;
+
+			CCZHeader header;
+			header.init(mChunkSize > 0 ? CCZ_VERSION_CHUNKED : CCZ_VERSION,
+				mUserValue, quint64(len));
+			header.compression_type = quint16(mCompressionType);
+			header.chunk_size = quint32(mChunkSize);
+			header.table_offset = quint64(header.size() + payloadSize);
+
+			if (!ioDeviceSeekInit() || !header.writeTo(mIODevice))
 				break;
 
-			if (mZStream.total_in > std::numeric_limits<quint32>::max())
+			if (mBytes && mIODevice->write(*mBytes) != mBytes->size())
 				break;
 
+			// Streamed payload is already behind the patched header
+			mIODevicePosition += qint64(header.table_offset);
+			if (!ioDeviceSeekInit())
+				break;
+
+			if (mChunkSize > 0)
 			{
 				QDataStream stream(mIODevice);
 				stream.setByteOrder(QDataStream::BigEndian);
 
-				CCZHeader header;
-				stream.writeRawData(CCZ_Signature, CCZ_SIGNATURE_SIZE);
-				header.compression_type = CCZ_COMPRESSION_ZLIB;
-				stream << header.compression_type;
-				header.version = CCZ_VERSION;
-				stream << header.version;
-				header.reserved = mUserValue;
-				stream << header.reserved;
-				header.len = quint32(mZStream.total_in);
-				stream << header.len;
+				stream << quint32(mChunks.size());
+				for (auto &chunk : mChunks)
+				{
+					stream << quint64(chunk.compressedOffset);
+					stream << quint64(chunk.uncompressedOffset);
+				}
 
 				if (stream.status() != QDataStream::Ok)
 					break;
-			}
 
-			if (mIODevice->write(*mBytes) != mBytes->size())
-				break;
+				mIODevicePosition +=
+					qint64(sizeof(quint32) + mChunks.size() * 16);
+			}
 
 			result = true;
 		} while (false);
@@ -223,25 +1036,94 @@ void QCCZCompressor::close()
 	flushToFile();
 }
 
-bool CCZHeader::readFrom(QIODevice *device)
+bool CCZHeader::readFrom(const char *data, qint64 size)
 {
-	QDataStream stream(device);
-	stream.setByteOrder(QDataStream::BigEndian);
-	stream.readRawData(sig, CCZ_SIGNATURE_SIZE);
+	if (size < CCZ_HEADER_SIZE)
+		return false;
+
+	memcpy(sig, data, CCZ_SIGNATURE_SIZE);
 	if (0 != memcmp(sig, CCZ_Signature, CCZ_SIGNATURE_SIZE))
 		return false;
 
-	stream >> compression_type;
+	compression_type = qFromBigEndian<quint16>(data + 4);
 
-	if (CCZ_COMPRESSION_ZLIB != compression_type)
+	if (!CCZ::isCompressionSupported(compression_type))
 		return false;
 
-	stream >> version;
-	if (CCZ_VERSION != version)
+	version = qFromBigEndian<quint16>(data + 6);
+	if (CCZ_VERSION != version && CCZ_VERSION_CHUNKED != version)
+		return false;
+
+	reserved = qFromBigEndian<quint32>(data + 8);
+
+	if (CCZ_VERSION_CHUNKED == version)
+	{
+		if (size < CCZ_CHUNKED_HEADER_SIZE)
+			return false;
+
+		chunk_size = qFromBigEndian<quint32>(data + 12);
+		len = qFromBigEndian<quint64>(data + 16);
+		table_offset = qFromBigEndian<quint64>(data + 24);
+
+		if (0 == chunk_size ||
+			chunk_size > quint32(std::numeric_limits<int>::max()) ||
+			len > quint64(std::numeric_limits<qint64>::max()) ||
+			table_offset > quint64(std::numeric_limits<qint64>::max()))
+		{
+			return false;
+		}
+	} else
+	{
+		len = qFromBigEndian<quint32>(data + 12);
+		chunk_size = 0;
+		table_offset = 0;
+	}
+
+	return true;
+}
+
+bool CCZHeader::readFrom(QIODevice *device)
+{
+	char data[CCZ_CHUNKED_HEADER_SIZE];
+	if (device->read(data, CCZ_HEADER_SIZE) != CCZ_HEADER_SIZE)
 		return false;
 
-	stream >> reserved;
-	stream >> len;
+	qint64 size = CCZ_HEADER_SIZE;
+	if (qFromBigEndian<quint16>(data + 6) == CCZ_VERSION_CHUNKED)
+	{
+		size = CCZ_CHUNKED_HEADER_SIZE;
+		if (device->read(data + CCZ_HEADER_SIZE, size - CCZ_HEADER_SIZE) !=
+			size - CCZ_HEADER_SIZE)
+		{
+			return false;
+		}
+	}
+
+	return readFrom(data, size);
+}
+
+void CCZHeader::writeTo(char *data) const
+{
+	memcpy(data, sig, CCZ_SIGNATURE_SIZE);
+	qToBigEndian(compression_type, data + 4);
+	qToBigEndian(version, data + 6);
+	qToBigEndian(reserved, data + 8);
+
+	if (CCZ_VERSION_CHUNKED == version)
+	{
+		qToBigEndian(chunk_size, data + 12);
+		qToBigEndian(len, data + 16);
+		qToBigEndian(table_offset, data + 24);
+	} else
+	{
+		qToBigEndian(quint32(len), data + 12);
+	}
+}
+
+bool CCZHeader::writeTo(QIODevice *device) const
+{
+	char data[CCZ_CHUNKED_HEADER_SIZE];
+	writeTo(data);
 
-	return stream.status() == QDataStream::Ok;
+	return device->write(data, size()) == size();
 }
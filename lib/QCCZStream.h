@@ -2,12 +2,48 @@
 
 #include "QZStream.h"
 
+#include <deque>
+#include <memory>
+#include <vector>
+
 class QBuffer;
 
 namespace CCZ
 {
+enum CompressionType
+{
+	COMPRESSION_ZLIB = 0,
+	// Stored payload, for data that is compressed already
+	COMPRESSION_NONE = 3,
+	// Needs QZSTREAM_WITH_ZSTD
+	COMPRESSION_ZSTD = 4,
+	// LZ4 frame, needs QZSTREAM_WITH_LZ4
+	COMPRESSION_LZ4 = 5
+};
+
+bool isCompressionSupported(int type);
+QByteArray compressionName(int type);
+// Returns -1 for unknown names
+int compressionType(const QByteArray &name);
+
 bool validateHeader(QIODevice *device);
-}
+
+// QCCZDecompressor for CCZ data, otherwise QZDecompressor detecting
+// zlib or gzip framing. Peeks at the header of the open 'device'.
+QZDecompressor *createDecompressor(
+	QIODevice *device, QObject *parent = nullptr);
+
+// Version 3 chunk table entry, offsets from the start of CCZ data
+struct Chunk
+{
+	qint64 compressedOffset;
+	qint64 uncompressedOffset;
+};
+
+struct ChunkJob;
+class Decoder;
+class Encoder;
+} // namespace CCZ
 
 class QCCZDecompressor final : public QZDecompressor
 {
@@ -22,12 +58,51 @@ public:
 	virtual void close() override;
 
 	inline quint32 userValue() const;
+	inline int compressionType() const;
+
+	// Version 3 chunked data is decoded by QThreadPool::globalInstance()
+	inline bool isChunked() const;
+	inline int chunkCount() const;
+
+	// Payload of CCZ::COMPRESSION_NONE data in mapped QFileDevice
+	// or QBuffer memory, size() bytes valid until close().
+	// Null when the source cannot be accessed directly.
+	const char *storedData() const;
+
+	// One-shot decoding of version 2 and 3 data, the user value
+	// is stored to 'userValue'. See QZDecompressor::decompressBytes().
+	static QByteArray decompressBytes(
+		const char *data, qint64 size, quint32 *userValue = nullptr);
+	static inline QByteArray decompressBytes(
+		const QByteArray &bytes, quint32 *userValue = nullptr);
 
 protected:
 	virtual bool initOpen(OpenMode mode) override;
+	virtual qint64 readData(char *data, qint64 maxlen) override;
+
+	virtual int decoderInit() override;
+	virtual int decoderReset() override;
+	virtual int decode(int flush) override;
+	virtual int decoderEnd() override;
+	virtual bool canCheckpoint() const override;
 
 private:
+	bool isStoredAccess() const;
+	qint64 readStored(char *data, qint64 maxlen);
+	bool readChunkTable(qint64 tableOffset, qint64 chunkSize);
+	std::shared_ptr<CCZ::ChunkJob> chunkJob(int index);
+	std::shared_ptr<CCZ::ChunkJob> startChunkJob(int index);
+	void clearChunkJobs();
+
 	quint32 mUserValue;
+	int mCompressionType;
+	std::unique_ptr<CCZ::Decoder> mDecoder;
+	int mHeaderSize;
+	qint64 mChunkSize;
+	qint64 mDataEnd;
+	std::vector<CCZ::Chunk> mChunks;
+	std::deque<std::shared_ptr<CCZ::ChunkJob>> mChunkJobs;
+	int mFirstJobChunk;
 };
 
 quint32 QCCZDecompressor::userValue() const
@@ -35,12 +110,36 @@ quint32 QCCZDecompressor::userValue() const
 	return mUserValue;
 }
 
+int QCCZDecompressor::compressionType() const
+{
+	return mCompressionType;
+}
+
+bool QCCZDecompressor::isChunked() const
+{
+	return mChunkSize > 0;
+}
+
+int QCCZDecompressor::chunkCount() const
+{
+	return mChunkSize > 0 ? int(mChunks.size()) - 1 : 0;
+}
+
+QByteArray QCCZDecompressor::decompressBytes(
+	const QByteArray &bytes, quint32 *userValue)
+{
+	return decompressBytes(bytes.constData(), bytes.size(), userValue);
+}
+
 class QCCZCompressor final : public QZCompressor
 {
 	Q_OBJECT
 
 public:
 	explicit QCCZCompressor(QObject *parent = nullptr);
+	// Random access targets get the payload streamed after a
+	// placeholder header that close() patches. Sequential targets
+	// get the whole CCZ data written by close().
 	explicit QCCZCompressor(QIODevice *target, int compressionLevel = -1,
 		QObject *parent = nullptr);
 
@@ -52,16 +151,51 @@ public:
 	inline quint32 userValue() const;
 	inline void setUserValue(quint32 value);
 
+	// CCZ::CompressionType of the payload, can only be changed
+	// while closed. zstd takes compression levels 1 to 22,
+	// LZ4 takes 0 to 2 for fast and 3 to 12 for LZ4-HC.
+	inline int compressionType() const;
+	void setCompressionType(int type);
+
+	// Uncompressed size of independently deflated chunks.
+	// Non zero writes CCZ version 3 with a chunk table
+	// and 64 bit sizes. Can only be changed while closed.
+	inline int chunkSize() const;
+	void setChunkSize(int size);
+
+	// One-shot version 2 data, see QZCompressor::compressBytes()
+	static QByteArray compressBytes(const char *data, qint64 size,
+		int compressionLevel = Z_DEFAULT_COMPRESSION, quint32 userValue = 0);
+	static inline QByteArray compressBytes(const QByteArray &bytes,
+		int compressionLevel = Z_DEFAULT_COMPRESSION, quint32 userValue = 0);
+
+	virtual qint64 size() const override;
+
 protected:
 	virtual bool initOpen(OpenMode mode) override;
+	virtual qint64 writeData(const char *data, qint64 maxlen) override;
+
+	virtual int encoderInit() override;
+	virtual int encoderReset() override;
+	virtual int encoderSetLevel() override;
+	virtual int encode(int flush) override;
+	virtual int encoderEnd() override;
 
 private:
+	bool finishChunk();
+	void reserveBytes(qint64 inputSize);
+
 	QByteArray *mBytes;
 	QBuffer *mCCZBuffer;
 	QIODevice *mTarget;
 
 	qint64 mSavePosition;
 	quint32 mUserValue;
+	int mCompressionType;
+	std::unique_ptr<CCZ::Encoder> mEncoder;
+	int mChunkSize;
+	qint64 mChunkStart;
+	std::vector<CCZ::Chunk> mChunks;
 };
 
 quint32 QCCZCompressor::userValue() const
@@ -73,3 +207,20 @@ void QCCZCompressor::setUserValue(quint32 value)
 {
 	mUserValue = value;
 }
+
+int QCCZCompressor::compressionType() const
+{
+	return mCompressionType;
+}
+
+QByteArray QCCZCompressor::compressBytes(
+	const QByteArray &bytes, int compressionLevel, quint32 userValue)
+{
+	return compressBytes(
+		bytes.constData(), bytes.size(), compressionLevel, userValue);
+}
+
+int QCCZCompressor::chunkSize() const
+{
+	return mChunkSize;
+}
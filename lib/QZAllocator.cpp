@@ -0,0 +1,218 @@
+﻿#include "QZAllocator.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace
+{
+enum
+{
+	// Keeps blocks returned to zlib aligned for any type
+	ZALLOC_HEADER_SIZE = 16,
+
+	POOL_MAX_SIZE_CLASSES = 32,
+	POOL_MAX_BLOCKS_PER_SIZE = 16,
+	POOL_MAX_BYTES = 16 * 1024 * 1024
+};
+
+class HeapAllocator : public QZAllocator
+{
+public:
+	virtual void *allocate(size_t size) override
+	{
+		return malloc(size);
+	}
+
+	virtual void deallocate(void *ptr, size_t) override
+	{
+		free(ptr);
+	}
+};
+
+class ThreadPool
+{
+public:
+	ThreadPool()
+		: mBytes(0)
+	{
+	}
+
+	~ThreadPool()
+	{
+		for (auto &sizeClass : mSizeClasses)
+		{
+			for (auto ptr : sizeClass.blocks)
+				free(ptr);
+		}
+	}
+
+	void *take(size_t size)
+	{
+		auto sizeClass = find(size);
+		if (!sizeClass || sizeClass->blocks.empty())
+			return nullptr;
+
+		auto ptr = sizeClass->blocks.back();
+		sizeClass->blocks.pop_back();
+		mBytes -= size;
+		return ptr;
+	}
+
+	bool put(void *ptr, size_t size)
+	{
+		if (size > POOL_MAX_BYTES - mBytes)
+			return false;
+
+		auto sizeClass = find(size);
+		if (!sizeClass)
+		{
+			if (mSizeClasses.size() >= POOL_MAX_SIZE_CLASSES)
+				return false;
+
+			mSizeClasses.push_back(SizeClass());
+			sizeClass = &mSizeClasses.back();
+			sizeClass->size = size;
+			sizeClass->blocks.reserve(POOL_MAX_BLOCKS_PER_SIZE);
+		}
+
+		if (sizeClass->blocks.size() >= POOL_MAX_BLOCKS_PER_SIZE)
+			return false;
+
+		sizeClass->blocks.push_back(ptr);
+		mBytes += size;
+		return true;
+	}
+
+private:
+	struct SizeClass
+	{
+		size_t size;
+		std::vector<void *> blocks;
+	};
+
+	SizeClass *find(size_t size)
+	{
+		for (auto &sizeClass : mSizeClasses)
+		{
+			if (sizeClass.size == size)
+				return &sizeClass;
+		}
+
+		return nullptr;
+	}
+
+	std::vector<SizeClass> mSizeClasses;
+	size_t mBytes;
+};
+
+thread_local bool tPoolDestroyed = false;
+
+struct ThreadPoolHolder
+{
+	ThreadPool pool;
+
+	~ThreadPoolHolder()
+	{
+		tPoolDestroyed = true;
+	}
+};
+
+ThreadPool *threadPool()
+{
+	// Blocks released during thread shutdown go straight to the heap
+	if (tPoolDestroyed)
+		return nullptr;
+
+	thread_local ThreadPoolHolder holder;
+	return &holder.pool;
+}
+
+class ThreadPoolAllocator : public QZAllocator
+{
+public:
+	virtual void *allocate(size_t size) override
+	{
+		auto pool = threadPool();
+		void *ptr = pool ? pool->take(size) : nullptr;
+		if (!ptr)
+			ptr = malloc(size);
+
+		return ptr;
+	}
+
+	virtual void deallocate(void *ptr, size_t size) override
+	{
+		if (!ptr)
+			return;
+
+		auto pool = threadPool();
+		if (!pool || !pool->put(ptr, size))
+			free(ptr);
+	}
+};
+
+HeapAllocator heapAllocatorInstance;
+ThreadPoolAllocator threadPoolAllocatorInstance;
+std::atomic<QZAllocator *> defaultAllocatorInstance(&heapAllocatorInstance);
+} // namespace
+
+QZAllocator::~QZAllocator()
+{
+}
+
+QZAllocator *QZAllocator::defaultAllocator()
+{
+	return defaultAllocatorInstance.load();
+}
+
+void QZAllocator::setDefaultAllocator(QZAllocator *allocator)
+{
+	defaultAllocatorInstance.store(
+		allocator ? allocator : &heapAllocatorInstance);
+}
+
+QZAllocator *QZAllocator::heapAllocator()
+{
+	return &heapAllocatorInstance;
+}
+
+QZAllocator *QZAllocator::threadPoolAllocator()
+{
+	return &threadPoolAllocatorInstance;
+}
+
+void *QZAllocator::zalloc(void *opaque, unsigned items, unsigned size)
+{
+	auto allocator = static_cast<QZAllocator *>(opaque);
+
+	if (size != 0 &&
+		items > (std::numeric_limits<size_t>::max() - ZALLOC_HEADER_SIZE) /
+				size)
+	{
+		return nullptr;
+	}
+
+	// zfree does not get the block size, keep it in front of the block
+	size_t total = size_t(items) * size + ZALLOC_HEADER_SIZE;
+	auto block = static_cast<char *>(allocator->allocate(total));
+	if (!block)
+		return nullptr;
+
+	memcpy(block, &total, sizeof(total));
+	return block + ZALLOC_HEADER_SIZE;
+}
+
+void QZAllocator::zfree(void *opaque, void *ptr)
+{
+	if (!ptr)
+		return;
+
+	auto block = static_cast<char *>(ptr) - ZALLOC_HEADER_SIZE;
+	size_t total;
+	memcpy(&total, block, sizeof(total));
+
+	static_cast<QZAllocator *>(opaque)->deallocate(block, total);
+}
@@ -0,0 +1,120 @@
+﻿#pragma once
+
+#include <cstddef>
+
+// Memory source for zlib state and stream I/O buffers.
+// Implementations must be thread safe, a block may be released
+// from another thread than the one that allocated it.
+class QZAllocator
+{
+public:
+	virtual ~QZAllocator();
+
+	virtual void *allocate(size_t size) = 0;
+	virtual void deallocate(void *ptr, size_t size) = 0;
+
+	// Used by streams with no allocator of their own.
+	// Null restores the heap allocator.
+	static QZAllocator *defaultAllocator();
+	static void setDefaultAllocator(QZAllocator *allocator);
+
+	// Plain malloc/free.
+	static QZAllocator *heapAllocator();
+
+	// Keeps released blocks in per-thread free lists of exact sizes,
+	// so reopening streams reuses the inflate/deflate state blocks
+	// and buffers of previously closed ones.
+	static QZAllocator *threadPoolAllocator();
+
+	// zalloc/zfree callbacks, 'opaque' is a QZAllocator.
+	static void *zalloc(void *opaque, unsigned items, unsigned size);
+	static void zfree(void *opaque, void *ptr);
+};
+
+template <typename T>
+class QZAllocatedArray
+{
+public:
+	inline QZAllocatedArray();
+	inline ~QZAllocatedArray();
+
+	QZAllocatedArray(const QZAllocatedArray &) = delete;
+	QZAllocatedArray &operator=(const QZAllocatedArray &) = delete;
+
+	// Keeps the current block when both allocator and size match.
+	// Returns false when allocation failed.
+	bool reset(QZAllocator *allocator = nullptr, size_t size = 0);
+
+	inline T *get() const;
+	inline T &operator[](size_t index) const;
+	inline size_t size() const;
+	inline QZAllocator *allocator() const;
+
+private:
+	T *mData;
+	size_t mSize;
+	QZAllocator *mAllocator;
+};
+
+template <typename T>
+QZAllocatedArray<T>::QZAllocatedArray()
+	: mData(nullptr)
+	, mSize(0)
+	, mAllocator(nullptr)
+{
+}
+
+template <typename T>
+QZAllocatedArray<T>::~QZAllocatedArray()
+{
+	reset();
+}
+
+template <typename T>
+bool QZAllocatedArray<T>::reset(QZAllocator *allocator, size_t size)
+{
+	if (allocator == mAllocator && size == mSize)
+		return true;
+
+	if (mData)
+		mAllocator->deallocate(mData, mSize * sizeof(T));
+
+	mData = nullptr;
+	mSize = 0;
+	mAllocator = nullptr;
+
+	if (!allocator || size == 0)
+		return true;
+
+	mData = static_cast<T *>(allocator->allocate(size * sizeof(T)));
+	if (!mData)
+		return false;
+
+	mSize = size;
+	mAllocator = allocator;
+	return true;
+}
+
+template <typename T>
+T *QZAllocatedArray<T>::get() const
+{
+	return mData;
+}
+
+template <typename T>
+T &QZAllocatedArray<T>::operator[](size_t index) const
+{
+	return mData[index];
+}
+
+template <typename T>
+size_t QZAllocatedArray<T>::size() const
+{
+	return mSize;
+}
+
+template <typename T>
+QZAllocator *QZAllocatedArray<T>::allocator() const
+{
+	return mAllocator;
+}
@@ -0,0 +1,428 @@
+﻿#include "QZBackend.h"
+#include "QZDictionary.h"
+
+#include <zlib.h>
+
+#ifdef QZSTREAM_WITH_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include <atomic>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+int nextBlockCapacity(int capacity, size_t inSize, int maxSize)
+{
+	if (capacity == 0)
+	{
+		return int(qBound(
+			qint64(4096), qint64(inSize) * 4, qint64(maxSize)));
+	}
+
+	return int(qMin(qint64(capacity) * 2, qint64(maxSize)));
+}
+
+// Streams of a preset dictionary get the registered one
+int inflateFinish(z_stream *stream)
+{
+	int code = inflate(stream, Z_FINISH);
+	if (code != Z_NEED_DICT)
+		return code;
+
+	if (QZDictionary::supplyInflateDictionary(stream) != Z_OK)
+		return Z_DATA_ERROR;
+
+	return inflate(stream, Z_FINISH);
+}
+
+class ZlibBackend : public QZBackend
+{
+public:
+	virtual QByteArray name() const override
+	{
+#ifdef ZLIBNG_VERSION
+		return QByteArrayLiteral("zlib-ng");
+#else
+		return QByteArrayLiteral("zlib");
+#endif
+	}
+
+	virtual size_t compressBlockBound(size_t size) const override
+	{
+		return size_t(compressBound(uLong(size)));
+	}
+
+	virtual size_t compressBlock(int level, const void *in, size_t inSize,
+		void *out, size_t outCapacity) override;
+
+	virtual bool decompressBlock(
+		const void *in, size_t inSize, void *out, size_t outSize) override;
+
+	virtual bool decompressBlock(
+		const void *in, size_t inSize, QByteArray &out, int maxSize) override;
+};
+
+// Streams are reset instead of reinitialized between blocks
+struct ZlibThreadState
+{
+	z_stream deflateStream;
+	z_stream inflateStream;
+	int deflateLevel;
+	bool deflateReady;
+	bool inflateReady;
+
+	ZlibThreadState()
+		: deflateLevel(Z_DEFAULT_COMPRESSION)
+		, deflateReady(false)
+		, inflateReady(false)
+	{
+		memset(&deflateStream, 0, sizeof(deflateStream));
+		memset(&inflateStream, 0, sizeof(inflateStream));
+	}
+
+	~ZlibThreadState()
+	{
+		if (deflateReady)
+			deflateEnd(&deflateStream);
+
+		if (inflateReady)
+			inflateEnd(&inflateStream);
+	}
+
+	z_stream *deflater(int level)
+	{
+		if (!deflateReady)
+		{
+			deflateReady = deflateInit(&deflateStream, level) == Z_OK;
+			deflateLevel = level;
+			return deflateReady ? &deflateStream : nullptr;
+		}
+
+		if (deflateReset(&deflateStream) != Z_OK)
+			return nullptr;
+
+		if (level != deflateLevel)
+		{
+			if (deflateParams(&deflateStream, level, Z_DEFAULT_STRATEGY) !=
+				Z_OK)
+			{
+				return nullptr;
+			}
+
+			deflateLevel = level;
+		}
+
+		return &deflateStream;
+	}
+
+	z_stream *inflater()
+	{
+		if (!inflateReady)
+		{
+			inflateReady = inflateInit(&inflateStream) == Z_OK;
+			return inflateReady ? &inflateStream : nullptr;
+		}
+
+		if (inflateReset(&inflateStream) != Z_OK)
+			return nullptr;
+
+		return &inflateStream;
+	}
+
+	static ZlibThreadState &instance()
+	{
+		thread_local ZlibThreadState state;
+		return state;
+	}
+};
+
+size_t ZlibBackend::compressBlock(
+	int level, const void *in, size_t inSize, void *out, size_t outCapacity)
+{
+	if (inSize > std::numeric_limits<uInt>::max())
+		return 0;
+
+	auto stream = ZlibThreadState::instance().deflater(level);
+	if (!stream)
+		return 0;
+
+	stream->next_in = static_cast<const Bytef *>(in);
+	stream->avail_in = uInt(inSize);
+	stream->next_out = static_cast<Bytef *>(out);
+	stream->avail_out =
+		uInt(qMin(outCapacity, size_t(std::numeric_limits<uInt>::max())));
+
+	if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+		return 0;
+
+	return size_t(stream->total_out);
+}
+
+bool ZlibBackend::decompressBlock(
+	const void *in, size_t inSize, void *out, size_t outSize)
+{
+	if (inSize > std::numeric_limits<uInt>::max() ||
+		outSize > std::numeric_limits<uInt>::max())
+	{
+		return false;
+	}
+
+	auto stream = ZlibThreadState::instance().inflater();
+	if (!stream)
+		return false;
+
+	stream->next_in = static_cast<const Bytef *>(in);
+	stream->avail_in = uInt(inSize);
+	stream->next_out = static_cast<Bytef *>(out);
+	stream->avail_out = uInt(outSize);
+
+	return inflateFinish(stream) == Z_STREAM_END &&
+		stream->avail_out == 0;
+}
+
+bool ZlibBackend::decompressBlock(
+	const void *in, size_t inSize, QByteArray &out, int maxSize)
+{
+	if (inSize > std::numeric_limits<uInt>::max())
+		return false;
+
+	auto stream = ZlibThreadState::instance().inflater();
+	if (!stream)
+		return false;
+
+	stream->next_in = static_cast<const Bytef *>(in);
+	stream->avail_in = uInt(inSize);
+
+	int capacity = 0;
+	while (true)
+	{
+		int newCapacity = nextBlockCapacity(capacity, inSize, maxSize);
+		if (newCapacity <= capacity)
+			return false;
+
+		out.resize(newCapacity);
+		stream->next_out = reinterpret_cast<Bytef *>(out.data()) + capacity;
+		stream->avail_out = uInt(newCapacity - capacity);
+		capacity = newCapacity;
+
+		int code = inflateFinish(stream);
+		if (code == Z_STREAM_END)
+			break;
+
+		// Output buffer is full and the stream is not finished
+		if ((code != Z_OK && code != Z_BUF_ERROR) || stream->avail_out != 0)
+			return false;
+	}
+
+	out.resize(int(stream->total_out));
+	return true;
+}
+
+#ifdef QZSTREAM_WITH_LIBDEFLATE
+class LibdeflateBackend : public QZBackend
+{
+public:
+	virtual QByteArray name() const override
+	{
+		return QByteArrayLiteral("libdeflate");
+	}
+
+	virtual size_t compressBlockBound(size_t size) const override
+	{
+		return libdeflate_zlib_compress_bound(nullptr, size);
+	}
+
+	virtual size_t compressBlock(int level, const void *in, size_t inSize,
+		void *out, size_t outCapacity) override;
+
+	virtual bool decompressBlock(
+		const void *in, size_t inSize, void *out, size_t outSize) override;
+
+	virtual bool decompressBlock(
+		const void *in, size_t inSize, QByteArray &out, int maxSize) override;
+};
+
+// FDICT flag of the zlib header
+bool hasPresetDictionary(const void *in, size_t inSize)
+{
+	return inSize >= 2 && (static_cast<const uchar *>(in)[1] & 0x20) != 0;
+}
+
+struct LibdeflateThreadState
+{
+	enum
+	{
+		LEVEL_COUNT = Z_BEST_COMPRESSION + 1
+	};
+
+	libdeflate_compressor *compressors[LEVEL_COUNT];
+	libdeflate_decompressor *decompressor;
+
+	LibdeflateThreadState()
+		: decompressor(nullptr)
+	{
+		memset(compressors, 0, sizeof(compressors));
+	}
+
+	~LibdeflateThreadState()
+	{
+		for (auto compressor : compressors)
+		{
+			if (compressor)
+				libdeflate_free_compressor(compressor);
+		}
+
+		if (decompressor)
+			libdeflate_free_decompressor(decompressor);
+	}
+
+	libdeflate_compressor *compressor(int level)
+	{
+		if (level < 0 || level >= LEVEL_COUNT)
+			level = 6;
+
+		auto &compressor = compressors[level];
+		if (!compressor)
+			compressor = libdeflate_alloc_compressor(level);
+
+		return compressor;
+	}
+
+	libdeflate_decompressor *sharedDecompressor()
+	{
+		if (!decompressor)
+			decompressor = libdeflate_alloc_decompressor();
+
+		return decompressor;
+	}
+
+	static LibdeflateThreadState &instance()
+	{
+		thread_local LibdeflateThreadState state;
+		return state;
+	}
+};
+
+size_t LibdeflateBackend::compressBlock(
+	int level, const void *in, size_t inSize, void *out, size_t outCapacity)
+{
+	auto compressor = LibdeflateThreadState::instance().compressor(level);
+	if (!compressor)
+		return 0;
+
+	return libdeflate_zlib_compress(compressor, in, inSize, out, outCapacity);
+}
+
+bool LibdeflateBackend::decompressBlock(
+	const void *in, size_t inSize, void *out, size_t outSize)
+{
+	// libdeflate has no preset dictionaries
+	if (hasPresetDictionary(in, inSize))
+		return QZBackend::zlib()->decompressBlock(in, inSize, out, outSize);
+
+	auto decompressor =
+		LibdeflateThreadState::instance().sharedDecompressor();
+	if (!decompressor)
+		return false;
+
+	// Null actual size requires the output to be filled exactly
+	return libdeflate_zlib_decompress(
+			   decompressor, in, inSize, out, outSize, nullptr) ==
+		LIBDEFLATE_SUCCESS;
+}
+
+bool LibdeflateBackend::decompressBlock(
+	const void *in, size_t inSize, QByteArray &out, int maxSize)
+{
+	if (hasPresetDictionary(in, inSize))
+		return QZBackend::zlib()->decompressBlock(in, inSize, out, maxSize);
+
+	auto decompressor =
+		LibdeflateThreadState::instance().sharedDecompressor();
+	if (!decompressor)
+		return false;
+
+	// libdeflate cannot resume, each retry decodes from the start
+	int capacity = 0;
+	while (true)
+	{
+		int newCapacity = nextBlockCapacity(capacity, inSize, maxSize);
+		if (newCapacity <= capacity)
+			return false;
+
+		capacity = newCapacity;
+		out.resize(capacity);
+
+		size_t size;
+		auto result = libdeflate_zlib_decompress(decompressor, in, inSize,
+			out.data(), size_t(capacity), &size);
+
+		if (result == LIBDEFLATE_SUCCESS)
+		{
+			out.resize(int(size));
+			return true;
+		}
+
+		if (result != LIBDEFLATE_INSUFFICIENT_SPACE)
+			return false;
+	}
+}
+
+LibdeflateBackend libdeflateBackendInstance;
+#endif
+
+ZlibBackend zlibBackendInstance;
+std::atomic<QZBackend *> defaultBackendInstance(&zlibBackendInstance);
+} // namespace
+
+QZBackend::~QZBackend()
+{
+}
+
+QZBackend *QZBackend::zlib()
+{
+	return &zlibBackendInstance;
+}
+
+QZBackend *QZBackend::libdeflate()
+{
+#ifdef QZSTREAM_WITH_LIBDEFLATE
+	return &libdeflateBackendInstance;
+#else
+	return nullptr;
+#endif
+}
+
+QList<QZBackend *> QZBackend::availableBackends()
+{
+	QList<QZBackend *> result;
+	result.append(zlib());
+
+	if (libdeflate())
+		result.append(libdeflate());
+
+	return result;
+}
+
+QZBackend *QZBackend::findBackend(const QByteArray &name)
+{
+	for (auto backend : availableBackends())
+	{
+		if (backend->name() == name)
+			return backend;
+	}
+
+	return nullptr;
+}
+
+QZBackend *QZBackend::defaultBackend()
+{
+	return defaultBackendInstance.load();
+}
+
+void QZBackend::setDefaultBackend(QZBackend *backend)
+{
+	defaultBackendInstance.store(backend ? backend : &zlibBackendInstance);
+}
@@ -0,0 +1,49 @@
+﻿#pragma once
+
+#include <QByteArray>
+#include <QList>
+
+#include <cstddef>
+
+// Whole buffer codec producing and reading zlib format data.
+// Used by compressBytes(), decompressBytes() and chunked CCZ.
+// Deflate and inflate streams always run on zlib.
+// Streams written by one backend are readable by any other.
+// Backends keep their codec state per thread. Streams of a preset
+// dictionary are decoded with the one registered in QZDictionary.
+class QZBackend
+{
+public:
+	virtual ~QZBackend();
+
+	virtual QByteArray name() const = 0;
+
+	virtual size_t compressBlockBound(size_t size) const = 0;
+
+	// Returns compressed size or zero when 'outCapacity' is too small
+	virtual size_t compressBlock(int level, const void *in, size_t inSize,
+		void *out, size_t outCapacity) = 0;
+
+	// Succeeds only when the stream decodes to exactly 'outSize' bytes
+	virtual bool decompressBlock(
+		const void *in, size_t inSize, void *out, size_t outSize) = 0;
+
+	// Decodes a stream of unknown size into 'out',
+	// growing it up to 'maxSize' bytes
+	virtual bool decompressBlock(
+		const void *in, size_t inSize, QByteArray &out, int maxSize) = 0;
+
+	// zlib, or zlib-ng when built against its zlib compatible library
+	static QZBackend *zlib();
+
+	// Null unless built with QZSTREAM_WITH_LIBDEFLATE
+	static QZBackend *libdeflate();
+
+	static QList<QZBackend *> availableBackends();
+	static QZBackend *findBackend(const QByteArray &name);
+
+	// Used by streams with no backend of their own.
+	// Null restores the zlib backend.
+	static QZBackend *defaultBackend();
+	static void setDefaultBackend(QZBackend *backend);
+};
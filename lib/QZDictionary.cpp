@@ -0,0 +1,211 @@
+﻿#include "QZDictionary.h"
+
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <cstring>
+#include <limits>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+enum
+{
+	// Shortest string worth a reference is 8 bytes for the trainer
+	GRAM_SIZE = 8,
+	SEGMENT_SIZE = 64,
+	SEGMENT_STEP = 16
+};
+
+struct Registry
+{
+	QMutex mutex;
+	std::unordered_map<quint32, QByteArray> dictionaries;
+
+	static Registry &instance()
+	{
+		static Registry registry;
+		return registry;
+	}
+};
+
+struct GramInfo
+{
+	// Index of the last counted sample plus one
+	int lastSample;
+	int sampleCount;
+};
+
+using GramMap = std::unordered_map<quint64, GramInfo>;
+
+struct Segment
+{
+	const char *data;
+	int size;
+	qint64 score;
+
+	bool operator<(const Segment &other) const
+	{
+		return score < other.score;
+	}
+};
+
+quint64 gramAt(const char *data)
+{
+	quint64 gram;
+	memcpy(&gram, data, GRAM_SIZE);
+	return gram;
+}
+
+// Only strings of several samples are worth having in the dictionary
+qint64 segmentScore(const Segment &segment, const GramMap &grams)
+{
+	qint64 score = 0;
+	for (int i = 0; i + GRAM_SIZE <= segment.size; i++)
+	{
+		int count = grams.find(gramAt(segment.data + i))->second.sampleCount;
+		if (count > 1)
+			score += count;
+	}
+
+	return score;
+}
+} // namespace
+
+quint32 QZDictionary::idOf(const QByteArray &dictionary)
+{
+	return quint32(adler32(adler32(0, Z_NULL, 0),
+		reinterpret_cast<const Bytef *>(dictionary.constData()),
+		uInt(dictionary.size())));
+}
+
+quint32 QZDictionary::registerDictionary(const QByteArray &dictionary)
+{
+	auto id = idOf(dictionary);
+
+	auto &registry = Registry::instance();
+	QMutexLocker locker(&registry.mutex);
+	registry.dictionaries[id] = dictionary;
+	return id;
+}
+
+void QZDictionary::unregisterDictionary(quint32 id)
+{
+	auto &registry = Registry::instance();
+	QMutexLocker locker(&registry.mutex);
+	registry.dictionaries.erase(id);
+}
+
+QByteArray QZDictionary::find(quint32 id)
+{
+	auto &registry = Registry::instance();
+	QMutexLocker locker(&registry.mutex);
+	auto it = registry.dictionaries.find(id);
+	if (it == registry.dictionaries.end())
+		return QByteArray();
+
+	return it->second;
+}
+
+int QZDictionary::supplyInflateDictionary(
+	z_stream *stream, const QByteArray &dictionary)
+{
+	auto bytes = dictionary.isEmpty() ? find(quint32(stream->adler))
+									  : dictionary;
+	if (bytes.isEmpty())
+		return Z_NEED_DICT;
+
+	// Fails with Z_DATA_ERROR when the id does not match
+	return inflateSetDictionary(stream,
+		reinterpret_cast<const Bytef *>(bytes.constData()),
+		uInt(bytes.size()));
+}
+
+QByteArray QZDictionary::train(const QList<QByteArray> &samples, int maxSize)
+{
+	if (samples.size() < 2 || maxSize <= 0)
+		return QByteArray();
+
+	GramMap grams;
+	std::priority_queue<Segment> segments;
+
+	for (int i = 0; i < samples.size(); i++)
+	{
+		auto &sample = samples.at(i);
+		auto data = sample.constData();
+		int size = sample.size();
+
+		for (int j = 0; j + GRAM_SIZE <= size; j++)
+		{
+			auto &info = grams[gramAt(data + j)];
+			if (info.lastSample != i + 1)
+			{
+				info.lastSample = i + 1;
+				info.sampleCount++;
+			}
+		}
+
+		for (int j = 0; j + GRAM_SIZE <= size; j += SEGMENT_STEP)
+		{
+			Segment segment;
+			segment.data = data + j;
+			segment.size = qMin(int(SEGMENT_SIZE), size - j);
+			segment.score = std::numeric_limits<qint64>::max();
+			segments.push(segment);
+		}
+	}
+
+	// Greedy cover: scores only drop as grams get taken, so a segment
+	// that keeps its score after rescoring is the best one left
+	std::vector<QByteArray> picked;
+	int pickedSize = 0;
+	while (!segments.empty() && pickedSize < maxSize)
+	{
+		auto segment = segments.top();
+		segments.pop();
+
+		auto score = segmentScore(segment, grams);
+		if (score == 0)
+			continue;
+
+		if (score < segment.score)
+		{
+			segment.score = score;
+			segments.push(segment);
+			continue;
+		}
+
+		// Overlapping segments add only the strings not taken yet
+		int first = -1;
+		int last = 0;
+		for (int i = 0; i + GRAM_SIZE <= segment.size; i++)
+		{
+			auto &info = grams[gramAt(segment.data + i)];
+			if (info.sampleCount > 1)
+			{
+				if (first < 0)
+					first = i;
+
+				last = i;
+			}
+
+			info.sampleCount = 0;
+		}
+
+		int size = qMin(last + GRAM_SIZE - first, maxSize - pickedSize);
+		picked.emplace_back(segment.data + first, size);
+		pickedSize += size;
+	}
+
+	// Nearer strings get shorter distance codes
+	QByteArray result;
+	result.reserve(pickedSize);
+	for (auto it = picked.rbegin(); it != picked.rend(); ++it)
+	{
+		result.append(*it);
+	}
+
+	return result;
+}
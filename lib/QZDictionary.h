@@ -0,0 +1,33 @@
+﻿#pragma once
+
+#include <QByteArray>
+#include <QList>
+
+#include <zlib.h>
+
+// Preset dictionaries of zlib streams. A stream compressed with
+// a dictionary records its Adler-32 in the header, decompressors
+// look up a registered dictionary by that id.
+class QZDictionary
+{
+public:
+	static quint32 idOf(const QByteArray &dictionary);
+
+	// Thread safe registry. Returns id of the dictionary.
+	static quint32 registerDictionary(const QByteArray &dictionary);
+	static void unregisterDictionary(quint32 id);
+	// Null array when no dictionary has this id
+	static QByteArray find(quint32 id);
+
+	// Answers Z_NEED_DICT of 'stream' with 'dictionary' or,
+	// when it is empty, with the registered one of the requested id.
+	// Returns Z_NEED_DICT when there is no such dictionary.
+	static int supplyInflateDictionary(
+		z_stream *stream, const QByteArray &dictionary = QByteArray());
+
+	// Builds a dictionary of at most 'maxSize' bytes from strings
+	// shared by several samples, the most common ones at the end.
+	// Empty when the samples have nothing in common.
+	static QByteArray train(
+		const QList<QByteArray> &samples, int maxSize = 32768);
+};
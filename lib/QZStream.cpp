@@ -1,15 +1,173 @@
 ﻿#include "QZStream.h"
 #include <QFileDevice>
+#include <QBuffer>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThread>
+#include <QThreadPool>
+#include <QTimer>
+#include <QWaitCondition>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+
+static const char QZ_IndexSignature[] = "QZI!";
+
+enum
+{
+	QZ_INDEX_SIGNATURE_SIZE = sizeof(QZ_IndexSignature) - 1,
+	QZ_INDEX_VERSION = 2,
+	// Compressed bytes at both ends checksummed for the index
+	QZ_FINGERPRINT_SIZE = 4096,
+	QZ_READ_AHEAD_BLOCK_SIZE = 65536,
+	// deflateInit() memory level
+	QZ_DEFAULT_MEM_LEVEL = 8,
+	// Input between compression level adjustments
+	QZ_ADAPTIVE_INTERVAL = 1024 * 1024,
+	// Approximate zlib state besides windows and hash tables
+	QZ_DEFLATE_STATE_SIZE = 6 * 1024,
+	QZ_INFLATE_STATE_SIZE = 7 * 1024,
+	QZ_MIN_BUFFER_SIZE = 4096
+};
+
+static std::atomic<qint64> QZ_TotalMemoryFootprint(0);
+
+// windowBits argument of inflateInit2() and deflateInit2()
+static int QZ_FormatWindowBits(int windowBits, int format)
+{
+	switch (format)
+	{
+		case QZStream::FORMAT_GZIP:
+			return windowBits + 16;
+
+		case QZStream::FORMAT_RAW:
+			return -windowBits;
+
+		case QZStream::FORMAT_AUTO:
+			return windowBits + 32;
+	}
+
+	return windowBits;
+}
+
+class QZDecompressor::ReadAhead : public QThread
+{
+public:
+	explicit ReadAhead(QZDecompressor *owner, int blockCount, qint64 position);
+
+	QMutex mutex;
+	QWaitCondition blockReady;
+	QWaitCondition blockFree;
+	std::deque<QByteArray> blocks;
+	std::vector<QByteArray> spareBlocks;
+	int blockCount;
+	int blockOffset;
+	qint64 position;
+	qint64 uncompressedSize;
+	bool stopped;
+	bool finished;
+	// Applied by stopReadAhead() on the owner thread
+	bool hasError;
+	QString errorString;
+	Statistics statistics;
+
+protected:
+	virtual void run() override;
+
+private:
+	QZDecompressor *mOwner;
+};
+
+QZDecompressor::ReadAhead::ReadAhead(
+	QZDecompressor *owner, int blockCount, qint64 position)
+	: blockCount(blockCount)
+	, blockOffset(0)
+	, position(position)
+	, uncompressedSize(-1)
+	, stopped(false)
+	, finished(false)
+	, hasError(false)
+	, mOwner(owner)
+{
+	memset(&statistics, 0, sizeof(statistics));
+}
+
+void QZDecompressor::ReadAhead::run()
+{
+	QMutexLocker locker(&mutex);
+	while (!stopped)
+	{
+		QByteArray block;
+		if (!spareBlocks.empty())
+		{
+			block = std::move(spareBlocks.back());
+			spareBlocks.pop_back();
+		}
+
+		// The owner does not touch the inflate state until it stops us
+		locker.unlock();
+		block.resize(QZ_READ_AHEAD_BLOCK_SIZE);
+		auto readBytes = mOwner->readInternal(block.data(), block.size());
+		locker.relock();
+
+		if (readBytes <= 0)
+			break;
+
+		block.resize(int(readBytes));
+		blocks.push_back(std::move(block));
+		blockReady.wakeOne();
+
+		while (!stopped && int(blocks.size()) >= blockCount)
+		{
+			blockFree.wait(&mutex);
+		}
+	}
+
+	finished = true;
+	blockReady.wakeOne();
+}
+
+void *QZStream::MemoryCounter::allocate(size_t size)
+{
+	auto ptr = allocator->allocate(size);
+	if (ptr)
+	{
+		this->size += qint64(size);
+		QZ_TotalMemoryFootprint += qint64(size);
+	}
+
+	return ptr;
+}
+
+void QZStream::MemoryCounter::deallocate(void *ptr, size_t size)
+{
+	this->size -= qint64(size);
+	QZ_TotalMemoryFootprint -= qint64(size);
+	allocator->deallocate(ptr, size);
+}
 
 QZStream::QZStream(QObject *parent)
 	: QIODevice(parent)
 	, mIODevice(nullptr)
 	, mIODeviceOriginalPosition(0)
 	, mIODevicePosition(0)
-	, mBuffer(new Bytef[BUFFER_SIZE])
+	, mAllocator(nullptr)
+	, mBackend(nullptr)
+	, mBufferSize(BUFFER_SIZE)
+	, mConfiguredBufferSize(BUFFER_SIZE)
+	, mMemoryBudget(0)
+	, mStatisticsEnabled(false)
+	, mCountedStatistics(&mStatistics)
 	, mHasError(false)
 {
+	memset(&mStatistics, 0, sizeof(mStatistics));
 	memset(&mZStream, 0, sizeof(mZStream));
+	mMemoryCounter.allocator = nullptr;
+	mMemoryCounter.size = 0;
 }
 
 QZStream::QZStream(QIODevice *stream, QObject *parent)
@@ -29,6 +187,74 @@ void QZStream::setIODevice(QIODevice *ioDevice)
 	}
 }
 
+void QZStream::setAllocator(QZAllocator *allocator)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change allocator of an open stream!");
+		return;
+	}
+
+	mAllocator = allocator;
+}
+
+void QZStream::setBufferSize(int size)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change buffer size of an open stream!");
+		return;
+	}
+
+	mConfiguredBufferSize = qMax(size, int(QZ_MIN_BUFFER_SIZE));
+	mBufferSize = mConfiguredBufferSize;
+}
+
+void QZStream::setMemoryBudget(qint64 bytes)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change memory budget of an open stream!");
+		return;
+	}
+
+	mMemoryBudget = qMax(bytes, qint64(0));
+}
+
+qint64 QZStream::memoryFootprint() const
+{
+	return mMemoryCounter.size;
+}
+
+qint64 QZStream::totalMemoryFootprint()
+{
+	return QZ_TotalMemoryFootprint;
+}
+
+void QZStream::setStatisticsEnabled(bool enabled)
+{
+	if (enabled && !mStatisticsTimer.isValid())
+		mStatisticsTimer.start();
+
+	mStatisticsEnabled = enabled;
+}
+
+void QZStream::resetStatistics()
+{
+	memset(&mStatistics, 0, sizeof(mStatistics));
+}
+
+void QZStream::setBackend(QZBackend *backend)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change backend of an open stream!");
+		return;
+	}
+
+	mBackend = backend;
+}
+
 bool QZStream::waitForReadyRead(int msecs)
 {
 	if (isReadable())
@@ -49,13 +275,19 @@ bool QZStream::check(int code)
 {
 	if (code < 0)
 	{
-		mHasError = true;
-		setErrorString(QLatin1String(mZStream.msg));
+		setError(QLatin1String(mZStream.msg));
+		return false;
 	}
 
 	return !mHasError;
 }
 
+void QZStream::setError(const QString &errorString)
+{
+	mHasError = true;
+	setErrorString(errorString);
+}
+
 bool QZStream::openIODevice(OpenMode mode)
 {
 	mode &= ~(QIODevice::Text | QIODevice::Unbuffered);
@@ -92,456 +324,685 @@ bool QZStream::openIODevice(OpenMode mode)
 
 bool QZStream::ioDeviceSeekInit()
 {
-	if (mIODevice->isTextModeEnabled() ||
-		(!mIODevice->isSequential() && !mIODevice->seek(mIODevicePosition)))
+	if (mIODevice->isTextModeEnabled())
 	{
-		mHasError = true;
-		setErrorString("IO device seek failed.");
+		setError("IO device seek failed.");
+		return false;
+	}
+
+	if (mIODevice->isSequential())
+		return true;
+
+	auto startTime = statisticsTime();
+	bool ok = mIODevice->seek(mIODevicePosition);
+	if (mStatisticsEnabled)
+	{
+		countIO(startTime);
+		mCountedStatistics->seekCount++;
+	}
+
+	if (!ok)
+	{
+		setError("IO device seek failed.");
 		return false;
 	}
 
 	return true;
 }
 
-QZDecompressor::QZDecompressor(QObject *parent)
-	: QZStream(parent)
-	, mUncompressedSize(-1)
+void QZStream::releaseBuffers()
 {
+	mBuffer.reset();
 }
 
-QZDecompressor::QZDecompressor(
-	QIODevice *source, qint64 uncompressedSize, QObject *parent)
-	: QZStream(source, parent)
-	, mUncompressedSize(uncompressedSize)
+void QZStream::resetFootprint()
 {
+	mBufferSize = mConfiguredBufferSize;
 }
 
-QZDecompressor::~QZDecompressor()
+qint64 QZStream::estimateFootprint() const
 {
-	QZDecompressor::close();
+	return mBufferSize;
 }
 
-bool QZDecompressor::isSequential() const
+bool QZStream::shrinkFootprint()
 {
-	return mIODevice->isSequential();
+	if (mBufferSize <= QZ_MIN_BUFFER_SIZE)
+		return false;
+
+	mBufferSize = qMax(mBufferSize / 2, int(QZ_MIN_BUFFER_SIZE));
+	return true;
 }
 
-bool QZDecompressor::open(OpenMode mode)
+QZBackend *QZStream::usedBackend() const
+{
+	return mBackend ? mBackend : QZBackend::defaultBackend();
+}
+
+bool QZStream::initAllocator()
 {
-	if (nullptr != mIODevice && initOpen(mode) && check(inflateInit(&mZStream)))
+	resetFootprint();
+	if (mMemoryBudget > 0)
 	{
-		mode |= Unbuffered;
-		mode &= ~(WriteOnly | Truncate | Append);
-		bool openOk = QZStream::open(mode);
-		Q_ASSERT(openOk);
-		Q_UNUSED(openOk);
+		while (estimateFootprint() > mMemoryBudget && shrinkFootprint())
+			continue;
 
-		QObject::connect(
-			mIODevice, &QIODevice::readyRead, this, &QIODevice::readyRead);
-		QObject::connect(
-			mIODevice, &QIODevice::aboutToClose, this, &QZDecompressor::close);
+		if (estimateFootprint() > mMemoryBudget)
+		{
+			mHasError = true;
+			setErrorString("Memory budget is too small.");
+			return false;
+		}
+	}
 
-		return true;
+	auto allocator = mAllocator ? mAllocator : QZAllocator::defaultAllocator();
+	if (allocator != mMemoryCounter.allocator)
+	{
+		// Blocks go back to the allocator they came from
+		releaseBuffers();
+		mMemoryCounter.allocator = allocator;
 	}
 
-	return false;
-}
+	mZStream.zalloc = QZAllocator::zalloc;
+	mZStream.zfree = QZAllocator::zfree;
+	mZStream.opaque = &mMemoryCounter;
 
-void QZDecompressor::close()
-{
-	if (!isOpen())
+	if (!mBuffer.reset(&mMemoryCounter, size_t(mBufferSize)))
 	{
-		return;
+		mHasError = true;
+		setErrorString("Out of memory.");
+		return false;
 	}
 
-	QObject::disconnect(
-		mIODevice, &QIODevice::readyRead, this, &QIODevice::readyRead);
-	QObject::disconnect(
-		mIODevice, &QIODevice::aboutToClose, this, &QZDecompressor::close);
+	return true;
+}
 
-	QZStream::close();
+QZDecompressor::QZDecompressor(QObject *parent)
+	: QZDecompressor(nullptr, -1, parent)
+{
+}
 
-	mIODevicePosition -= mZStream.avail_in;
-	ioDeviceSeekInit();
-	check(inflateEnd(&mZStream));
+QZDecompressor::QZDecompressor(
+	QIODevice *source, qint64 uncompressedSize, QObject *parent)
+	: QZStream(source, parent)
+	, mUncompressedSize(uncompressedSize)
+	, mDirectInput(nullptr)
+	, mDirectInputSize(0)
+	, mMappedInput(nullptr)
+	, mDirectInputEnabled(true)
+	, mCheckpointInterval(0)
+	, mFingerprint({-1, 0, FORMAT_ZLIB, MAX_WBITS})
+	, mIndexUncompressedSize(-1)
+	, mCacheSize(BUFFER_SIZE)
+	, mConfiguredCacheSize(BUFFER_SIZE)
+	, mHistorySize(0)
+	, mHistoryFill(0)
+	, mHistoryHead(0)
+	, mReadAheadBlockCount(0)
+	, mDictionaryRequested(false)
+	, mWindowBits(MAX_WBITS)
+	, mFormat(FORMAT_ZLIB)
+	, mPendingOffset(0)
+	, mDecodeDeferred(false)
+	, mSourceFinished(false)
+	, mStreamEnded(false)
+{
 }
 
-qint64 QZDecompressor::size() const
+QZDecompressor::~QZDecompressor()
 {
-	if (!isOpen())
-		return 0;
+	QZDecompressor::close();
+}
 
-	if (mUncompressedSize >= 0)
-		return mUncompressedSize;
+void QZDecompressor::setCheckpointInterval(qint64 interval)
+{
+	stopReadAhead();
+	mCheckpointInterval = qMax(interval, qint64(0));
 
-	return bytesAvailable();
+	if (isOpen())
+		updateHistorySize();
 }
 
-qint64 QZDecompressor::bytesAvailable() const
+void QZDecompressor::clearIndex()
 {
-	if (!isOpen())
-		return 0;
+	stopReadAhead();
+	mCheckpoints.clear();
+	mIndexUncompressedSize = -1;
+}
 
-	if (mHasError)
-		return 0;
+void QZDecompressor::setCacheSize(int size)
+{
+	stopReadAhead();
+	mConfiguredCacheSize = qMax(size, 0);
+	mCacheSize = mConfiguredCacheSize;
 
-	if (mUncompressedSize >= 0)
-		return qMax(mUncompressedSize - pos(), qint64(0));
+	if (isOpen())
+		updateHistorySize();
+}
 
-	if (sizeof(qint64) == sizeof(uLong))
-		return std::numeric_limits<qint64>::max();
-	return qint64(std::numeric_limits<uLong>::max());
+void QZDecompressor::setReadAheadBlockCount(int count)
+{
+	stopReadAhead();
+	mReadAheadBlockCount = qMax(count, 0);
 }
 
-bool QZDecompressor::atEnd() const
+void QZDecompressor::releaseBuffers()
 {
-	return bytesAvailable() == 0;
+	mHistory.reset();
+	QZStream::releaseBuffers();
 }
 
-qint64 QZDecompressor::bytesToWrite() const
+void QZDecompressor::resetFootprint()
 {
-	return 0;
+	QZStream::resetFootprint();
+	mCacheSize = mConfiguredCacheSize;
 }
 
-qint64 QZDecompressor::readData(char *data, qint64 maxlen)
+qint64 QZDecompressor::estimateFootprint() const
+{
+	qint64 historySize = mCacheSize;
+	if (mCheckpointInterval > 0)
+		historySize = qMax(historySize, qint64(WINDOW_SIZE));
+
+	return QZStream::estimateFootprint() + historySize +
+		(qint64(1) << mWindowBits) + QZ_INFLATE_STATE_SIZE;
+}
+
+bool QZDecompressor::shrinkFootprint()
 {
-	if (seekInternal(pos()))
+	if (QZStream::shrinkFootprint())
+		return true;
+
+	if (mCacheSize > 0)
 	{
-		return readInternal(data, maxlen);
+		mCacheSize = mCacheSize > QZ_MIN_BUFFER_SIZE ? mCacheSize / 2 : 0;
+		return true;
 	}
 
-	return -1;
+	// A smaller window would reject streams written with the
+	// configured one
+	return false;
 }
 
-bool QZDecompressor::initOpen(OpenMode mode)
+void QZDecompressor::setWindowBits(int bits)
 {
-	Q_ASSERT(!isOpen());
-	if (0 == (mode & ReadOnly))
+	if (isOpen())
 	{
-		mHasError = true;
-		setErrorString("Cannot open decompression stream whith no read mode.");
-		return false;
+		qWarning("Cannot change window bits of an open stream!");
+		return;
 	}
 
-	if (!openIODevice(mode))
+	if (bits < 8 || bits > MAX_WBITS)
 	{
-		return false;
+		qWarning("Unsupported window bits!");
+		return;
 	}
 
-	if (!mIODevice->isReadable())
+	mWindowBits = bits;
+}
+
+void QZDecompressor::setFormat(int format)
+{
+	if (isOpen())
 	{
-		mHasError = true;
-		setErrorString("Source IO device is not readable.");
-		return false;
+		qWarning("Cannot change format of an open stream!");
+		return;
 	}
 
-	if (mIODevice->isTextModeEnabled())
+	if (format < FORMAT_ZLIB || format > FORMAT_AUTO)
 	{
-		mHasError = true;
-		setErrorString("Source IO device is not binary.");
-		return false;
+		qWarning("Unsupported format!");
+		return;
 	}
 
-	mHasError = false;
-	setErrorString(QString());
-	mIODevicePosition = mIODeviceOriginalPosition;
-	mZStream.next_in = mBuffer.get();
-	mZStream.avail_in = 0;
-
-	return true;
+	mFormat = format;
 }
 
-bool QZDecompressor::seekInternal(qint64 pos)
+void QZDecompressor::setDictionary(const QByteArray &dictionary)
 {
-	if (!isOpen())
-		return false;
+	stopReadAhead();
+	mDictionary = dictionary;
+}
 
-	if (isSequential())
-		return true;
+QByteArray QZDecompressor::decompressBytes(
+	const char *data, qint64 size, qint64 uncompressedSize)
+{
+	if (size < 0 || uncompressedSize > MAX_BYTE_ARRAY_SIZE)
+		return QByteArray();
 
-	qint64 currentPos = static_cast<qint64>(mZStream.total_out);
-	currentPos -= pos;
-	if (currentPos > 0)
+	auto backend = QZBackend::defaultBackend();
+	QByteArray result;
+	if (uncompressedSize < 0)
 	{
-		if (!check(inflateReset(&mZStream)))
+		if (!backend->decompressBlock(
+				data, size_t(size), result, MAX_BYTE_ARRAY_SIZE))
 		{
-			return false;
+			return QByteArray();
 		}
 
-		mIODevicePosition = mIODeviceOriginalPosition;
+		return result;
+	}
 
-		mZStream.next_in = mBuffer.get();
-		mZStream.avail_in = 0;
-	} else
+	result.resize(int(uncompressedSize));
+	if (!backend->decompressBlock(
+			data, size_t(size), result.data(), size_t(result.size())))
 	{
-		pos = -currentPos;
+		return QByteArray();
 	}
 
-	while (pos > 0)
+	return result;
+}
+
+QByteArray QZDecompressor::readAllDecompressed(qint64 sizeHint)
+{
+	QByteArray result;
+	if (!isReadable())
+		return result;
+
+	const qint64 maxSize = MAX_BYTE_ARRAY_SIZE;
+
+	bool exact = !isSequential() && mUncompressedSize >= 0;
+	qint64 capacity = exact ? qMax(mUncompressedSize - pos(), qint64(0))
+							: (sizeHint > 0 ? sizeHint : qint64(BUFFER_SIZE));
+	if (capacity > maxSize)
 	{
-		char buf[4096];
+		if (exact)
+		{
+			mHasError = true;
+			setErrorString("Uncompressed data is too large.");
+			return result;
+		}
 
-		auto blockSize = qMin(pos, qint64(sizeof(buf)));
+		capacity = maxSize;
+	}
 
-		auto readBytes = readInternal(buf, blockSize);
-		if (readBytes != blockSize)
+	qint64 count = 0;
+	while (true)
+	{
+		if (count == capacity)
 		{
-			return false;
+			if (exact || capacity == maxSize)
+				break;
+
+			capacity = qMin(capacity * 2, maxSize);
 		}
-		pos -= readBytes;
+
+		result.resize(int(capacity));
+		auto readBytes = read(result.data() + count, capacity - count);
+		if (readBytes <= 0)
+			break;
+
+		count += readBytes;
 	}
 
-	return true;
+	result.resize(int(count));
+	return result;
 }
 
-qint64 QZDecompressor::readInternal(char *data, qint64 maxlen)
+bool QZDecompressor::exportIndex(QIODevice *target) const
 {
-	if (!isOpen() || !ioDeviceSeekInit())
+	if (!target || !target->isWritable())
+		return false;
+
+	QDataStream stream(target);
+	stream.setByteOrder(QDataStream::BigEndian);
+	stream.writeRawData(QZ_IndexSignature, QZ_INDEX_SIGNATURE_SIZE);
+	stream << quint16(QZ_INDEX_VERSION);
+	stream << mCheckpointInterval;
+	stream << mUncompressedSize;
+	stream << mFingerprint.size;
+	stream << mFingerprint.check;
+	stream << quint8(mFingerprint.format);
+	stream << quint8(mFingerprint.windowBits);
+	stream << quint32(mCheckpoints.size());
+
+	for (const auto &checkpoint : mCheckpoints)
 	{
-		return -1;
+		stream << checkpoint.compressedOffset;
+		stream << checkpoint.uncompressedOffset;
+		stream << quint8(checkpoint.bits);
+		stream << checkpoint.window;
 	}
 
-	mZStream.next_out = reinterpret_cast<decltype(mZStream.next_out)>(data);
+	return stream.status() == QDataStream::Ok;
+}
 
-	qint64 count = maxlen;
-	auto blockSize = std::numeric_limits<decltype(mZStream.avail_out)>::max();
-	bool run = true;
+bool QZDecompressor::importIndex(QIODevice *source)
+{
+	if (!source || !source->isReadable())
+		return false;
 
-	while (run && count > 0)
+	QDataStream stream(source);
+	stream.setByteOrder(QDataStream::BigEndian);
+
+	char sig[QZ_INDEX_SIGNATURE_SIZE];
+	if (stream.readRawData(sig, QZ_INDEX_SIGNATURE_SIZE) !=
+			QZ_INDEX_SIGNATURE_SIZE ||
+		0 != memcmp(sig, QZ_IndexSignature, QZ_INDEX_SIGNATURE_SIZE))
 	{
-		if (count < blockSize)
-		{
-			blockSize = static_cast<decltype(blockSize)>(count);
-		}
+		return false;
+	}
 
-		mZStream.avail_out = blockSize;
+	quint16 version;
+	stream >> version;
+	if (QZ_INDEX_VERSION != version)
+		return false;
 
-		while (mZStream.avail_out > 0)
+	qint64 interval;
+	qint64 uncompressedSize;
+	Fingerprint fingerprint;
+	quint8 format;
+	quint8 windowBits;
+	quint32 count;
+	stream >> interval;
+	stream >> uncompressedSize;
+	stream >> fingerprint.size;
+	stream >> fingerprint.check;
+	stream >> format;
+	stream >> windowBits;
+	stream >> count;
+	fingerprint.format = format;
+	fingerprint.windowBits = windowBits;
+
+	std::vector<Checkpoint> checkpoints;
+	for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++)
+	{
+		Checkpoint checkpoint;
+		quint8 bits;
+		stream >> checkpoint.compressedOffset;
+		stream >> checkpoint.uncompressedOffset;
+		stream >> bits;
+		stream >> checkpoint.window;
+		checkpoint.bits = bits;
+
+		if (bits > 7 || checkpoint.window.size() > WINDOW_SIZE ||
+			checkpoint.compressedOffset <= 0 ||
+			checkpoint.uncompressedOffset <= 0 ||
+			(!checkpoints.empty() &&
+				checkpoints.back().uncompressedOffset >=
+					checkpoint.uncompressedOffset))
 		{
-			if (mZStream.avail_in == 0)
-			{
-				auto readResult = mIODevice->read(
-					reinterpret_cast<char *>(mBuffer.get()), BUFFER_SIZE);
-				mZStream.avail_in = readResult >= 0
-					? static_cast<decltype(mZStream.avail_in)>(readResult)
-					: 0;
+			return false;
+		}
 
-				if (readResult <= 0)
-				{
-					run = false;
-					mUncompressedSize = qint64(mZStream.total_out);
-					if (readResult < 0)
-					{
-						mHasError = true;
-						setErrorString(mIODevice->errorString());
-					}
-					break;
-				}
+		checkpoints.push_back(std::move(checkpoint));
+	}
 
-				mZStream.next_in = mBuffer.get();
-				mIODevicePosition += mZStream.avail_in;
-			}
+	if (stream.status() != QDataStream::Ok)
+		return false;
 
-			int code = inflate(&mZStream, Z_NO_FLUSH);
-			if (code == Z_STREAM_END || !check(code))
-			{
-				run = false;
-				mUncompressedSize = qint64(mZStream.total_out);
-				break;
-			}
+	stopReadAhead();
+	if (isOpen())
+	{
+		Fingerprint sourceFingerprint;
+		if (!readFingerprint(sourceFingerprint) ||
+			!sourceFingerprint.matches(fingerprint))
+		{
+			setErrorString("Index does not match the source.");
+			return false;
 		}
-
-		count -= blockSize - mZStream.avail_out;
 	}
 
-	return maxlen - count;
-}
+	mCheckpoints.swap(checkpoints);
+	mFingerprint = fingerprint;
+	mIndexUncompressedSize = uncompressedSize;
+	setCheckpointInterval(interval);
 
-qint64 QZDecompressor::writeData(const char *, qint64)
-{
-	qWarning("QZDecompressionStream is read only!");
-	return -1;
+	if (isOpen())
+		applyIndexUncompressedSize();
+
+	return true;
 }
 
-QZCompressor::QZCompressor(QObject *parent)
-	: QZStream(parent)
-	, mCompressionLevel(Z_DEFAULT_COMPRESSION)
+void QZDecompressor::applyIndexUncompressedSize()
 {
+	if (mUncompressedSize < 0)
+		mUncompressedSize = mIndexUncompressedSize;
 }
 
-QZCompressor::QZCompressor(
-	QIODevice *target, int compressionLevel, QObject *parent)
-	: QZStream(target, parent)
-	, mCompressionLevel(compressionLevel)
+bool QZDecompressor::Fingerprint::matches(const Fingerprint &other) const
 {
+	if (format != other.format || windowBits != other.windowBits)
+		return false;
+
+	return size < 0 || other.size < 0 ||
+		(size == other.size && check == other.check);
 }
 
-QZCompressor::~QZCompressor()
+bool QZDecompressor::readFingerprint(Fingerprint &fingerprint)
 {
-	QZCompressor::close();
+	fingerprint.size = -1;
+	fingerprint.check = 0;
+	fingerprint.format = mFormat;
+	fingerprint.windowBits = mWindowBits;
+	if (mIODevice->isSequential())
+		return true;
+
+	auto size = mIODevice->size() - mIODeviceOriginalPosition;
+	auto checkSize = qMin(size, qint64(QZ_FINGERPRINT_SIZE));
+	uLong check = crc32(0, Z_NULL, 0);
+	for (auto offset : {qint64(0), size - checkSize})
+	{
+		QByteArray bytes;
+		if (mIODevice->seek(mIODeviceOriginalPosition + offset))
+			bytes = mIODevice->read(checkSize);
+
+		if (bytes.size() != checkSize)
+			return false;
+
+		check = crc32(check, reinterpret_cast<const Bytef *>(bytes.constData()),
+			uInt(bytes.size()));
+	}
+
+	fingerprint.size = size;
+	fingerprint.check = quint32(check);
+	return true;
 }
 
-bool QZCompressor::isSequential() const
+bool QZDecompressor::isSequential() const
 {
-	return true;
+	return mIODevice->isSequential();
 }
 
-bool QZCompressor::open(OpenMode mode)
+bool QZDecompressor::open(OpenMode mode)
 {
-	if (nullptr != mIODevice && initOpen(mode) &&
-		check(deflateInit(&mZStream, mCompressionLevel)))
+	if (nullptr != mIODevice && initOpen(mode) && check(decoderInit()))
 	{
-		mode |= Truncate;
-		mode &= ~(ReadOnly | Append);
+		mode |= Unbuffered;
+		mode &= ~(WriteOnly | Truncate | Append);
 		bool openOk = QZStream::open(mode);
 		Q_ASSERT(openOk);
 		Q_UNUSED(openOk);
 
+		initDirectInput();
+
+		if (isSequential())
+		{
+			QObject::connect(mIODevice, &QIODevice::readyRead, this,
+				&QZDecompressor::onSourceReadyRead);
+			QObject::connect(mIODevice, &QIODevice::readChannelFinished, this,
+				&QZDecompressor::onSourceReadChannelFinished);
+		} else
+		{
+			QObject::connect(
+				mIODevice, &QIODevice::readyRead, this, &QIODevice::readyRead);
+		}
 		QObject::connect(
-			mIODevice, &QIODevice::aboutToClose, this, &QZCompressor::close);
+			mIODevice, &QIODevice::aboutToClose, this, &QZDecompressor::close);
+
 		return true;
 	}
 
 	return false;
 }
 
-void QZCompressor::flushToFile()
-{
-	if (!mHasError)
-	{
-		auto fileDevice = qobject_cast<QFileDevice *>(mIODevice);
-		if (fileDevice)
-		{
-			if (!fileDevice->flush())
-			{
-				mHasError = true;
-				setErrorString(fileDevice->errorString());
-			}
-		}
-	}
-}
-
-void QZCompressor::close()
+void QZDecompressor::close()
 {
 	if (!isOpen())
 	{
 		return;
 	}
 
+	stopReadAhead();
+
 	QObject::disconnect(
-		mIODevice, &QIODevice::aboutToClose, this, &QZCompressor::close);
+		mIODevice, &QIODevice::readyRead, this, &QIODevice::readyRead);
+	QObject::disconnect(mIODevice, &QIODevice::readyRead, this,
+		&QZDecompressor::onSourceReadyRead);
+	QObject::disconnect(mIODevice, &QIODevice::readChannelFinished, this,
+		&QZDecompressor::onSourceReadChannelFinished);
+	QObject::disconnect(
+		mIODevice, &QIODevice::aboutToClose, this, &QZDecompressor::close);
 
 	QZStream::close();
 
-	mZStream.next_in = Z_NULL;
-	mZStream.avail_in = 0;
-	if (ioDeviceSeekInit())
-	{
-		while (true)
-		{
-			int result = deflate(&mZStream, Z_FINISH);
-			if (!check(result))
-				break;
-
-			if (result == Z_STREAM_END)
-				break;
-
-			Q_ASSERT(mZStream.avail_out == 0);
+	mPending.clear();
+	mPendingOffset = 0;
+	mDecodeDeferred = false;
 
-			if (!flushBuffer())
-				break;
+	mIODevicePosition -= mZStream.avail_in;
+	ioDeviceSeekInit();
+	releaseDirectInput();
+	check(decoderEnd());
+}
 
-			mZStream.next_out = mBuffer.get();
-			mZStream.avail_out = uInt(BUFFER_SIZE);
-		}
-	}
+qint64 QZDecompressor::size() const
+{
+	if (!isOpen())
+		return 0;
 
-	if (!mHasError && mZStream.avail_out < BUFFER_SIZE)
-	{
-		flushBuffer(int(BUFFER_SIZE - mZStream.avail_out));
-	}
+	if (mUncompressedSize >= 0)
+		return mUncompressedSize;
 
-	check(deflateEnd(&mZStream));
-	flushToFile();
+	return bytesAvailable();
 }
 
-qint64 QZCompressor::size() const
+qint64 QZDecompressor::bytesAvailable() const
 {
-	return isOpen() ? mZStream.total_in : 0;
+	if (!isOpen())
+		return 0;
+
+	if (mHasError)
+		return 0;
+
+	if (isSequential())
+		return pendingSize();
+
+	if (mUncompressedSize >= 0)
+		return qMax(mUncompressedSize - pos(), qint64(0));
+
+	if (sizeof(qint64) == sizeof(uLong))
+		return std::numeric_limits<qint64>::max();
+	return qint64(std::numeric_limits<uLong>::max());
 }
 
-bool QZCompressor::canReadLine() const
+bool QZDecompressor::atEnd() const
 {
-	qWarning("QZCompressionStream is write only!");
-	return false;
+	return bytesAvailable() == 0;
 }
 
-qint64 QZCompressor::bytesToWrite() const
+qint64 QZDecompressor::bytesToWrite() const
 {
-	return isOpen() ? mZStream.avail_out : 0;
+	return 0;
 }
 
-qint64 QZCompressor::writeData(const char *data, qint64 maxlen)
+bool QZDecompressor::waitForReadyRead(int msecs)
 {
-	if (!mIODevice->isOpen() || !ioDeviceSeekInit())
-	{
-		mHasError = true;
-		setErrorString("Target IO device seek failed.");
-		return -1;
-	}
-
-	qint64 count = maxlen;
-	auto blockSize = std::numeric_limits<decltype(mZStream.avail_in)>::max();
+	if (!isReadable() || !isSequential())
+		return QZStream::waitForReadyRead(msecs);
 
-	mZStream.next_in =
-		reinterpret_cast<decltype(mZStream.next_in)>(const_cast<char *>(data));
+	QElapsedTimer timer;
+	timer.start();
 
-	bool run = true;
-	while (run && count > 0)
+	while (pendingSize() == 0)
 	{
-		if (count < blockSize)
+		if (decodePending() > 0)
 		{
-			blockSize = static_cast<decltype(blockSize)>(count);
+			emit readyRead();
+			break;
 		}
 
-		mZStream.avail_in = blockSize;
+		if (mStreamEnded || mHasError)
+			return false;
 
-		while (mZStream.avail_in > 0)
+		int timeout = -1;
+		if (msecs >= 0)
 		{
-			if (!check(deflate(&mZStream, Z_NO_FLUSH)))
-			{
-				run = false;
-				break;
-			}
-			if (mZStream.avail_out == 0)
-			{
-				if (!flushBuffer())
-				{
-					run = false;
-					break;
-				}
+			timeout = msecs - int(timer.elapsed());
+			if (timeout <= 0)
+				return false;
+		}
 
-				mIODevicePosition += BUFFER_SIZE;
-				mZStream.next_out = mBuffer.get();
-				mZStream.avail_out = uInt(BUFFER_SIZE);
-			}
+		// Decoded and signalled by onSourceReadyRead()
+		if (!mIODevice->waitForReadyRead(timeout) && pendingSize() == 0)
+			return false;
+	}
+
+	return true;
+}
+
+qint64 QZDecompressor::readData(char *data, qint64 maxlen)
+{
+	if (isSequential())
+	{
+		auto count = readPending(data, maxlen);
+		if (count < maxlen)
+		{
+			auto readBytes = readInternal(data + count, maxlen - count);
+			if (readBytes < 0)
+				return count > 0 ? count : -1;
+
+			mDecodeDeferred = readBytes == maxlen - count;
+			count += readBytes;
 		}
 
-		count -= blockSize - mZStream.avail_in;
+		// Input the source may still have is not signalled again
+		if (mDecodeDeferred && pendingSize() == 0)
+		{
+			mDecodeDeferred = false;
+			QTimer::singleShot(0, this, &QZDecompressor::onSourceReadyRead);
+		}
+
+		return count;
 	}
 
-	return maxlen - count;
+	auto pos = this->pos();
+	if (mReadAheadBlockCount > 0)
+	{
+		if (mReadAhead && mReadAhead->position != pos)
+			stopReadAhead();
+
+		if (mReadAhead || startReadAhead())
+			return readAheadData(data, maxlen);
+	}
+
+	auto result = readHistory(data, pos, maxlen);
+	if (result == maxlen)
+		return result;
+
+	data += result;
+	maxlen -= result;
+	pos += result;
+
+	if (!seekInternal(pos))
+		return result > 0 ? result : -1;
+
+	auto count = maxlen < qMin(mCacheSize, mHistorySize)
+		? readCached(data, maxlen)
+		: readInternal(data, maxlen);
+	if (count < 0)
+		return result > 0 ? result : -1;
+
+	return result + count;
 }
 
-bool QZCompressor::initOpen(OpenMode mode)
+bool QZDecompressor::initOpen(OpenMode mode)
 {
 	Q_ASSERT(!isOpen());
-	Q_ASSERT(nullptr != mIODevice);
-
-	if (0 == (mode & WriteOnly))
+	if (0 == (mode & ReadOnly))
 	{
 		mHasError = true;
-		setErrorString("Cannot open compression stream whith no write mode.");
+		setErrorString("Cannot open decompression stream whith no read mode.");
 		return false;
 	}
 
@@ -550,46 +1011,1748 @@ bool QZCompressor::initOpen(OpenMode mode)
 		return false;
 	}
 
-	if (!mIODevice->isWritable())
+	if (!mIODevice->isReadable())
 	{
 		mHasError = true;
-		setErrorString("Target IO device is not writable.");
+		setErrorString("Source IO device is not readable.");
 		return false;
 	}
 
 	if (mIODevice->isTextModeEnabled())
 	{
 		mHasError = true;
-		setErrorString("Target IO device is not binary.");
+		setErrorString("Source IO device is not binary.");
 		return false;
 	}
 
 	mHasError = false;
 	setErrorString(QString());
 
+	if (!initAllocator())
+		return false;
+
+	bool indexed = !mCheckpoints.empty() || mIndexUncompressedSize >= 0;
+	if (mCheckpointInterval > 0 || indexed)
+	{
+		Fingerprint fingerprint;
+		if (!readFingerprint(fingerprint))
+		{
+			mHasError = true;
+			setErrorString("Source IO device seek failed.");
+			return false;
+		}
+
+		// Checkpoints of another source would restore wrong state
+		if (indexed && !fingerprint.matches(mFingerprint))
+		{
+			mHasError = true;
+			setErrorString("Index does not match the source.");
+			return false;
+		}
+
+		mFingerprint = fingerprint;
+		applyIndexUncompressedSize();
+	}
+
 	mIODevicePosition = mIODeviceOriginalPosition;
-	mZStream.next_out = mBuffer.get();
-	mZStream.avail_out = uInt(BUFFER_SIZE);
+	mZStream.next_in = mBuffer.get();
+	mZStream.avail_in = 0;
+	mSourceFinished = false;
+	mStreamEnded = false;
+	mDictionaryRequested = false;
+	updateHistorySize();
+	clearHistory();
 
-	return true;
+	return !mHasError;
 }
 
-qint64 QZCompressor::readData(char *, qint64)
+void QZDecompressor::initDirectInput()
 {
-	warnWriteOnly();
-	return -1;
-}
+	Q_ASSERT(!mDirectInput);
+	if (!mDirectInputEnabled)
+		return;
 
-qint64 QZCompressor::bytesAvailable() const
+	auto fileDevice = qobject_cast<QFileDevice *>(mIODevice);
+	if (fileDevice)
+	{
+		auto size = fileDevice->size();
+		if (size > 0 && !fileDevice->isSequential())
+		{
+			mMappedInput = fileDevice->map(0, size);
+			if (mMappedInput)
+			{
+				mDirectInput = mMappedInput;
+				mDirectInputSize = size;
+			}
+		}
+		return;
+	}
+
+	auto buffer = qobject_cast<QBuffer *>(mIODevice);
+	if (buffer)
+	{
+		mInputBytes = buffer->data();
+		mDirectInput = reinterpret_cast<const Bytef *>(mInputBytes.constData());
+		mDirectInputSize = mInputBytes.size();
+	}
+}
+
+void QZDecompressor::releaseDirectInput()
+{
+	if (mMappedInput)
+	{
+		auto fileDevice = qobject_cast<QFileDevice *>(mIODevice);
+		Q_ASSERT(fileDevice);
+		fileDevice->unmap(mMappedInput);
+		mMappedInput = nullptr;
+	}
+
+	mInputBytes.clear();
+	mDirectInput = nullptr;
+	mDirectInputSize = 0;
+}
+
+qint64 QZDecompressor::fillInput()
+{
+	if (mDirectInput)
+	{
+		auto size = qMax(mDirectInputSize - mIODevicePosition, qint64(0));
+		mZStream.next_in = mDirectInput + mIODevicePosition;
+		return qMin(size,
+			qint64(std::numeric_limits<decltype(mZStream.avail_in)>::max()));
+	}
+
+	if (!ioDeviceSeekInit())
+		return -1;
+
+	auto startTime = statisticsTime();
+	auto readResult =
+		mIODevice->read(reinterpret_cast<char *>(mBuffer.get()), mBufferSize);
+	countIO(startTime);
+	if (readResult < 0)
+		setError(mIODevice->errorString());
+
+	mZStream.next_in = mBuffer.get();
+	return readResult;
+}
+
+bool QZDecompressor::seekInternal(qint64 pos)
+{
+	if (!isOpen())
+		return false;
+
+	if (isSequential())
+		return true;
+
+	auto currentPos = static_cast<qint64>(mZStream.total_out);
+	auto checkpoint = canCheckpoint() ? findCheckpoint(pos) : nullptr;
+	if (checkpoint && currentPos <= pos &&
+		checkpoint->uncompressedOffset <= currentPos)
+	{
+		// Inflating forward from the current position is cheaper
+		checkpoint = nullptr;
+	}
+
+	if (checkpoint)
+	{
+		if (!restoreCheckpoint(*checkpoint))
+			return false;
+	} else if (currentPos > pos)
+	{
+		if (!resetInternal())
+			return false;
+
+		if (mStatisticsEnabled)
+			mStatistics.restartCount++;
+	}
+
+	pos -= static_cast<qint64>(mZStream.total_out);
+
+	while (pos > 0)
+	{
+		char buf[4096];
+
+		auto blockSize = qMin(pos, qint64(sizeof(buf)));
+
+		auto readBytes = readInternal(buf, blockSize);
+		if (readBytes != blockSize)
+		{
+			return false;
+		}
+		pos -= readBytes;
+	}
+
+	return true;
+}
+
+bool QZDecompressor::resetInternal()
+{
+	if (!check(decoderReset()))
+		return false;
+
+	mIODevicePosition = mIODeviceOriginalPosition;
+
+	mZStream.next_in = mBuffer.get();
+	mZStream.avail_in = 0;
+	clearHistory();
+
+	return true;
+}
+
+bool QZDecompressor::restoreCheckpoint(const Checkpoint &checkpoint)
+{
+	// Checkpoints are placed between deflate blocks,
+	// so the stream continues in raw mode
+	if (!check(inflateReset2(&mZStream, -mWindowBits)))
+		return false;
+
+	mIODevicePosition =
+		mIODeviceOriginalPosition + checkpoint.compressedOffset;
+
+	if (checkpoint.bits > 0)
+	{
+		mIODevicePosition--;
+
+		char c;
+		if (mDirectInput)
+		{
+			if (mIODevicePosition >= mDirectInputSize)
+			{
+				mHasError = true;
+				setErrorString("Bad checkpoint offset.");
+				return false;
+			}
+
+			c = char(mDirectInput[mIODevicePosition]);
+		} else
+		{
+			if (!ioDeviceSeekInit())
+				return false;
+
+			if (mIODevice->read(&c, 1) != 1)
+			{
+				mHasError = true;
+				setErrorString("IO device read failed.");
+				return false;
+			}
+		}
+
+		mIODevicePosition++;
+
+		int bits = checkpoint.bits;
+		if (!check(inflatePrime(&mZStream, bits, uchar(c) >> (8 - bits))))
+			return false;
+	}
+
+	auto &window = checkpoint.window;
+	if (!check(inflateSetDictionary(&mZStream,
+			reinterpret_cast<const Bytef *>(window.constData()),
+			uInt(window.size()))))
+	{
+		return false;
+	}
+
+	mZStream.next_in = mBuffer.get();
+	mZStream.avail_in = 0;
+	mZStream.total_in = uLong(checkpoint.compressedOffset);
+	mZStream.total_out = uLong(checkpoint.uncompressedOffset);
+
+	clearHistory();
+	appendHistory(window.constData(), window.size());
+
+	return true;
+}
+
+const QZDecompressor::Checkpoint *QZDecompressor::findCheckpoint(
+	qint64 pos) const
+{
+	auto it = std::upper_bound(mCheckpoints.begin(), mCheckpoints.end(), pos,
+		[](qint64 pos, const Checkpoint &checkpoint) {
+			return pos < checkpoint.uncompressedOffset;
+		});
+
+	if (it == mCheckpoints.begin())
+		return nullptr;
+
+	return &*(--it);
+}
+
+void QZDecompressor::addCheckpoint()
+{
+	auto uncompressedOffset = static_cast<qint64>(mZStream.total_out);
+	qint64 lastOffset = mCheckpoints.empty()
+		? 0
+		: mCheckpoints.back().uncompressedOffset;
+
+	if (uncompressedOffset - lastOffset < mCheckpointInterval)
+		return;
+
+	// Checkpoint windows do not hold the preset dictionary
+	if (mDictionaryRequested && uncompressedOffset < WINDOW_SIZE)
+		return;
+
+	auto windowSize = int(qMin(uncompressedOffset, qint64(WINDOW_SIZE)));
+	if (mHistoryFill < windowSize)
+		return;
+
+	Checkpoint checkpoint;
+	checkpoint.compressedOffset = static_cast<qint64>(mZStream.total_in);
+	checkpoint.uncompressedOffset = uncompressedOffset;
+	checkpoint.bits = mZStream.data_type & 7;
+	checkpoint.window.resize(windowSize);
+	copyHistory(checkpoint.window.data(), windowSize, windowSize);
+
+	mCheckpoints.push_back(std::move(checkpoint));
+}
+
+qint64 QZDecompressor::readCached(char *data, qint64 maxlen)
+{
+	Q_ASSERT(maxlen <= mHistorySize);
+
+	// Inflate ahead straight into the history ring,
+	// keeping most of it available for backward seeks
+	qint64 count = 0;
+	while (count < maxlen)
+	{
+		auto blockSize = qMin(qint64(mHistorySize - mHistoryHead),
+			qMax(maxlen - count, qint64(mHistorySize / 4)));
+
+		auto block = &mHistory[mHistoryHead];
+		auto readBytes = readInternal(block, blockSize);
+		if (readBytes <= 0)
+		{
+			if (readBytes < 0 && count == 0)
+				return -1;
+
+			break;
+		}
+
+		readBytes = qMin(readBytes, maxlen - count);
+		memcpy(data + count, block, size_t(readBytes));
+		count += readBytes;
+	}
+
+	return count;
+}
+
+qint64 QZDecompressor::readHistory(
+	char *data, qint64 pos, qint64 maxlen) const
+{
+	auto back = static_cast<qint64>(mZStream.total_out) - pos;
+	if (back <= 0 || back > mHistoryFill)
+		return 0;
+
+	auto len = qMin(back, maxlen);
+	copyHistory(data, back, len);
+	return len;
+}
+
+void QZDecompressor::updateHistorySize()
+{
+	int size = mCacheSize;
+	if (mCheckpointInterval > 0)
+		size = qMax(size, int(WINDOW_SIZE));
+
+	if (size != mHistorySize || mHistory.allocator() != mBuffer.allocator())
+	{
+		if (!allocHistory(size))
+		{
+			mHasError = true;
+			setErrorString("Out of memory.");
+		}
+	}
+}
+
+bool QZDecompressor::allocHistory(int size)
+{
+	clearHistory();
+	mHistorySize = 0;
+	if (!mHistory.reset(mBuffer.allocator(), size_t(size)))
+		return false;
+
+	mHistorySize = size;
+	return true;
+}
+
+void QZDecompressor::clearHistory()
+{
+	mHistoryFill = 0;
+	mHistoryHead = 0;
+}
+
+void QZDecompressor::appendHistory(const char *data, qint64 len)
+{
+	if (mHistorySize == 0 || len <= 0)
+		return;
+
+	if (len > mHistorySize)
+	{
+		data += len - mHistorySize;
+		len = mHistorySize;
+	}
+
+	if (data != &mHistory[mHistoryHead])
+	{
+		auto tail = qMin(len, qint64(mHistorySize - mHistoryHead));
+		memcpy(&mHistory[mHistoryHead], data, size_t(tail));
+		memcpy(&mHistory[0], data + tail, size_t(len - tail));
+	}
+
+	mHistoryHead = int((mHistoryHead + len) % mHistorySize);
+	mHistoryFill = int(qMin(mHistoryFill + len, qint64(mHistorySize)));
+}
+
+void QZDecompressor::copyHistory(char *data, qint64 back, qint64 len) const
+{
+	Q_ASSERT(back <= mHistoryFill);
+	Q_ASSERT(len <= back);
+
+	auto start = mHistoryHead - int(back);
+	if (start < 0)
+		start += mHistorySize;
+
+	auto head = qMin(len, qint64(mHistorySize - start));
+	memcpy(data, &mHistory[start], size_t(head));
+	memcpy(data + head, &mHistory[0], size_t(len - head));
+}
+
+qint64 QZDecompressor::readInternal(char *data, qint64 maxlen)
+{
+	if (!isOpen())
+	{
+		return -1;
+	}
+
+	mZStream.next_out = reinterpret_cast<decltype(mZStream.next_out)>(data);
+
+	qint64 count = maxlen;
+	auto blockSize = std::numeric_limits<decltype(mZStream.avail_out)>::max();
+	bool checkpoints = mCheckpointInterval > 0 && canCheckpoint();
+	bool run = true;
+
+	while (run && count > 0)
+	{
+		if (count < blockSize)
+		{
+			blockSize = static_cast<decltype(blockSize)>(count);
+		}
+
+		mZStream.avail_out = blockSize;
+
+		while (mZStream.avail_out > 0)
+		{
+			if (mZStream.avail_in == 0)
+			{
+				auto readResult = fillInput();
+				mZStream.avail_in = readResult >= 0
+					? static_cast<decltype(mZStream.avail_in)>(readResult)
+					: 0;
+
+				if (readResult <= 0)
+				{
+					run = false;
+
+					// Sequential sources may deliver more input later
+					if (readResult < 0 || !isSequential() || mSourceFinished)
+						setStreamEnd();
+					break;
+				}
+
+				mIODevicePosition += mZStream.avail_in;
+			}
+
+			auto out = mZStream.next_out;
+			int code = decodeCounted(checkpoints ? Z_BLOCK : Z_NO_FLUSH);
+			appendHistory(reinterpret_cast<const char *>(out),
+				mZStream.next_out - out);
+
+			if (code == Z_STREAM_END || !check(code))
+			{
+				run = false;
+				setStreamEnd();
+				break;
+			}
+
+			if (checkpoints && (mZStream.data_type & 128) &&
+				!(mZStream.data_type & 64))
+			{
+				addCheckpoint();
+			}
+		}
+
+		count -= blockSize - mZStream.avail_out;
+	}
+
+	if (mHasError && count == maxlen)
+		return -1;
+
+	return maxlen - count;
+}
+
+void QZDecompressor::setStreamEnd()
+{
+	// Applied by stopReadAhead() when decoded by the worker thread
+	if (mReadAhead)
+	{
+		mReadAhead->uncompressedSize = qint64(mZStream.total_out);
+	} else
+	{
+		mUncompressedSize = qint64(mZStream.total_out);
+		mStreamEnded = true;
+	}
+}
+
+bool QZDecompressor::startReadAhead()
+{
+	Q_ASSERT(!mReadAhead);
+
+	auto pos = this->pos();
+	if (mHasError || pos != qint64(mZStream.total_out) ||
+		(mUncompressedSize >= 0 && pos >= mUncompressedSize))
+	{
+		return false;
+	}
+
+	mReadAhead.reset(new ReadAhead(this, mReadAheadBlockCount, pos));
+	mCountedStatistics = &mReadAhead->statistics;
+	mReadAhead->start();
+	return true;
+}
+
+void QZDecompressor::stopReadAhead()
+{
+	if (!mReadAhead)
+		return;
+
+	{
+		QMutexLocker locker(&mReadAhead->mutex);
+		mReadAhead->stopped = true;
+		mReadAhead->blockFree.wakeOne();
+	}
+
+	mReadAhead->wait();
+
+	std::unique_ptr<ReadAhead> readAhead;
+	readAhead.swap(mReadAhead);
+	mCountedStatistics = &mStatistics;
+
+	auto &statistics = readAhead->statistics;
+	mStatistics.compressedBytes += statistics.compressedBytes;
+	mStatistics.uncompressedBytes += statistics.uncompressedBytes;
+	mStatistics.codecTime += statistics.codecTime;
+	mStatistics.ioTime += statistics.ioTime;
+	mStatistics.seekCount += statistics.seekCount;
+
+	if (readAhead->hasError)
+		setError(readAhead->errorString);
+
+	if (readAhead->uncompressedSize >= 0)
+	{
+		mUncompressedSize = readAhead->uncompressedSize;
+		mStreamEnded = true;
+	}
+}
+
+void QZDecompressor::setError(const QString &errorString)
+{
+	// The owner does not decode while the worker thread runs
+	if (mReadAhead)
+	{
+		QMutexLocker locker(&mReadAhead->mutex);
+		mReadAhead->hasError = true;
+		mReadAhead->errorString = errorString;
+		return;
+	}
+
+	QZStream::setError(errorString);
+}
+
+qint64 QZDecompressor::readAheadData(char *data, qint64 maxlen)
+{
+	auto &readAhead = *mReadAhead;
+	QMutexLocker locker(&readAhead.mutex);
+
+	qint64 count = 0;
+	while (count < maxlen)
+	{
+		if (readAhead.blocks.empty())
+		{
+			if (readAhead.finished)
+				break;
+
+			readAhead.blockReady.wait(&readAhead.mutex);
+			continue;
+		}
+
+		auto &block = readAhead.blocks.front();
+		auto len = qMin(
+			maxlen - count, qint64(block.size() - readAhead.blockOffset));
+		memcpy(data + count, block.constData() + readAhead.blockOffset,
+			size_t(len));
+		count += len;
+		readAhead.blockOffset += int(len);
+
+		if (readAhead.blockOffset == block.size())
+		{
+			readAhead.spareBlocks.push_back(std::move(block));
+			readAhead.blocks.pop_front();
+			readAhead.blockOffset = 0;
+			readAhead.blockFree.wakeOne();
+		}
+	}
+
+	readAhead.position += count;
+	bool finished = readAhead.finished && readAhead.blocks.empty();
+	locker.unlock();
+
+	if (finished)
+		stopReadAhead();
+
+	if (count == 0 && mHasError)
+		return -1;
+
+	return count;
+}
+
+qint64 QZDecompressor::readPending(char *data, qint64 maxlen)
+{
+	auto count = qMin(pendingSize(), maxlen);
+	if (count <= 0)
+		return 0;
+
+	memcpy(data, mPending.constData() + mPendingOffset, size_t(count));
+	mPendingOffset += int(count);
+
+	if (mPendingOffset == mPending.size())
+	{
+		mPending.resize(0);
+		mPendingOffset = 0;
+	}
+
+	return count;
+}
+
+qint64 QZDecompressor::decodePending()
+{
+	if (mPendingOffset > 0)
+	{
+		mPending.remove(0, mPendingOffset);
+		mPendingOffset = 0;
+	}
+
+	// Inflate input the source has for now, at most a buffer size
+	// ahead of the reader. The rest is decoded once it is read.
+	qint64 count = 0;
+	mDecodeDeferred = false;
+	while (!mStreamEnded && !mHasError)
+	{
+		auto size = mPending.size();
+		if (size >= mBufferSize)
+		{
+			mDecodeDeferred = true;
+			break;
+		}
+
+		auto readSize = qMin(int(BUFFER_SIZE), mBufferSize - size);
+		mPending.resize(size + readSize);
+		auto readBytes = readInternal(mPending.data() + size, readSize);
+		mPending.resize(size + int(qMax(readBytes, qint64(0))));
+
+		if (readBytes <= 0)
+			break;
+
+		count += readBytes;
+		if (readBytes < readSize)
+			break;
+	}
+
+	return count;
+}
+
+void QZDecompressor::onSourceReadyRead()
+{
+	if (isOpen() && decodePending() > 0)
+		emit readyRead();
+}
+
+void QZDecompressor::onSourceReadChannelFinished()
+{
+	if (!isOpen())
+		return;
+
+	mSourceFinished = true;
+	if (decodePending() > 0)
+		emit readyRead();
+
+	emit readChannelFinished();
+}
+
+int QZDecompressor::decoderInit()
+{
+	int code =
+		inflateInit2(&mZStream, QZ_FormatWindowBits(mWindowBits, mFormat));
+	if (code != Z_OK)
+		return code;
+
+	return setRawDictionary();
+}
+
+int QZDecompressor::decoderReset()
+{
+	int code =
+		inflateReset2(&mZStream, QZ_FormatWindowBits(mWindowBits, mFormat));
+	if (code != Z_OK)
+		return code;
+
+	return setRawDictionary();
+}
+
+int QZDecompressor::setRawDictionary()
+{
+	// Raw deflate data cannot request a dictionary
+	if (mFormat != FORMAT_RAW || mDictionary.isEmpty())
+		return Z_OK;
+
+	mDictionaryRequested = true;
+	return inflateSetDictionary(&mZStream,
+		reinterpret_cast<const Bytef *>(mDictionary.constData()),
+		uInt(mDictionary.size()));
+}
+
+int QZDecompressor::decodeCounted(int flush)
+{
+	if (!mStatisticsEnabled)
+		return decode(flush);
+
+	auto startTime = statisticsTime();
+	auto availIn = mZStream.avail_in;
+	auto availOut = mZStream.avail_out;
+	int code = decode(flush);
+	countCodec(startTime, availIn - mZStream.avail_in,
+		availOut - mZStream.avail_out);
+	return code;
+}
+
+int QZDecompressor::decode(int flush)
+{
+	auto availIn = mZStream.avail_in;
+	int code = inflate(&mZStream, flush);
+	if (code != Z_NEED_DICT)
+		return code;
+
+	// zlib does not count the header bytes taken before Z_NEED_DICT,
+	// checkpoints need exact compressed offsets
+	mZStream.total_in += availIn - mZStream.avail_in;
+	mDictionaryRequested = true;
+	code = QZDictionary::supplyInflateDictionary(&mZStream, mDictionary);
+	if (code == Z_NEED_DICT)
+	{
+		mZStream.msg = "Missing preset dictionary.";
+		return Z_DATA_ERROR;
+	}
+
+	if (code == Z_DATA_ERROR)
+		mZStream.msg = "Wrong preset dictionary.";
+
+	if (code != Z_OK)
+		return code;
+
+	// With Z_BLOCK this stops before the first block without progress
+	code = inflate(&mZStream, flush);
+	return code == Z_BUF_ERROR ? Z_OK : code;
+}
+
+int QZDecompressor::decoderEnd()
+{
+	return inflateEnd(&mZStream);
+}
+
+bool QZDecompressor::canCheckpoint() const
+{
+	return true;
+}
+
+qint64 QZDecompressor::writeData(const char *, qint64)
+{
+	qWarning("QZDecompressionStream is read only!");
+	return -1;
+}
+
+struct QZCompressor::ParallelBlock
+{
+	QByteArray input;
+	QByteArray dictionary;
+	QByteArray output;
+	void *allocator;
+	int level;
+	int strategy;
+	int windowBits;
+	int memLevel;
+	int format;
+	bool last;
+	bool ok;
+	uLong check;
+	qint64 submitTime;
+	QSemaphore done;
+
+	void run();
+};
+
+void QZCompressor::ParallelBlock::run()
+{
+	auto data = reinterpret_cast<const Bytef *>(input.constData());
+	if (format == QZStream::FORMAT_GZIP)
+		check = crc32(crc32(0, Z_NULL, 0), data, uInt(input.size()));
+	else if (format == QZStream::FORMAT_ZLIB)
+		check = adler32(adler32(0, Z_NULL, 0), data, uInt(input.size()));
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	stream.zalloc = QZAllocator::zalloc;
+	stream.zfree = QZAllocator::zfree;
+	stream.opaque = allocator;
+
+	// Raw deflate, the owner writes header and trailer
+	if (deflateInit2(&stream, level, Z_DEFLATED, -windowBits, memLevel,
+			strategy) != Z_OK)
+	{
+		return;
+	}
+
+	int code = Z_OK;
+	if (!dictionary.isEmpty())
+	{
+		code = deflateSetDictionary(&stream,
+			reinterpret_cast<const Bytef *>(dictionary.constData()),
+			uInt(dictionary.size()));
+	}
+
+	// Sync flush marker follows the bound of a finished stream
+	output.resize(int(deflateBound(&stream, uLong(input.size())) + 16));
+	stream.next_in = reinterpret_cast<const Bytef *>(input.constData());
+	stream.avail_in = uInt(input.size());
+	stream.next_out = reinterpret_cast<Bytef *>(output.data());
+	stream.avail_out = uInt(output.size());
+
+	if (code == Z_OK)
+		code = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+
+	ok = (last ? code == Z_STREAM_END : code == Z_OK) &&
+		stream.avail_in == 0 && stream.avail_out > 0;
+	output.resize(int(stream.total_out));
+	deflateEnd(&stream);
+}
+
+class QZCompressor::ParallelRunnable : public QRunnable
+{
+public:
+	explicit ParallelRunnable(const std::shared_ptr<ParallelBlock> &block)
+		: mBlock(block)
+	{
+	}
+
+	virtual void run() override
+	{
+		mBlock->run();
+		mBlock->done.release();
+	}
+
+private:
+	std::shared_ptr<ParallelBlock> mBlock;
+};
+
+QZCompressor::QZCompressor(QObject *parent)
+	: QZStream(parent)
+	, mCompressionLevel(Z_DEFAULT_COMPRESSION)
+	, mConfiguredCompressionLevel(Z_DEFAULT_COMPRESSION)
+	, mStrategy(Z_DEFAULT_STRATEGY)
+	, mWindowBits(MAX_WBITS)
+	, mMemLevel(QZ_DEFAULT_MEM_LEVEL)
+	, mConfiguredWindowBits(MAX_WBITS)
+	, mConfiguredMemLevel(QZ_DEFAULT_MEM_LEVEL)
+	, mFormat(FORMAT_ZLIB)
+	, mInputBufferSize(0)
+	, mInputBufferFill(0)
+	, mTargetThroughput(0)
+	, mAdaptiveInput(0)
+	, mAdaptiveTime(0)
+	, mAdaptiveOutputTime(0)
+	, mAdaptiveMark(0)
+	, mAutoFlushBytes(0)
+	, mAutoFlushInput(0)
+	, mAutoFlushInterval(0)
+	, mAutoFlushMode(Z_SYNC_FLUSH)
+	, mParallelBlockSize(0)
+	, mParallel(false)
+	, mParallelFinished(false)
+	, mParallelCheck(0)
+	, mParallelOutputOffset(0)
+{
+}
+
+QZCompressor::QZCompressor(
+	QIODevice *target, int compressionLevel, QObject *parent)
+	: QZStream(target, parent)
+	, mCompressionLevel(compressionLevel)
+	, mConfiguredCompressionLevel(compressionLevel)
+	, mStrategy(Z_DEFAULT_STRATEGY)
+	, mWindowBits(MAX_WBITS)
+	, mMemLevel(QZ_DEFAULT_MEM_LEVEL)
+	, mConfiguredWindowBits(MAX_WBITS)
+	, mConfiguredMemLevel(QZ_DEFAULT_MEM_LEVEL)
+	, mFormat(FORMAT_ZLIB)
+	, mInputBufferSize(0)
+	, mInputBufferFill(0)
+	, mTargetThroughput(0)
+	, mAdaptiveInput(0)
+	, mAdaptiveTime(0)
+	, mAdaptiveOutputTime(0)
+	, mAdaptiveMark(0)
+	, mAutoFlushBytes(0)
+	, mAutoFlushInput(0)
+	, mAutoFlushInterval(0)
+	, mAutoFlushMode(Z_SYNC_FLUSH)
+	, mParallelBlockSize(0)
+	, mParallel(false)
+	, mParallelFinished(false)
+	, mParallelCheck(0)
+	, mParallelOutputOffset(0)
+{
+}
+
+QZCompressor::~QZCompressor()
+{
+	QZCompressor::close();
+}
+
+QByteArray QZCompressor::compressBytes(
+	const char *data, qint64 size, int compressionLevel)
+{
+	if (size < 0 || size > MAX_BYTE_ARRAY_SIZE)
+		return QByteArray();
+
+	auto backend = QZBackend::defaultBackend();
+	auto bound = backend->compressBlockBound(size_t(size));
+	if (bound > size_t(MAX_BYTE_ARRAY_SIZE))
+		return QByteArray();
+
+	QByteArray result(int(bound), Qt::Uninitialized);
+	auto written = backend->compressBlock(
+		compressionLevel, data, size_t(size), result.data(), bound);
+	if (written == 0)
+		return QByteArray();
+
+	result.resize(int(written));
+	return result;
+}
+
+bool QZCompressor::isSequential() const
+{
+	return true;
+}
+
+bool QZCompressor::open(OpenMode mode)
+{
+	if (nullptr != mIODevice && initOpen(mode) &&
+		check(encoderInit()))
+	{
+		mode |= Truncate;
+		mode &= ~(ReadOnly | Append);
+		bool openOk = QZStream::open(mode);
+		Q_ASSERT(openOk);
+		Q_UNUSED(openOk);
+
+		QObject::connect(
+			mIODevice, &QIODevice::aboutToClose, this, &QZCompressor::close);
+		return true;
+	}
+
+	return false;
+}
+
+void QZCompressor::flushToFile()
+{
+	if (!mHasError)
+	{
+		auto fileDevice = qobject_cast<QFileDevice *>(mIODevice);
+		if (fileDevice)
+		{
+			if (!fileDevice->flush())
+			{
+				mHasError = true;
+				setErrorString(fileDevice->errorString());
+			}
+		}
+	}
+}
+
+void QZCompressor::close()
+{
+	if (!isOpen())
+	{
+		return;
+	}
+
+	QObject::disconnect(
+		mIODevice, &QIODevice::aboutToClose, this, &QZCompressor::close);
+
+	QZStream::close();
+
+	finishStream();
+	check(encoderEnd());
+	flushToFile();
+}
+
+bool QZCompressor::flush(int mode)
+{
+	if (!isOpen() || mHasError)
+		return false;
+
+	if (mode != Z_SYNC_FLUSH && mode != Z_FULL_FLUSH)
+	{
+		qWarning("Unsupported flush mode!");
+		return false;
+	}
+
+	mAutoFlushInput = 0;
+	mAutoFlushTimer.restart();
+	if (mStatisticsEnabled)
+		mStatistics.flushCount++;
+
+	if (!flushStream(mode))
+		return false;
+
+	flushToFile();
+	return !mHasError;
+}
+
+bool QZCompressor::finishStream()
+{
+	return flushStream(Z_FINISH);
+}
+
+bool QZCompressor::flushStream(int flush)
+{
+	if (!flushInputBuffer())
+		return false;
+
+	mZStream.next_in = Z_NULL;
+	mZStream.avail_in = 0;
+
+	while (true)
+	{
+		int result = encodeCounted(flush);
+		// Nothing left to flush
+		if (result == Z_BUF_ERROR && flush != Z_FINISH)
+			result = Z_OK;
+
+		if (!check(result))
+			return false;
+
+		if (flush == Z_FINISH ? result == Z_STREAM_END
+							  : mZStream.avail_out > 0)
+		{
+			break;
+		}
+
+		Q_ASSERT(mZStream.avail_out == 0);
+
+		if (!flushBuffer(mBufferSize))
+			return false;
+
+		mIODevicePosition += mBufferSize;
+		mZStream.next_out = mBuffer.get();
+		mZStream.avail_out = uInt(mBufferSize);
+	}
+
+	auto size = int(mBufferSize - mZStream.avail_out);
+	if (size > 0)
+	{
+		if (!flushBuffer(size))
+			return false;
+
+		mIODevicePosition += size;
+		mZStream.next_out = mBuffer.get();
+		mZStream.avail_out = uInt(mBufferSize);
+	}
+
+	return true;
+}
+
+qint64 QZCompressor::size() const
+{
+	return isOpen() ? totalIn() : 0;
+}
+
+qint64 QZCompressor::totalIn() const
+{
+	return qint64(mZStream.total_in) + mInputBufferFill;
+}
+
+bool QZCompressor::canReadLine() const
+{
+	qWarning("QZCompressionStream is write only!");
+	return false;
+}
+
+qint64 QZCompressor::bytesToWrite() const
+{
+	return isOpen() ? mZStream.avail_out : 0;
+}
+
+qint64 QZCompressor::writeData(const char *data, qint64 maxlen)
+{
+	auto written = writeInput(data, maxlen);
+	if (written > 0)
+		autoFlush(written);
+
+	return written;
+}
+
+void QZCompressor::autoFlush(qint64 written)
+{
+	mAutoFlushInput += written;
+	if ((mAutoFlushBytes > 0 && mAutoFlushInput >= mAutoFlushBytes) ||
+		(mAutoFlushInterval > 0 &&
+			mAutoFlushTimer.hasExpired(mAutoFlushInterval)))
+	{
+		flush(mAutoFlushMode);
+	}
+}
+
+qint64 QZCompressor::writeInput(const char *data, qint64 maxlen)
+{
+	if (maxlen == 0)
+		return 0;
+
+	if (!mIODevice->isOpen())
+	{
+		mHasError = true;
+		setErrorString("Target IO device is not open.");
+		return -1;
+	}
+
+	if (maxlen <= qint64(mInputBufferSize - mInputBufferFill))
+	{
+		stageInput(data, maxlen);
+		return maxlen;
+	}
+
+	if (!flushInputBuffer())
+		return -1;
+
+	if (maxlen < qint64(mInputBufferSize))
+	{
+		stageInput(data, maxlen);
+		return maxlen;
+	}
+
+	return compressInput(data, maxlen);
+}
+
+void QZCompressor::stageInput(const char *data, qint64 size)
+{
+	memcpy(mInputBuffer.get() + mInputBufferFill, data, size_t(size));
+	mInputBufferFill += int(size);
+}
+
+bool QZCompressor::flushInputBuffer()
+{
+	if (mInputBufferFill == 0)
+		return true;
+
+	auto size = qint64(mInputBufferFill);
+	mInputBufferFill = 0;
+	return compressInput(mInputBuffer.get(), size) == size;
+}
+
+qint64 QZCompressor::compressInput(const char *data, qint64 maxlen)
+{
+	bool adaptive = mTargetThroughput > 0;
+	auto startTime = adaptive ? adaptiveClock() : 0;
+
+	qint64 count = maxlen;
+	auto blockSize = std::numeric_limits<decltype(mZStream.avail_in)>::max();
+
+	mZStream.next_in =
+		reinterpret_cast<decltype(mZStream.next_in)>(const_cast<char *>(data));
+
+	bool run = true;
+	while (run && count > 0)
+	{
+		if (count < blockSize)
+		{
+			blockSize = static_cast<decltype(blockSize)>(count);
+		}
+
+		mZStream.avail_in = blockSize;
+
+		while (mZStream.avail_in > 0)
+		{
+			if (!check(encodeCounted(Z_NO_FLUSH)))
+			{
+				run = false;
+				break;
+			}
+			if (mZStream.avail_out == 0)
+			{
+				auto outputStart = adaptive ? adaptiveClock() : 0;
+				if (!flushBuffer(mBufferSize))
+				{
+					run = false;
+					break;
+				}
+
+				if (adaptive)
+					mAdaptiveOutputTime += adaptiveClock() - outputStart;
+
+				mIODevicePosition += mBufferSize;
+				mZStream.next_out = mBuffer.get();
+				mZStream.avail_out = uInt(mBufferSize);
+			}
+		}
+
+		count -= blockSize - mZStream.avail_in;
+	}
+
+	// Parallel blocks are measured by receiveParallelBlock()
+	if (adaptive && run && !mParallel)
+		adaptLevel(maxlen - count, adaptiveClock() - startTime);
+
+	return maxlen - count;
+}
+
+qint64 QZCompressor::adaptiveClock()
+{
+	if (!mAdaptiveTimer.isValid())
+		mAdaptiveTimer.start();
+
+	return mAdaptiveTimer.nsecsElapsed();
+}
+
+void QZCompressor::adaptLevel(qint64 input, qint64 nsecs)
+{
+	mAdaptiveInput += input;
+	mAdaptiveTime += nsecs;
+	if (mAdaptiveInput < QZ_ADAPTIVE_INTERVAL)
+		return;
+
+	auto throughput =
+		mAdaptiveInput * 1000000000 / qMax(mAdaptiveTime, qint64(1));
+	auto encodeTime = mAdaptiveTime - mAdaptiveOutputTime;
+	int level = mCompressionLevel == Z_DEFAULT_COMPRESSION ? 6
+														   : mCompressionLevel;
+	if (throughput < mTargetThroughput)
+	{
+		// Smaller output drains faster when the target is slow
+		level += encodeTime > mAdaptiveOutputTime ? -1 : 1;
+	} else if (throughput > mTargetThroughput + mTargetThroughput / 4)
+	{
+		level++;
+	}
+
+	mAdaptiveInput = 0;
+	mAdaptiveTime = 0;
+	mAdaptiveOutputTime = 0;
+
+	level = qBound(int(Z_BEST_SPEED), level, int(Z_BEST_COMPRESSION));
+	if (level == mCompressionLevel)
+		return;
+
+	mCompressionLevel = level;
+	updateEncoderLevel();
+}
+
+bool QZCompressor::initOpen(OpenMode mode)
+{
+	Q_ASSERT(!isOpen());
+	Q_ASSERT(nullptr != mIODevice);
+
+	if (0 == (mode & WriteOnly))
+	{
+		mHasError = true;
+		setErrorString("Cannot open compression stream whith no write mode.");
+		return false;
+	}
+
+	if (mFormat == FORMAT_GZIP && !mDictionary.isEmpty())
+	{
+		mHasError = true;
+		setErrorString("gzip format cannot have a preset dictionary.");
+		return false;
+	}
+
+	mCompressionLevel = mConfiguredCompressionLevel;
+	if (!openIODevice(mode))
+	{
+		return false;
+	}
+
+	if (!mIODevice->isWritable())
+	{
+		mHasError = true;
+		setErrorString("Target IO device is not writable.");
+		return false;
+	}
+
+	if (mIODevice->isTextModeEnabled())
+	{
+		mHasError = true;
+		setErrorString("Target IO device is not binary.");
+		return false;
+	}
+
+	mHasError = false;
+	setErrorString(QString());
+
+	if (!initAllocator())
+		return false;
+
+	if (!mInputBuffer.reset(mBuffer.allocator(), size_t(mInputBufferSize)))
+	{
+		mHasError = true;
+		setErrorString("Out of memory.");
+		return false;
+	}
+
+	mInputBufferFill = 0;
+	mAutoFlushInput = 0;
+	mAutoFlushTimer.start();
+	mIODevicePosition = mIODeviceOriginalPosition;
+	mZStream.next_out = mBuffer.get();
+	mZStream.avail_out = uInt(mBufferSize);
+
+	return true;
+}
+
+qint64 QZCompressor::readData(char *, qint64)
+{
+	warnWriteOnly();
+	return -1;
+}
+
+qint64 QZCompressor::bytesAvailable() const
 {
 	warnWriteOnly();
 	return -1;
 }
 
+int QZCompressor::encoderInit()
+{
+	mParallel = mParallelBlockSize > 0;
+	if (mParallel)
+		return encoderReset();
+
+	int code = deflateInit2(&mZStream, mCompressionLevel, Z_DEFLATED,
+		QZ_FormatWindowBits(mWindowBits, mFormat), mMemLevel, mStrategy);
+	if (code != Z_OK)
+		return code;
+
+	return setEncoderDictionary();
+}
+
+int QZCompressor::encoderReset()
+{
+	if (mParallel)
+	{
+		resetParallel();
+		return Z_OK;
+	}
+
+	int code = deflateReset(&mZStream);
+	if (code != Z_OK)
+		return code;
+
+	return setEncoderDictionary();
+}
+
+int QZCompressor::setEncoderDictionary()
+{
+	if (mDictionary.isEmpty())
+		return Z_OK;
+
+	// zlib counts the dictionary as input, size() and chunks must not
+	auto totalIn = mZStream.total_in;
+	int code = deflateSetDictionary(&mZStream,
+		reinterpret_cast<const Bytef *>(mDictionary.constData()),
+		uInt(mDictionary.size()));
+	mZStream.total_in = totalIn;
+	return code;
+}
+
+void QZCompressor::updateEncoderLevel()
+{
+	while (true)
+	{
+		// deflateParams() needs room for the pending block and
+		// deflate() fails without any room left
+		int code = encoderSetLevel();
+		bool full = mZStream.avail_out == 0;
+		if (full)
+		{
+			if (!flushBuffer(mBufferSize))
+				break;
+
+			mIODevicePosition += mBufferSize;
+			mZStream.next_out = mBuffer.get();
+			mZStream.avail_out = uInt(mBufferSize);
+		}
+
+		if (code != Z_BUF_ERROR || !full)
+		{
+			check(code);
+			break;
+		}
+	}
+}
+
+int QZCompressor::encoderSetLevel()
+{
+	// Parallel blocks take the level when submitted
+	if (mParallel)
+		return Z_OK;
+
+	return deflateParams(&mZStream, mCompressionLevel, mStrategy);
+}
+
+int QZCompressor::encodeCounted(int flush)
+{
+	if (!mStatisticsEnabled)
+		return encode(flush);
+
+	auto startTime = statisticsTime();
+	auto availIn = mZStream.avail_in;
+	auto availOut = mZStream.avail_out;
+	int code = encode(flush);
+	countCodec(startTime, availOut - mZStream.avail_out,
+		availIn - mZStream.avail_in);
+	return code;
+}
+
+int QZCompressor::encode(int flush)
+{
+	if (mParallel)
+		return encodeParallel(flush);
+
+	return deflate(&mZStream, flush);
+}
+
+int QZCompressor::encoderEnd()
+{
+	if (mParallel)
+	{
+		waitParallelBlocks();
+		mParallelInput.clear();
+		mParallelWindow.clear();
+		mParallelOutput.clear();
+		mParallel = false;
+		return Z_OK;
+	}
+
+	return deflateEnd(&mZStream);
+}
+
+void QZCompressor::resetParallel()
+{
+	waitParallelBlocks();
+	mParallelFinished = false;
+	mParallelCheck = mFormat == FORMAT_GZIP ? crc32(0, Z_NULL, 0)
+		: adler32(0, Z_NULL, 0);
+	mParallelInput.clear();
+	mParallelWindow = mDictionary.right(1 << mWindowBits);
+	mParallelOutputOffset = 0;
+	mZStream.total_in = 0;
+	mZStream.total_out = 0;
+	mParallelOutput.clear();
+
+	if (mFormat == FORMAT_RAW)
+		return;
+
+	if (mFormat == FORMAT_GZIP)
+	{
+		// No name, time or extra fields, unknown OS
+		char extraFlags = 0;
+		if (mCompressionLevel == Z_BEST_COMPRESSION)
+			extraFlags = 2;
+		else if (mStrategy >= Z_HUFFMAN_ONLY || mCompressionLevel < 2)
+			extraFlags = 4;
+
+		const char header[] = { '\x1F', '\x8B', Z_DEFLATED, 0, 0, 0, 0, 0,
+			extraFlags, '\xFF' };
+		mParallelOutput.append(header, int(sizeof(header)));
+		return;
+	}
+
+	// Same header deflate writes
+	int levelFlags;
+	if (mStrategy >= Z_HUFFMAN_ONLY)
+		levelFlags = 0;
+	else if (mCompressionLevel == Z_DEFAULT_COMPRESSION ||
+		mCompressionLevel == 6)
+		levelFlags = 2;
+	else if (mCompressionLevel < 2)
+		levelFlags = 0;
+	else if (mCompressionLevel < 6)
+		levelFlags = 1;
+	else
+		levelFlags = 3;
+
+	uint header = (Z_DEFLATED + uint((mWindowBits - 8) << 4)) << 8;
+	header |= uint(levelFlags << 6);
+	if (!mDictionary.isEmpty())
+		header |= 0x20;
+	header += 31 - header % 31;
+
+	mParallelOutput.append(char(header >> 8));
+	mParallelOutput.append(char(header));
+	if (!mDictionary.isEmpty())
+		appendParallelCheck(QZDictionary::idOf(mDictionary));
+}
+
+void QZCompressor::appendParallelCheck(quint32 value)
+{
+	mParallelOutput.append(char(value >> 24));
+	mParallelOutput.append(char(value >> 16));
+	mParallelOutput.append(char(value >> 8));
+	mParallelOutput.append(char(value));
+}
+
+void QZCompressor::appendParallelTrailer()
+{
+	if (mFormat == FORMAT_ZLIB)
+	{
+		appendParallelCheck(quint32(mParallelCheck));
+		return;
+	}
+
+	if (mFormat != FORMAT_GZIP)
+		return;
+
+	// Little endian CRC-32 and input size modulo 2^32
+	quint32 values[] = { quint32(mParallelCheck), quint32(mZStream.total_in) };
+	for (auto value : values)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			mParallelOutput.append(char(value >> (i * 8)));
+		}
+	}
+}
+
+int QZCompressor::encodeParallel(int flush)
+{
+	while (true)
+	{
+		auto outputSize = qMin(qint64(mZStream.avail_out),
+			qint64(mParallelOutput.size() - mParallelOutputOffset));
+		if (outputSize > 0)
+		{
+			memcpy(mZStream.next_out,
+				mParallelOutput.constData() + mParallelOutputOffset,
+				size_t(outputSize));
+			mZStream.next_out += outputSize;
+			mZStream.avail_out -= uInt(outputSize);
+			mZStream.total_out += uLong(outputSize);
+			mParallelOutputOffset += int(outputSize);
+		}
+
+		if (mZStream.avail_out == 0)
+			return Z_OK;
+
+		if (mParallelFinished)
+			return Z_STREAM_END;
+
+		mParallelOutput.clear();
+		mParallelOutputOffset = 0;
+
+		if (mZStream.avail_in > 0)
+		{
+			auto inputSize = qMin(qint64(mZStream.avail_in),
+				qint64(mParallelBlockSize - mParallelInput.size()));
+			mParallelInput.append(
+				reinterpret_cast<const char *>(mZStream.next_in),
+				int(inputSize));
+			mZStream.next_in += inputSize;
+			mZStream.avail_in -= uInt(inputSize);
+			mZStream.total_in += uLong(inputSize);
+
+			if (mParallelInput.size() == mParallelBlockSize &&
+				!submitParallelBlock(false))
+			{
+				return Z_MEM_ERROR;
+			}
+
+			continue;
+		}
+
+		if (flush == Z_NO_FLUSH)
+			return Z_OK;
+
+		if (flush != Z_FINISH)
+		{
+			// Blocks end with a sync flush already
+			if (!mParallelInput.isEmpty() && !submitParallelBlock(false))
+				return Z_MEM_ERROR;
+
+			if (flush == Z_FULL_FLUSH)
+				mParallelWindow.clear();
+
+			if (mParallelBlocks.empty())
+				return Z_OK;
+
+			while (!mParallelBlocks.empty())
+			{
+				if (!receiveParallelBlock())
+					return Z_MEM_ERROR;
+			}
+
+			continue;
+		}
+
+		if (!submitParallelBlock(true))
+			return Z_MEM_ERROR;
+
+		while (!mParallelBlocks.empty())
+		{
+			if (!receiveParallelBlock())
+				return Z_MEM_ERROR;
+		}
+
+		appendParallelTrailer();
+		mParallelFinished = true;
+	}
+}
+
+bool QZCompressor::submitParallelBlock(bool last)
+{
+	// Bounded queue keeps the pool busy while output is written
+	auto maxBlocks =
+		2 * qMax(QThreadPool::globalInstance()->maxThreadCount(), 1);
+	while (int(mParallelBlocks.size()) >= maxBlocks ||
+		(!mParallelBlocks.empty() &&
+			mParallelBlocks.front()->done.available() > 0))
+	{
+		if (!receiveParallelBlock())
+			return false;
+	}
+
+	std::shared_ptr<ParallelBlock> block(new ParallelBlock);
+	block->input = mParallelInput;
+	block->dictionary = mParallelWindow;
+	block->allocator = mZStream.opaque;
+	block->level = mCompressionLevel;
+	block->strategy = mStrategy;
+	block->windowBits = mWindowBits;
+	block->memLevel = mMemLevel;
+	block->format = mFormat;
+	block->last = last;
+	block->ok = false;
+	block->check = 0;
+	block->submitTime = mTargetThroughput > 0 ? adaptiveClock() : 0;
+
+	auto windowSize = 1 << mWindowBits;
+	if (mParallelInput.size() >= windowSize)
+	{
+		mParallelWindow = mParallelInput.right(windowSize);
+	} else
+	{
+		mParallelWindow.append(mParallelInput);
+		mParallelWindow = mParallelWindow.right(windowSize);
+	}
+	mParallelInput.clear();
+
+	mParallelBlocks.push_back(block);
+	QThreadPool::globalInstance()->start(new ParallelRunnable(block));
+	return true;
+}
+
+bool QZCompressor::receiveParallelBlock()
+{
+	auto block = mParallelBlocks.front();
+	mParallelBlocks.pop_front();
+	block->done.acquire();
+	if (!block->ok)
+	{
+		mZStream.msg = "Parallel deflate failed.";
+		return false;
+	}
+
+	mParallelOutput.append(block->output);
+	auto size = z_off_t(block->input.size());
+	if (mFormat == FORMAT_GZIP)
+		mParallelCheck = crc32_combine(mParallelCheck, block->check, size);
+	else if (mFormat == FORMAT_ZLIB)
+		mParallelCheck = adler32_combine(mParallelCheck, block->check, size);
+
+	if (mTargetThroughput > 0)
+	{
+		// From submission or the previous completion, whichever is
+		// later, so the time between writes is not counted
+		auto now = adaptiveClock();
+		adaptLevel(qint64(size), now - qMax(block->submitTime, mAdaptiveMark));
+		mAdaptiveMark = now;
+	}
+
+	return true;
+}
+
+void QZCompressor::waitParallelBlocks()
+{
+	// Blocks use the stream allocator
+	for (auto &block : mParallelBlocks)
+	{
+		block->done.acquire();
+	}
+
+	mParallelBlocks.clear();
+}
+
+void QZCompressor::setInputBufferSize(int size)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change input buffer size of an open stream!");
+		return;
+	}
+
+	mInputBufferSize = qMax(size, 0);
+}
+
+void QZCompressor::setAutoFlushMode(int mode)
+{
+	if (mode != Z_SYNC_FLUSH && mode != Z_FULL_FLUSH)
+	{
+		qWarning("Unsupported flush mode!");
+		return;
+	}
+
+	mAutoFlushMode = mode;
+}
+
+void QZCompressor::setParallelBlockSize(int size)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change parallel block size of an open stream!");
+		return;
+	}
+
+	mParallelBlockSize = qMax(size, 0);
+}
+
 bool QZCompressor::flushBuffer(int size)
 {
 	Q_ASSERT(mIODevice->isOpen());
-	if (mIODevice->write(reinterpret_cast<char *>(mBuffer.get()), size) != size)
+
+	// Target is only positioned when output is written
+	if (mIODevice->pos() != mIODevicePosition && !ioDeviceSeekInit())
+		return false;
+
+	auto startTime = statisticsTime();
+	auto written =
+		mIODevice->write(reinterpret_cast<char *>(mBuffer.get()), size);
+	countIO(startTime);
+	if (written != size)
 	{
 		mHasError = true;
 		setErrorString(mIODevice->errorString());
@@ -604,8 +2767,201 @@ void QZCompressor::warnWriteOnly() const
 	qWarning("QZCompressionStream is write only!");
 }
 
+void QZCompressor::setDictionary(const QByteArray &dictionary)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change dictionary of an open stream!");
+		return;
+	}
+
+	mDictionary = dictionary;
+}
+
+void QZCompressor::releaseBuffers()
+{
+	mInputBuffer.reset();
+	QZStream::releaseBuffers();
+}
+
+void QZCompressor::resetFootprint()
+{
+	QZStream::resetFootprint();
+	mWindowBits = mConfiguredWindowBits;
+	mMemLevel = mConfiguredMemLevel;
+}
+
+qint64 QZCompressor::estimateFootprint() const
+{
+	return QZStream::estimateFootprint() + mInputBufferSize +
+		(qint64(1) << (mWindowBits + 2)) + (qint64(1) << (mMemLevel + 9)) +
+		QZ_DEFLATE_STATE_SIZE;
+}
+
+bool QZCompressor::shrinkFootprint()
+{
+	if (QZStream::shrinkFootprint())
+		return true;
+
+	if (mMemLevel > 1)
+	{
+		mMemLevel--;
+		return true;
+	}
+
+	if (mWindowBits > 9)
+	{
+		mWindowBits--;
+		return true;
+	}
+
+	return false;
+}
+
+void QZCompressor::setTargetThroughput(qint64 bytesPerSecond)
+{
+	mTargetThroughput = qMax(bytesPerSecond, qint64(0));
+	mAdaptiveInput = 0;
+	mAdaptiveTime = 0;
+	mAdaptiveOutputTime = 0;
+}
+
+void QZCompressor::setStrategy(int strategy)
+{
+	if (strategy < Z_DEFAULT_STRATEGY || strategy > Z_FIXED)
+	{
+		qWarning("Unsupported deflate strategy!");
+		return;
+	}
+
+	if (mStrategy == strategy)
+		return;
+
+	mStrategy = strategy;
+	if (!isOpen())
+		return;
+
+	updateEncoderLevel();
+}
+
+void QZCompressor::setWindowBits(int bits)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change window bits of an open stream!");
+		return;
+	}
+
+	// zlib refuses 8 for raw deflate of parallel blocks
+	if (bits < 9 || bits > MAX_WBITS)
+	{
+		qWarning("Unsupported window bits!");
+		return;
+	}
+
+	mConfiguredWindowBits = bits;
+	mWindowBits = bits;
+}
+
+void QZCompressor::setMemLevel(int level)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change memory level of an open stream!");
+		return;
+	}
+
+	if (level < 1 || level > MAX_MEM_LEVEL)
+	{
+		qWarning("Unsupported memory level!");
+		return;
+	}
+
+	mConfiguredMemLevel = level;
+	mMemLevel = level;
+}
+
+void QZCompressor::setFormat(int format)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change format of an open stream!");
+		return;
+	}
+
+	if (format < FORMAT_ZLIB || format > FORMAT_RAW)
+	{
+		qWarning("Unsupported format!");
+		return;
+	}
+
+	mFormat = format;
+}
+
+struct QZCompressorPreset
+{
+	const char *name;
+	int level;
+	int strategy;
+	int windowBits;
+	int memLevel;
+};
+
+static const QZCompressorPreset QZ_CompressorPresets[] = {
+	{"default", Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, MAX_WBITS,
+		QZ_DEFAULT_MEM_LEVEL},
+	{"fast", Z_BEST_SPEED, Z_DEFAULT_STRATEGY, MAX_WBITS,
+		QZ_DEFAULT_MEM_LEVEL},
+	// Runs of equal pixels or table entries
+	{"fast-rle", Z_BEST_SPEED, Z_RLE, MAX_WBITS, QZ_DEFAULT_MEM_LEVEL},
+	// Small values with some randomness, such as filtered images
+	{"filtered", Z_DEFAULT_COMPRESSION, Z_FILTERED, MAX_WBITS,
+		QZ_DEFAULT_MEM_LEVEL},
+	// About 24 KB of deflate state instead of 256 KB
+	{"low-memory", Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, 12, 4},
+	{"max-ratio", Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, MAX_WBITS,
+		MAX_MEM_LEVEL}};
+
+QList<QByteArray> QZCompressor::presetNames()
+{
+	QList<QByteArray> result;
+	for (auto &preset : QZ_CompressorPresets)
+	{
+		result.append(QByteArray(preset.name));
+	}
+
+	return result;
+}
+
+bool QZCompressor::setPreset(const QByteArray &name)
+{
+	if (isOpen())
+	{
+		qWarning("Cannot change preset of an open stream!");
+		return false;
+	}
+
+	for (auto &preset : QZ_CompressorPresets)
+	{
+		if (name == preset.name)
+		{
+			mCompressionLevel = preset.level;
+			mConfiguredCompressionLevel = preset.level;
+			mStrategy = preset.strategy;
+			mConfiguredWindowBits = preset.windowBits;
+			mConfiguredMemLevel = preset.memLevel;
+			mWindowBits = preset.windowBits;
+			mMemLevel = preset.memLevel;
+			return true;
+		}
+	}
+
+	return false;
+}
+
 void QZCompressor::setCompressionLevel(int level)
 {
+	mConfiguredCompressionLevel = level;
 	if (mCompressionLevel == level)
 		return;
 
@@ -613,5 +2969,5 @@ void QZCompressor::setCompressionLevel(int level)
 	if (!isOpen())
 		return;
 
-	check(deflateParams(&mZStream, mCompressionLevel, Z_DEFAULT_STRATEGY));
+	updateEncoderLevel();
 }
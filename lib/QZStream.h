@@ -1,20 +1,95 @@
 ﻿#pragma once
 
 #include <QIODevice>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QList>
+#include <atomic>
+#include <limits>
+#include <deque>
 #include <memory>
+#include <vector>
 
 #include <zlib.h>
 
+#include "QZAllocator.h"
+#include "QZBackend.h"
+#include "QZDictionary.h"
+
 class QZStream : public QIODevice
 {
 	Q_OBJECT
 
 public:
+	// Framing of deflate data
+	enum Format
+	{
+		FORMAT_ZLIB,
+		FORMAT_GZIP,
+		// No header and checksum
+		FORMAT_RAW,
+		// zlib or gzip detected from the header, decompression only
+		FORMAT_AUTO
+	};
+
+	// See setStatisticsEnabled()
+	struct Statistics
+	{
+		// Input and output of the codec, data decoded again
+		// after backward seeks is counted again
+		qint64 compressedBytes;
+		qint64 uncompressedBytes;
+		// Nanoseconds the stream thread spent in the codec
+		// and in reads and writes of the IO device
+		qint64 codecTime;
+		qint64 ioTime;
+		// IO device seeks, backward seeks decoding again from the
+		// start of the stream and QZCompressor::flush() calls
+		qint64 seekCount;
+		qint64 restartCount;
+		qint64 flushCount;
+	};
+
 	inline QIODevice *ioDevice() const;
 	void setIODevice(QIODevice *ioDevice);
 
 	bool hasError() const;
 
+	// Source of zlib state and I/O buffers, can only be changed
+	// while closed. Null means QZAllocator::defaultAllocator().
+	inline QZAllocator *allocator() const;
+	void setAllocator(QZAllocator *allocator);
+
+	// Codec for whole buffer paths such as chunked CCZ.
+	// Null means QZBackend::defaultBackend().
+	inline QZBackend *backend() const;
+	void setBackend(QZBackend *backend);
+
+	// Size of the compressed data I/O buffer, 32 KB by default.
+	// Can only be changed while closed.
+	inline int bufferSize() const;
+	void setBufferSize(int size);
+
+	// Limit in bytes for zlib state and stream buffers. Opening
+	// uses a smaller buffer size, then cache size, or compressor
+	// memory level and window bits until the estimate fits, and
+	// fails if it does not. The configured values are kept.
+	// Zero means no limit. Can only be changed while closed.
+	inline qint64 memoryBudget() const;
+	void setMemoryBudget(qint64 bytes);
+
+	// Bytes this stream holds in zlib state and stream buffers
+	qint64 memoryFootprint() const;
+	// Sum of memoryFootprint() of all streams
+	static qint64 totalMemoryFootprint();
+
+	// Statistics are collected while enabled, disabled by default.
+	// With read ahead running, query them after close().
+	inline bool isStatisticsEnabled() const;
+	void setStatisticsEnabled(bool enabled);
+	inline const Statistics &statistics() const;
+	void resetStatistics();
+
 protected:
 	QZStream(QObject *parent = nullptr);
 	QZStream(QIODevice *stream, QObject *parent = nullptr);
@@ -23,10 +98,28 @@ protected:
 	virtual bool waitForBytesWritten(int msecs) override;
 
 	bool check(int code);
+	// Error of stream work that may run on a worker thread
+	virtual void setError(const QString &errorString);
 
 protected:
 	bool openIODevice(OpenMode mode);
 	bool ioDeviceSeekInit();
+	bool initAllocator();
+	QZBackend *usedBackend() const;
+
+	// Start time of counted work, zero while statistics are disabled
+	inline qint64 statisticsTime() const;
+	inline void countCodec(
+		qint64 startTime, qint64 compressed, qint64 uncompressed);
+	inline void countIO(qint64 startTime);
+
+	// Buffers from the stream allocator, released when it changes
+	virtual void releaseBuffers();
+	// Memory budget of the next open, see setMemoryBudget().
+	// Reset restores the effective values from the configured ones.
+	virtual void resetFootprint();
+	virtual qint64 estimateFootprint() const;
+	virtual bool shrinkFootprint();
 
 protected:
 	QIODevice *mIODevice;
@@ -35,10 +128,35 @@ protected:
 
 	enum
 	{
-		BUFFER_SIZE = 32768
+		BUFFER_SIZE = 32768,
+		WINDOW_SIZE = 32768,
+		// QByteArray limit
+		MAX_BYTE_ARRAY_SIZE = std::numeric_limits<int>::max() - 32
+	};
+
+	// Counts blocks of the stream allocator
+	struct MemoryCounter : public QZAllocator
+	{
+		QZAllocator *allocator;
+		std::atomic<qint64> size;
+
+		virtual void *allocate(size_t size) override;
+		virtual void deallocate(void *ptr, size_t size) override;
 	};
 
-	std::unique_ptr<Bytef[]> mBuffer;
+	QZAllocator *mAllocator;
+	QZBackend *mBackend;
+	MemoryCounter mMemoryCounter;
+	QZAllocatedArray<Bytef> mBuffer;
+	int mBufferSize;
+	int mConfiguredBufferSize;
+	qint64 mMemoryBudget;
+
+	bool mStatisticsEnabled;
+	Statistics mStatistics;
+	// Counts of stream work, redirected while a worker thread does it
+	Statistics *mCountedStatistics;
+	QElapsedTimer mStatisticsTimer;
 
 	z_stream mZStream;
 
@@ -55,6 +173,59 @@ inline bool QZStream::hasError() const
 	return mHasError;
 }
 
+QZAllocator *QZStream::allocator() const
+{
+	return mAllocator;
+}
+
+QZBackend *QZStream::backend() const
+{
+	return mBackend;
+}
+
+int QZStream::bufferSize() const
+{
+	return mConfiguredBufferSize;
+}
+
+qint64 QZStream::memoryBudget() const
+{
+	return mMemoryBudget;
+}
+
+bool QZStream::isStatisticsEnabled() const
+{
+	return mStatisticsEnabled;
+}
+
+const QZStream::Statistics &QZStream::statistics() const
+{
+	return mStatistics;
+}
+
+qint64 QZStream::statisticsTime() const
+{
+	return mStatisticsEnabled ? mStatisticsTimer.nsecsElapsed() : 0;
+}
+
+void QZStream::countCodec(
+	qint64 startTime, qint64 compressed, qint64 uncompressed)
+{
+	if (!mStatisticsEnabled)
+		return;
+
+	mCountedStatistics->codecTime +=
+		mStatisticsTimer.nsecsElapsed() - startTime;
+	mCountedStatistics->compressedBytes += compressed;
+	mCountedStatistics->uncompressedBytes += uncompressed;
+}
+
+void QZStream::countIO(qint64 startTime)
+{
+	if (mStatisticsEnabled)
+		mCountedStatistics->ioTime += mStatisticsTimer.nsecsElapsed() - startTime;
+}
+
 class QZDecompressor : public QZStream
 {
 	Q_OBJECT
@@ -66,6 +237,69 @@ public:
 
 	void setUncompressedSize(qint64 value);
 
+	// Records a seek checkpoint every 'interval' uncompressed bytes
+	// while reading. Zero disables index building.
+	inline qint64 checkpointInterval() const;
+	void setCheckpointInterval(qint64 interval);
+
+	inline int checkpointCount() const;
+	void clearIndex();
+
+	// Size of the decoded output cache serving small reads, peek()
+	// and short backward seeks. Zero disables the cache.
+	inline int cacheSize() const;
+	void setCacheSize(int size);
+
+	// Inflate straight from mapped QFileDevice or QBuffer memory
+	// instead of copying the source through the I/O buffer.
+	inline bool isDirectInputEnabled() const;
+	inline void setDirectInputEnabled(bool enabled);
+
+	// Number of decoded blocks a worker thread inflates ahead of
+	// sequential reads from a random access source. Zero keeps
+	// decompression on the reading thread. While enabled, query
+	// the index with checkpointCount() or exportIndex() after close().
+	// Errors and statistics of the worker apply once it stopped.
+	inline int readAheadBlockCount() const;
+	void setReadAheadBlockCount(int count);
+
+	// Answers a stream compressed with a preset dictionary.
+	// When empty, the QZDictionary registered with the id
+	// requested by the stream is used.
+	inline const QByteArray &dictionary() const;
+	void setDictionary(const QByteArray &dictionary);
+
+	// Base two logarithm of the inflate window, 8 to 15. Smaller
+	// windows save memory but fail on streams deflated with larger
+	// ones. Can only be changed while closed.
+	inline int windowBits() const;
+	void setWindowBits(int bits);
+
+	// QZStream::Format of the source, FORMAT_ZLIB by default.
+	// Raw deflate data is answered with dictionary() from the start.
+	// Can only be changed while closed.
+	inline int format() const;
+	void setFormat(int format);
+
+	// Reads the rest of the stream in one pass into a buffer
+	// allocated once when the uncompressed size is known,
+	// otherwise grown geometrically starting from 'sizeHint'.
+	QByteArray readAllDecompressed(qint64 sizeHint = -1);
+
+	// One-shot decoding of a whole zlib stream with per thread state
+	// of QZBackend::defaultBackend(). Negative 'uncompressedSize'
+	// means unknown. Returns a null array on error.
+	static QByteArray decompressBytes(
+		const char *data, qint64 size, qint64 uncompressedSize = -1);
+	static inline QByteArray decompressBytes(
+		const QByteArray &bytes, qint64 uncompressedSize = -1);
+
+	// Sidecar index of the same compressed source. The index keeps
+	// size, head and tail checksum, format and window bits of the
+	// source, opening another one with it fails.
+	bool exportIndex(QIODevice *target) const;
+	bool importIndex(QIODevice *source);
+
 	virtual ~QZDecompressor() override;
 
 	virtual bool isSequential() const override;
@@ -78,18 +312,125 @@ public:
 	virtual qint64 bytesAvailable() const override;
 	virtual bool atEnd() const override;
 
+	// Sequential sources are decoded as input arrives,
+	// readyRead() is emitted when decoded data is available
+	virtual bool waitForReadyRead(int msecs) override;
+
 protected:
 	virtual bool initOpen(OpenMode mode);
 	virtual qint64 readData(char *data, qint64 maxlen) override;
 
+	virtual void releaseBuffers() override;
+	virtual void resetFootprint() override;
+	virtual qint64 estimateFootprint() const override;
+	virtual bool shrinkFootprint() override;
+
+	// Payload decoder, inflate by default. Works on mZStream buffers
+	// and totals and returns zlib codes.
+	virtual int decoderInit();
+	virtual int decoderReset();
+	virtual int decode(int flush);
+	virtual int decoderEnd();
+	// Seek checkpoints restore inflate state
+	virtual bool canCheckpoint() const;
+	virtual void setError(const QString &errorString) override;
+
 private:
+	struct Checkpoint
+	{
+		qint64 compressedOffset;
+		qint64 uncompressedOffset;
+		int bits;
+		QByteArray window;
+	};
+
+	// Identifies the source of checkpoints, size is negative
+	// when unknown
+	struct Fingerprint
+	{
+		qint64 size;
+		quint32 check;
+		int format;
+		int windowBits;
+
+		bool matches(const Fingerprint &other) const;
+	};
+
+	class ReadAhead;
+
+	void initDirectInput();
+	void releaseDirectInput();
+	qint64 fillInput();
 	bool seekInternal(qint64 pos);
+	bool resetInternal();
+	bool restoreCheckpoint(const Checkpoint &checkpoint);
+	bool readFingerprint(Fingerprint &fingerprint);
+	void applyIndexUncompressedSize();
+	int decodeCounted(int flush);
+	int setRawDictionary();
+	const Checkpoint *findCheckpoint(qint64 pos) const;
+	void addCheckpoint();
 	qint64 readInternal(char *data, qint64 maxlen);
+	void setStreamEnd();
 	virtual qint64 bytesToWrite() const override;
 	virtual qint64 writeData(const char *, qint64) override;
 
+	qint64 readCached(char *data, qint64 maxlen);
+	qint64 readHistory(char *data, qint64 pos, qint64 maxlen) const;
+	void updateHistorySize();
+	bool allocHistory(int size);
+	void clearHistory();
+	void appendHistory(const char *data, qint64 len);
+	void copyHistory(char *data, qint64 back, qint64 len) const;
+
+	bool startReadAhead();
+	void stopReadAhead();
+	qint64 readAheadData(char *data, qint64 maxlen);
+
+	inline qint64 pendingSize() const;
+	qint64 readPending(char *data, qint64 maxlen);
+	qint64 decodePending();
+	void onSourceReadyRead();
+	void onSourceReadChannelFinished();
+
 protected:
 	qint64 mUncompressedSize;
+
+	const Bytef *mDirectInput;
+	qint64 mDirectInputSize;
+
+private:
+	uchar *mMappedInput;
+	QByteArray mInputBytes;
+	bool mDirectInputEnabled;
+
+	std::vector<Checkpoint> mCheckpoints;
+	qint64 mCheckpointInterval;
+	Fingerprint mFingerprint;
+	// Uncompressed size of an imported index, used once the
+	// source matched its fingerprint
+	qint64 mIndexUncompressedSize;
+
+	QZAllocatedArray<char> mHistory;
+	int mCacheSize;
+	int mConfiguredCacheSize;
+	int mHistorySize;
+	int mHistoryFill;
+	int mHistoryHead;
+
+	std::unique_ptr<ReadAhead> mReadAhead;
+	int mReadAheadBlockCount;
+
+	QByteArray mDictionary;
+	bool mDictionaryRequested;
+	int mWindowBits;
+	int mFormat;
+
+	QByteArray mPending;
+	int mPendingOffset;
+	bool mDecodeDeferred;
+	bool mSourceFinished;
+	bool mStreamEnded;
 };
 
 inline void QZDecompressor::setUncompressedSize(qint64 value)
@@ -97,6 +438,62 @@ inline void QZDecompressor::setUncompressedSize(qint64 value)
 	mUncompressedSize = value;
 }
 
+qint64 QZDecompressor::checkpointInterval() const
+{
+	return mCheckpointInterval;
+}
+
+int QZDecompressor::checkpointCount() const
+{
+	return int(mCheckpoints.size());
+}
+
+int QZDecompressor::cacheSize() const
+{
+	return mConfiguredCacheSize;
+}
+
+bool QZDecompressor::isDirectInputEnabled() const
+{
+	return mDirectInputEnabled;
+}
+
+void QZDecompressor::setDirectInputEnabled(bool enabled)
+{
+	mDirectInputEnabled = enabled;
+}
+
+int QZDecompressor::readAheadBlockCount() const
+{
+	return mReadAheadBlockCount;
+}
+
+const QByteArray &QZDecompressor::dictionary() const
+{
+	return mDictionary;
+}
+
+int QZDecompressor::windowBits() const
+{
+	return mWindowBits;
+}
+
+int QZDecompressor::format() const
+{
+	return mFormat;
+}
+
+qint64 QZDecompressor::pendingSize() const
+{
+	return mPending.size() - mPendingOffset;
+}
+
+QByteArray QZDecompressor::decompressBytes(
+	const QByteArray &bytes, qint64 uncompressedSize)
+{
+	return decompressBytes(bytes.constData(), bytes.size(), uncompressedSize);
+}
+
 class QZCompressor : public QZStream
 {
 	Q_OBJECT
@@ -110,6 +507,85 @@ public:
 	int compressionLevel() const;
 	void setCompressionLevel(int level);
 
+	// Input bytes per second to compress at. While set, the level
+	// moves between Z_BEST_SPEED and Z_BEST_COMPRESSION after each
+	// megabyte of input: down when deflate is too slow, up when
+	// writing the output is the bottleneck or there is time to
+	// spare. Parallel blocks are measured when they complete and
+	// take the level when submitted. Zero keeps the level fixed.
+	// Each open starts from compressionLevel(), which is not changed.
+	inline qint64 targetThroughput() const;
+	void setTargetThroughput(qint64 bytesPerSecond);
+
+	// deflateInit2() strategy, Z_DEFAULT_STRATEGY by default.
+	// Z_RLE and Z_FILTERED are much faster on raw pixel data
+	// and sparse tables.
+	inline int strategy() const;
+	void setStrategy(int strategy);
+
+	// Base two logarithm of the deflate window, 9 to 15, and
+	// memory level, 1 to 9, of deflateInit2(). Smaller values save
+	// memory at some cost of ratio. Can only be changed while closed.
+	inline int windowBits() const;
+	void setWindowBits(int bits);
+	inline int memLevel() const;
+	void setMemLevel(int level);
+
+	// QZStream::Format of the output, FORMAT_ZLIB by default.
+	// gzip output cannot have a preset dictionary.
+	// Can only be changed while closed.
+	inline int format() const;
+	void setFormat(int format);
+
+	// Sets compression level, strategy, window bits and memory
+	// level at once, see presetNames(). Returns false for unknown
+	// names. Can only be changed while closed.
+	bool setPreset(const QByteArray &name);
+	static QList<QByteArray> presetNames();
+
+	// Preset dictionary, can only be changed while closed.
+	// Readers need the same dictionary, see QZDictionary.
+	inline const QByteArray &dictionary() const;
+	void setDictionary(const QByteArray &dictionary);
+
+	// Writes up to 'size' bytes are staged and compressed together,
+	// so many small writes neither run deflate nor position the
+	// target each time. Zero compresses every write at once.
+	// Can only be changed while closed.
+	inline int inputBufferSize() const;
+	void setInputBufferSize(int size);
+
+	// Compresses all input written so far and writes the output
+	// to the target, so readers can decode it without waiting for
+	// more data. Z_FULL_FLUSH also resets the compression history
+	// and lets decoding restart from this point.
+	bool flush(int mode = Z_SYNC_FLUSH);
+
+	// Flushes when 'bytes' of input were written or 'msecs' passed
+	// since the last flush, checked on each write. Zero disables.
+	inline qint64 autoFlushBytes() const;
+	inline void setAutoFlushBytes(qint64 bytes);
+	inline int autoFlushInterval() const;
+	inline void setAutoFlushInterval(int msecs);
+	// Z_SYNC_FLUSH by default or Z_FULL_FLUSH
+	inline int autoFlushMode() const;
+	void setAutoFlushMode(int mode);
+
+	// Input size of blocks deflated by QThreadPool::globalInstance()
+	// and joined into one zlib stream. Each block is primed with
+	// the 32 KB of input before it, output does not depend on the
+	// thread count. Zero deflates on the writing thread.
+	// Can only be changed while closed.
+	inline int parallelBlockSize() const;
+	void setParallelBlockSize(int size);
+
+	// One-shot zlib stream with per thread state of
+	// QZBackend::defaultBackend(). Returns a null array on error.
+	static QByteArray compressBytes(const char *data, qint64 size,
+		int compressionLevel = Z_DEFAULT_COMPRESSION);
+	static inline QByteArray compressBytes(const QByteArray &bytes,
+		int compressionLevel = Z_DEFAULT_COMPRESSION);
+
 	virtual ~QZCompressor() override;
 
 	virtual bool isSequential() const override;
@@ -127,18 +603,167 @@ protected:
 	virtual qint64 writeData(const char *data, qint64 maxlen) override;
 	void flushToFile();
 
+	virtual void releaseBuffers() override;
+	virtual void resetFootprint() override;
+	virtual qint64 estimateFootprint() const override;
+	virtual bool shrinkFootprint() override;
+
+	// Payload encoder, deflate by default. Works on mZStream buffers
+	// and totals and returns zlib codes.
+	virtual int encoderInit();
+	virtual int encoderReset();
+	virtual int encoderSetLevel();
+	virtual int encode(int flush);
+	virtual int encoderEnd();
+
+	// Ends the deflate stream and writes out all pending output
+	bool finishStream();
+	// Nanoseconds clock measuring throughput of the adaptive level
+	virtual qint64 adaptiveClock();
+	// Input bytes of the stream including staged ones
+	qint64 totalIn() const;
+
 private:
 	virtual qint64 readData(char *, qint64) override;
 	virtual qint64 bytesAvailable() const override;
 
-	bool flushBuffer(int size = BUFFER_SIZE);
+	struct ParallelBlock;
+	class ParallelRunnable;
+
+	qint64 writeInput(const char *data, qint64 maxlen);
+	void autoFlush(qint64 written);
+	bool flushStream(int flush);
+	int encodeCounted(int flush);
+	void stageInput(const char *data, qint64 size);
+	bool flushInputBuffer();
+	qint64 compressInput(const char *data, qint64 maxlen);
+	void adaptLevel(qint64 input, qint64 nsecs);
+	bool flushBuffer(int size);
 	void warnWriteOnly() const;
+	int setEncoderDictionary();
+	void updateEncoderLevel();
+
+	void resetParallel();
+	void appendParallelCheck(quint32 value);
+	void appendParallelTrailer();
+	int encodeParallel(int flush);
+	bool submitParallelBlock(bool last);
+	bool receiveParallelBlock();
+	void waitParallelBlocks();
 
 protected:
+	// Effective level, adapted to the target throughput while open
 	int mCompressionLevel;
+	int mConfiguredCompressionLevel;
+	int mStrategy;
+	int mWindowBits;
+	int mMemLevel;
+	int mConfiguredWindowBits;
+	int mConfiguredMemLevel;
+	int mFormat;
+	QByteArray mDictionary;
+
+private:
+	QZAllocatedArray<char> mInputBuffer;
+	int mInputBufferSize;
+	int mInputBufferFill;
+
+	qint64 mTargetThroughput;
+	qint64 mAdaptiveInput;
+	qint64 mAdaptiveTime;
+	qint64 mAdaptiveOutputTime;
+	qint64 mAdaptiveMark;
+	QElapsedTimer mAdaptiveTimer;
+
+	qint64 mAutoFlushBytes;
+	qint64 mAutoFlushInput;
+	int mAutoFlushInterval;
+	int mAutoFlushMode;
+	QElapsedTimer mAutoFlushTimer;
+
+	int mParallelBlockSize;
+	bool mParallel;
+	bool mParallelFinished;
+	uLong mParallelCheck;
+	QByteArray mParallelInput;
+	QByteArray mParallelWindow;
+	QByteArray mParallelOutput;
+	int mParallelOutputOffset;
+	std::deque<std::shared_ptr<ParallelBlock>> mParallelBlocks;
 };
 
+QByteArray QZCompressor::compressBytes(
+	const QByteArray &bytes, int compressionLevel)
+{
+	return compressBytes(bytes.constData(), bytes.size(), compressionLevel);
+}
+
 inline int QZCompressor::compressionLevel() const
 {
-	return mCompressionLevel;
+	return mConfiguredCompressionLevel;
+}
+
+qint64 QZCompressor::targetThroughput() const
+{
+	return mTargetThroughput;
+}
+
+int QZCompressor::strategy() const
+{
+	return mStrategy;
+}
+
+int QZCompressor::windowBits() const
+{
+	return mConfiguredWindowBits;
+}
+
+int QZCompressor::memLevel() const
+{
+	return mConfiguredMemLevel;
+}
+
+int QZCompressor::format() const
+{
+	return mFormat;
+}
+
+const QByteArray &QZCompressor::dictionary() const
+{
+	return mDictionary;
+}
+
+int QZCompressor::inputBufferSize() const
+{
+	return mInputBufferSize;
+}
+
+qint64 QZCompressor::autoFlushBytes() const
+{
+	return mAutoFlushBytes;
+}
+
+void QZCompressor::setAutoFlushBytes(qint64 bytes)
+{
+	mAutoFlushBytes = qMax(bytes, qint64(0));
+}
+
+int QZCompressor::autoFlushInterval() const
+{
+	return mAutoFlushInterval;
+}
+
+void QZCompressor::setAutoFlushInterval(int msecs)
+{
+	mAutoFlushInterval = qMax(msecs, 0);
+}
+
+int QZCompressor::autoFlushMode() const
+{
+	return mAutoFlushMode;
+}
+
+int QZCompressor::parallelBlockSize() const
+{
+	return mParallelBlockSize;
 }
@@ -1,4 +1,4 @@
-VERSION = 2.0.2
+VERSION = 2.1.0
 
 QT -= gui
 
@@ -20,11 +20,19 @@ unix|win32-g++ {
 }
 
 HEADERS += \
+    QZAllocator.h \
+    QZBackend.h \
+    QZDictionary.h \
     QZStream.h \
+    QCCZCodec.h \
     QCCZStream.h
 
 SOURCES += \
+    QZAllocator.cpp \
+    QZBackend.cpp \
+    QZDictionary.cpp \
     QZStream.cpp \
+    QCCZCodec.cpp \
     QCCZStream.cpp
 
 include(../QZStream.pri)
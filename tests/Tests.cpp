@@ -2,97 +2,1767 @@
 
 #include "QZStream.h"
 #include "QCCZStream.h"
+#include "QZDictionary.h"
 
 #undef compress
 
 #include <QBuffer>
+#include <QDataStream>
+#include <QFile>
 #include <QImageReader>
 #include <QImageWriter>
 #include <QTemporaryDir>
+#include <QThreadPool>
 #include <QtTest>
 
 #include <set>
 
 #define QADD_COLUMN(type, name) QTest::addColumn<type>(#name)
 
+namespace
+{
+class CountingAllocator : public QZAllocator
+{
+public:
+	CountingAllocator()
+		: allocations(0)
+		, liveBytes(0)
+	{
+	}
+
+	virtual void *allocate(size_t size) override
+	{
+		allocations++;
+		liveBytes += qint64(size);
+		return QZAllocator::heapAllocator()->allocate(size);
+	}
+
+	virtual void deallocate(void *ptr, size_t size) override
+	{
+		liveBytes -= qint64(size);
+		QZAllocator::heapAllocator()->deallocate(ptr, size);
+	}
+
+	int allocations;
+	qint64 liveBytes;
+};
+
+// Sequential device receiving its data in portions, like a socket
+class PipeDevice : public QIODevice
+{
+public:
+	virtual bool isSequential() const override
+	{
+		return true;
+	}
+
+	virtual qint64 bytesAvailable() const override
+	{
+		return mBytes.size() + QIODevice::bytesAvailable();
+	}
+
+	void feed(const QByteArray &bytes)
+	{
+		mBytes.append(bytes);
+		emit readyRead();
+	}
+
+	void finish()
+	{
+		emit readChannelFinished();
+	}
+
+protected:
+	virtual qint64 readData(char *data, qint64 maxlen) override
+	{
+		auto count = qMin(qint64(mBytes.size()), maxlen);
+		memcpy(data, mBytes.constData(), size_t(count));
+		mBytes = mBytes.mid(int(count));
+		return count;
+	}
+
+	virtual qint64 writeData(const char *data, qint64 len) override
+	{
+		mBytes.append(data, int(len));
+		return len;
+	}
+
+private:
+	QByteArray mBytes;
+};
+
+// Every reading of the adaptive clock takes a millisecond
+class SteppingClockCompressor : public QZCompressor
+{
+public:
+	SteppingClockCompressor(QIODevice *target)
+		: QZCompressor(target)
+		, now(0)
+	{
+	}
+
+	int effectiveLevel() const
+	{
+		return mCompressionLevel;
+	}
+
+protected:
+	virtual qint64 adaptiveClock() override
+	{
+		now += 1000000;
+		return now;
+	}
+
+private:
+	qint64 now;
+};
+
+class ReadyReadCounter : public QObject
+{
+public:
+	ReadyReadCounter()
+		: count(0)
+	{
+	}
+
+	void onReadyRead()
+	{
+		count++;
+	}
+
+	int count;
+};
+} // namespace
+
 void Tests::test_data()
 {
-	QADD_COLUMN(QByteArray, sourceBytes);
-	QADD_COLUMN(int, compressionType);
+	QADD_COLUMN(QByteArray, sourceBytes);
+	QADD_COLUMN(int, compressionType);
+
+	QByteArray empty(256, 0);
+	QByteArray random(512, Qt::Uninitialized);
+
+	QTest::newRow("empty_z") << empty << (int) COMPRESS_Z;
+	QTest::newRow("random_z") << random << (int) COMPRESS_Z;
+	QTest::newRow("empty_ccz") << empty << (int) COMPRESS_CCZ;
+	QTest::newRow("random_ccz") << random << (int) COMPRESS_CCZ;
+}
+
+void Tests::test()
+{
+	QFETCH(QByteArray, sourceBytes);
+	QFETCH(int, compressionType);
+
+	QByteArray bytes;
+
+	{
+		QBuffer buffer(&bytes);
+		QScopedPointer<QZStream> compress(newCompressor(compressionType));
+		QVERIFY(nullptr != compress);
+		compress->setIODevice(&buffer);
+		QVERIFY(compress->open(QIODevice::WriteOnly));
+		QVERIFY(compress->isWritable() == buffer.isWritable());
+		QVERIFY(compress->isReadable() == buffer.isReadable());
+		QVERIFY(!compress->isReadable());
+		QVERIFY(compress->isWritable());
+		QCOMPARE(compress->size(), 0);
+		QCOMPARE(compress->write(sourceBytes), sourceBytes.size());
+		QCOMPARE(compress->size(), sourceBytes.size());
+		QRegularExpression seekRE("QIODevice::seek");
+		QTest::ignoreMessage(QtWarningMsg, seekRE);
+		QVERIFY(!compress->seek(sourceBytes.size()));
+		QTest::ignoreMessage(QtWarningMsg, seekRE);
+		QVERIFY(!compress->seek(0));
+		compress->close();
+		QVERIFY(!compress->hasError());
+		QVERIFY(buffer.isOpen());
+	}
+
+	{
+		QBuffer buffer(&bytes);
+		QScopedPointer<QZStream> decompress(
+			newDecompressor(compressionType, sourceBytes.size()));
+		QVERIFY(nullptr != decompress);
+		decompress->setIODevice(&buffer);
+		QVERIFY(decompress->open(QIODevice::ReadOnly));
+		QVERIFY(decompress->isWritable() == buffer.isWritable());
+		QVERIFY(decompress->isReadable() == buffer.isReadable());
+		QVERIFY(decompress->isReadable());
+		QVERIFY(!decompress->isWritable());
+		QCOMPARE(decompress->pos(), 0);
+		QCOMPARE(decompress->peek(sourceBytes.size()), sourceBytes);
+		QCOMPARE(decompress->pos(), 0);
+		QCOMPARE(decompress->readAll(), sourceBytes);
+		QCOMPARE(decompress->pos(), sourceBytes.size());
+		QVERIFY(decompress->seek(1));
+		QCOMPARE(decompress->pos(), 1);
+		auto uncompressed = decompress->readAll();
+		QCOMPARE(uncompressed,
+			QByteArray::fromRawData(
+				&sourceBytes.data()[1], uncompressed.size()));
+
+		QCOMPARE(decompress->pos(), sourceBytes.size());
+		QVERIFY(decompress->seek(0));
+		QVERIFY(decompress->seek(sourceBytes.size() + 1));
+		QCOMPARE(decompress->pos(), sourceBytes.size() + 1);
+		QRegularExpression readRE("QIODevice::read");
+		QTest::ignoreMessage(QtWarningMsg, readRE);
+		QVERIFY(decompress->readAll().isEmpty());
+
+		decompress->close();
+		QVERIFY(!decompress->hasError());
+		QVERIFY(buffer.isOpen());
+	}
+}
+
+void Tests::testSeekIndex()
+{
+	auto sourceBytes = sampleBytes(1024 * 1024);
+	auto bytes = compressBytes(COMPRESS_Z, sourceBytes);
+
+	QByteArray indexBytes;
+	{
+		QBuffer buffer(&bytes);
+		QZDecompressor decompress(&buffer);
+		decompress.setCheckpointInterval(65536);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QByteArray uncompressed;
+		while (!decompress.atEnd())
+			uncompressed += decompress.read(65536);
+		QCOMPARE(uncompressed, sourceBytes);
+		QVERIFY(decompress.checkpointCount() > 0);
+
+		auto middle = sourceBytes.size() / 2;
+		QVERIFY(decompress.seek(middle));
+		QCOMPARE(decompress.read(4096), sourceBytes.mid(middle, 4096));
+		QVERIFY(decompress.seek(100));
+		QCOMPARE(decompress.read(100), sourceBytes.mid(100, 100));
+
+		QBuffer indexBuffer(&indexBytes);
+		QVERIFY(indexBuffer.open(QIODevice::WriteOnly));
+		QVERIFY(decompress.exportIndex(&indexBuffer));
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+	}
+
+	{
+		QBuffer buffer(&bytes);
+		QZDecompressor decompress(&buffer);
+		QBuffer indexBuffer(&indexBytes);
+		QVERIFY(indexBuffer.open(QIODevice::ReadOnly));
+		QVERIFY(decompress.importIndex(&indexBuffer));
+		QVERIFY(decompress.checkpointCount() > 0);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QCOMPARE(decompress.size(), sourceBytes.size());
+
+		for (int pos : {sourceBytes.size() - 1000, 70000, 300000, 0})
+		{
+			QVERIFY(decompress.seek(pos));
+			QCOMPARE(decompress.read(1000), sourceBytes.mid(pos, 1000));
+		}
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+	}
+
+	// Index of another source is rejected
+	auto otherBytes = compressBytes(COMPRESS_Z, sourceBytes.mid(1));
+	{
+		QBuffer buffer(&otherBytes);
+		QZDecompressor decompress(&buffer);
+		QBuffer indexBuffer(&indexBytes);
+		QVERIFY(indexBuffer.open(QIODevice::ReadOnly));
+		QVERIFY(decompress.importIndex(&indexBuffer));
+		QVERIFY(!decompress.open(QIODevice::ReadOnly));
+		QVERIFY(decompress.hasError());
+
+		decompress.clearIndex();
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QVERIFY(indexBuffer.seek(0));
+		QVERIFY(!decompress.importIndex(&indexBuffer));
+		QCOMPARE(decompress.checkpointCount(), 0);
+		// Neither is the size of the rejected index
+		QVERIFY(decompress.size() != sourceBytes.size());
+		QByteArray uncompressed;
+		while (!decompress.atEnd())
+			uncompressed += decompress.read(65536);
+		QCOMPARE(uncompressed, sourceBytes.mid(1));
+		QCOMPARE(decompress.size(), qint64(sourceBytes.size() - 1));
+	}
+
+	{
+		QBuffer buffer(&bytes);
+		QZDecompressor decompress(&buffer);
+		decompress.setWindowBits(12);
+		QBuffer indexBuffer(&indexBytes);
+		QVERIFY(indexBuffer.open(QIODevice::ReadOnly));
+		QVERIFY(decompress.importIndex(&indexBuffer));
+		QVERIFY(!decompress.open(QIODevice::ReadOnly));
+	}
+}
+
+void Tests::testSmallReads()
+{
+	auto sourceBytes = sampleBytes(200000);
+
+	for (int type : {int(COMPRESS_Z), int(COMPRESS_CCZ)})
+	{
+		auto bytes = compressBytes(type, sourceBytes);
+		QBuffer buffer(&bytes);
+		QScopedPointer<QZStream> decompress(
+			newDecompressor(type, sourceBytes.size()));
+		decompress->setIODevice(&buffer);
+		QVERIFY(decompress->open(QIODevice::ReadOnly));
+
+		QByteArray uncompressed;
+		char c;
+		while (decompress->getChar(&c))
+		{
+			uncompressed.append(c);
+			if (uncompressed.size() % 1000 == 0)
+			{
+				QCOMPARE(decompress->peek(10),
+					sourceBytes.mid(uncompressed.size(), 10));
+				QVERIFY(decompress->seek(decompress->pos() - 1));
+				QVERIFY(decompress->getChar(&c));
+				QCOMPARE(c, uncompressed.at(uncompressed.size() - 1));
+			}
+		}
+		QCOMPARE(uncompressed, sourceBytes);
+
+		QVERIFY(decompress->seek(0));
+		QCOMPARE(decompress->readLine(),
+			sourceBytes.left(sourceBytes.indexOf('\n') + 1));
+
+		decompress->close();
+		QVERIFY(!decompress->hasError());
+	}
+}
+
+void Tests::testDirectInput_data()
+{
+	QADD_COLUMN(int, compressionType);
+	QADD_COLUMN(bool, directInput);
+
+	QTest::newRow("direct_z") << (int) COMPRESS_Z << true;
+	QTest::newRow("copied_z") << (int) COMPRESS_Z << false;
+	QTest::newRow("direct_ccz") << (int) COMPRESS_CCZ << true;
+	QTest::newRow("copied_ccz") << (int) COMPRESS_CCZ << false;
+}
+
+void Tests::testDirectInput()
+{
+	QFETCH(int, compressionType);
+	QFETCH(bool, directInput);
+
+	auto sourceBytes = sampleBytes(300000);
+	auto bytes = compressBytes(compressionType, sourceBytes);
+
+	QTemporaryDir dir;
+	QFile file(QDir(dir.path()).filePath("test.z"));
+	QVERIFY(file.open(QIODevice::WriteOnly));
+	QCOMPARE(file.write(bytes), bytes.size());
+	file.close();
+
+	QBuffer buffer(&bytes);
+	for (QIODevice *source : {static_cast<QIODevice *>(&file),
+			 static_cast<QIODevice *>(&buffer)})
+	{
+		QVERIFY(source->open(QIODevice::ReadOnly));
+		QScopedPointer<QZStream> decompress(
+			newDecompressor(compressionType, sourceBytes.size()));
+		auto decompressor = static_cast<QZDecompressor *>(decompress.data());
+		decompressor->setDirectInputEnabled(directInput);
+		decompress->setIODevice(source);
+		QVERIFY(decompress->open(QIODevice::ReadOnly));
+		QCOMPARE(decompress->readAll(), sourceBytes);
+		QVERIFY(decompress->seek(1000));
+		QCOMPARE(decompress->read(1000), sourceBytes.mid(1000, 1000));
+		QCOMPARE(decompress->readAll(), sourceBytes.mid(2000));
+		decompress->close();
+		QVERIFY(!decompress->hasError());
+		QCOMPARE(source->pos(), bytes.size());
+		source->close();
+	}
+}
+
+void Tests::testAllocator()
+{
+	auto pool = QZAllocator::threadPoolAllocator();
+	auto block = pool->allocate(12345);
+	QVERIFY(nullptr != block);
+	pool->deallocate(block, 12345);
+	QCOMPARE(pool->allocate(12345), block);
+	pool->deallocate(block, 12345);
+
+	auto sourceBytes = sampleBytes(100000);
+
+	for (int type : {int(COMPRESS_Z), int(COMPRESS_CCZ)})
+	{
+		CountingAllocator allocator;
+		QByteArray bytes;
+
+		{
+			QBuffer buffer(&bytes);
+			QScopedPointer<QZStream> compress(newCompressor(type));
+			compress->setAllocator(&allocator);
+			compress->setIODevice(&buffer);
+			QVERIFY(compress->open(QIODevice::WriteOnly));
+			QCOMPARE(compress->write(sourceBytes), qint64(sourceBytes.size()));
+			compress->close();
+			QVERIFY(!compress->hasError());
+		}
+
+		QVERIFY(allocator.allocations > 0);
+		QCOMPARE(allocator.liveBytes, qint64(0));
+
+		auto allocations = allocator.allocations;
+		QZAllocator::setDefaultAllocator(&allocator);
+
+		for (int i = 0; i < 2; i++)
+		{
+			QBuffer buffer(&bytes);
+			QScopedPointer<QZStream> decompress(
+				newDecompressor(type, sourceBytes.size()));
+			decompress->setAllocator(i == 0 ? nullptr : pool);
+			decompress->setIODevice(&buffer);
+			QVERIFY(decompress->open(QIODevice::ReadOnly));
+			QCOMPARE(decompress->read(sourceBytes.size()), sourceBytes);
+			decompress->close();
+			QVERIFY(!decompress->hasError());
+		}
+
+		QZAllocator::setDefaultAllocator(nullptr);
+		QCOMPARE(QZAllocator::defaultAllocator(), QZAllocator::heapAllocator());
+
+		// Only the first decompressor used the default allocator
+		QVERIFY(allocator.allocations > allocations);
+		QCOMPARE(allocator.liveBytes, qint64(0));
+	}
+}
+
+void Tests::testReadAhead()
+{
+	auto sourceBytes = sampleBytes(1000000);
+
+	for (int type : {int(COMPRESS_Z), int(COMPRESS_CCZ)})
+	{
+		auto bytes = compressBytes(type, sourceBytes);
+
+		{
+			QBuffer buffer(&bytes);
+			QScopedPointer<QZStream> decompress(newDecompressor(type, -1));
+			auto decompressor = static_cast<QZDecompressor *>(decompress.data());
+			decompressor->setReadAheadBlockCount(4);
+			decompress->setStatisticsEnabled(true);
+			decompress->setIODevice(&buffer);
+			QVERIFY(decompress->open(QIODevice::ReadOnly));
+
+			QByteArray uncompressed;
+			QByteArray block(10000, Qt::Uninitialized);
+			qint64 readBytes;
+			while ((readBytes = decompress->read(block.data(), block.size())) > 0)
+			{
+				uncompressed.append(block.constData(), int(readBytes));
+			}
+			QCOMPARE(readBytes, qint64(0));
+			QCOMPARE(uncompressed, sourceBytes);
+			QCOMPARE(decompress->size(), qint64(sourceBytes.size()));
+			QVERIFY(decompress->atEnd());
+
+			QVERIFY(decompress->seek(1000));
+			QCOMPARE(decompress->read(5000), sourceBytes.mid(1000, 5000));
+			QVERIFY(decompress->seek(500000));
+			QCOMPARE(decompress->read(200000), sourceBytes.mid(500000, 200000));
+			QCOMPARE(decompress->read(200000), sourceBytes.mid(700000, 200000));
+
+			decompress->close();
+			QVERIFY(!decompress->hasError());
+
+			// Work of the worker thread is counted after it stopped
+			auto &statistics = decompress->statistics();
+			QVERIFY(statistics.compressedBytes >= bytes.size());
+			QVERIFY(statistics.uncompressedBytes >= sourceBytes.size());
+			QVERIFY(statistics.codecTime > 0);
+		}
+
+		// Closing while the worker waits for free blocks
+		{
+			QBuffer buffer(&bytes);
+			QScopedPointer<QZStream> decompress(
+				newDecompressor(type, sourceBytes.size()));
+			auto decompressor = static_cast<QZDecompressor *>(decompress.data());
+			decompressor->setReadAheadBlockCount(1);
+			decompress->setIODevice(&buffer);
+			QVERIFY(decompress->open(QIODevice::ReadOnly));
+			QCOMPARE(decompress->read(100), sourceBytes.left(100));
+			decompress->close();
+			QVERIFY(!decompress->hasError());
+		}
+	}
+}
+
+void Tests::testChunkedCCZ()
+{
+	enum
+	{
+		CHUNK_SIZE = 65536
+	};
+
+	auto sourceBytes = sampleBytes(1000000);
+
+	QByteArray bytes;
+	{
+		QBuffer buffer(&bytes);
+		QCCZCompressor compress(&buffer, Z_BEST_COMPRESSION);
+		compress.setChunkSize(CHUNK_SIZE);
+		compress.setUserValue(0x12345678);
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+		QCOMPARE(compress.write(sourceBytes.left(100)), qint64(100));
+		QCOMPARE(compress.write(sourceBytes.mid(100)),
+			qint64(sourceBytes.size() - 100));
+		QCOMPARE(compress.size(), qint64(sourceBytes.size()));
+		compress.close();
+		QVERIFY(!compress.hasError());
+	}
+
+	QCOMPARE(bytes.left(4), QByteArray("CCZ!"));
+	QCOMPARE(int(bytes.at(7)), 3);
+
+	QTemporaryDir dir;
+	QFile file(QDir(dir.path()).filePath("test.ccz"));
+	QVERIFY(file.open(QIODevice::WriteOnly));
+	QCOMPARE(file.write(bytes), bytes.size());
+	file.close();
+
+	QBuffer buffer(&bytes);
+	for (QIODevice *source : {static_cast<QIODevice *>(&file),
+			 static_cast<QIODevice *>(&buffer)})
+	{
+		QVERIFY(source->open(QIODevice::ReadOnly));
+		QCCZDecompressor decompress(source);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QVERIFY(decompress.isChunked());
+		QCOMPARE(decompress.chunkCount(),
+			(sourceBytes.size() + CHUNK_SIZE - 1) / CHUNK_SIZE);
+		QCOMPARE(decompress.userValue(), quint32(0x12345678));
+		QCOMPARE(decompress.size(), qint64(sourceBytes.size()));
+		QCOMPARE(decompress.readAll(), sourceBytes);
+
+		for (int pos : {CHUNK_SIZE * 3 - 10, 5, CHUNK_SIZE * 15 + 7, 0})
+		{
+			QVERIFY(decompress.seek(pos));
+			QCOMPARE(decompress.read(CHUNK_SIZE + 20),
+				sourceBytes.mid(pos, CHUNK_SIZE + 20));
+		}
+
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+		QCOMPARE(source->pos(), bytes.size());
+		source->close();
+	}
+
+	// Empty payload is a single empty chunk
+	auto emptyBytes = compressBytes(COMPRESS_CCZ, QByteArray(),
+		Z_DEFAULT_COMPRESSION, QByteArray(), QZStream::FORMAT_ZLIB, 0,
+		CHUNK_SIZE);
+	QVERIFY(!emptyBytes.isEmpty());
+
+	{
+		QBuffer emptyBuffer(&emptyBytes);
+		QCCZDecompressor decompress(&emptyBuffer);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QCOMPARE(decompress.chunkCount(), 1);
+		QVERIFY(decompress.atEnd());
+		QCOMPARE(decompress.readAll(), QByteArray());
+	}
+
+	// Damaged chunk data
+	bytes[100] = char(bytes.at(100) ^ 0x55);
+	bytes[101] = char(bytes.at(101) ^ 0x55);
+	{
+		QBuffer damagedBuffer(&bytes);
+		QCCZDecompressor decompress(&damagedBuffer);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QByteArray block(CHUNK_SIZE, Qt::Uninitialized);
+		QCOMPARE(decompress.read(block.data(), block.size()), qint64(-1));
+		QVERIFY(decompress.hasError());
+	}
+}
+
+void Tests::testSequentialSource()
+{
+	auto sourceBytes = sampleBytes(200000);
+	auto bytes = compressBytes(COMPRESS_Z, sourceBytes);
+
+	for (bool complete : {true, false})
+	{
+		PipeDevice pipe;
+		QVERIFY(pipe.open(QIODevice::ReadOnly));
+
+		QZDecompressor decompress(&pipe);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QVERIFY(decompress.isSequential());
+
+		ReadyReadCounter counter;
+		QObject::connect(&decompress, &QIODevice::readyRead, &counter,
+			&ReadyReadCounter::onReadyRead);
+
+		QByteArray block(1000, Qt::Uninitialized);
+		QCOMPARE(decompress.read(block.data(), block.size()), qint64(0));
+		QCOMPARE(decompress.bytesAvailable(), qint64(0));
+		QVERIFY(!decompress.waitForReadyRead(0));
+
+		// zlib header alone decodes nothing
+		pipe.feed(bytes.left(2));
+		QCOMPARE(counter.count, 0);
+		QCOMPARE(decompress.read(block.data(), block.size()), qint64(0));
+
+		auto inputSize = complete ? bytes.size() : bytes.size() / 2;
+		QByteArray uncompressed;
+		for (int i = 2; i < inputSize; i += 1000)
+		{
+			auto readyReadCount = counter.count;
+			pipe.feed(bytes.mid(i, qMin(1000, inputSize - i)));
+			if (counter.count > readyReadCount)
+			{
+				QVERIFY(decompress.bytesAvailable() > 0);
+				uncompressed += decompress.read(decompress.bytesAvailable());
+			}
+			QCOMPARE(decompress.bytesAvailable(), qint64(0));
+			QVERIFY(!decompress.hasError());
+		}
+
+		pipe.finish();
+		uncompressed += decompress.readAll();
+		QCOMPARE(uncompressed, sourceBytes.left(uncompressed.size()));
+		if (complete)
+			QCOMPARE(uncompressed.size(), sourceBytes.size());
+		else
+			QVERIFY(uncompressed.size() < sourceBytes.size());
+
+		QCOMPARE(decompress.size(), qint64(uncompressed.size()));
+		QVERIFY(decompress.atEnd());
+		QVERIFY(!decompress.waitForReadyRead(0));
+
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+	}
+
+	// A burst of input is decoded at most a buffer ahead
+	{
+		auto largeBytes = sampleBytes(1024 * 1024);
+		PipeDevice pipe;
+		QVERIFY(pipe.open(QIODevice::ReadOnly));
+
+		QZDecompressor decompress(&pipe);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		pipe.feed(compressBytes(COMPRESS_Z, largeBytes));
+		QVERIFY(decompress.bytesAvailable() > 0);
+		QVERIFY(decompress.bytesAvailable() <= decompress.bufferSize());
+
+		QByteArray uncompressed;
+		while (uncompressed.size() < largeBytes.size())
+		{
+			auto block = decompress.read(65536);
+			QVERIFY(!block.isEmpty());
+			uncompressed += block;
+		}
+		QCOMPARE(uncompressed, largeBytes);
+		QVERIFY(!decompress.hasError());
+	}
+}
+
+void Tests::testReadAllDecompressed()
+{
+	auto sourceBytes = sampleBytes(300000);
+
+	for (int type : {int(COMPRESS_Z), int(COMPRESS_CCZ)})
+	{
+		auto bytes = compressBytes(type, sourceBytes);
+
+		for (int uncompressedSize : {-1, sourceBytes.size()})
+		{
+			QBuffer buffer(&bytes);
+			QScopedPointer<QZStream> decompress(
+				newDecompressor(type, uncompressedSize));
+			auto decompressor = static_cast<QZDecompressor *>(decompress.data());
+			decompress->setIODevice(&buffer);
+			QVERIFY(decompress->open(QIODevice::ReadOnly));
+			QCOMPARE(decompressor->readAllDecompressed(100), sourceBytes);
+			QVERIFY(decompress->atEnd());
+			QCOMPARE(decompressor->readAllDecompressed(), QByteArray());
+
+			QVERIFY(decompress->seek(1000));
+			QCOMPARE(decompressor->readAllDecompressed(), sourceBytes.mid(1000));
+			decompress->close();
+			QVERIFY(!decompress->hasError());
+		}
+	}
+
+	PipeDevice pipe;
+	QVERIFY(pipe.open(QIODevice::ReadOnly));
+	QZDecompressor decompress(&pipe);
+	QVERIFY(decompress.open(QIODevice::ReadOnly));
+	pipe.feed(compressBytes(COMPRESS_Z, sourceBytes));
+	pipe.finish();
+	QCOMPARE(decompress.readAllDecompressed(), sourceBytes);
+}
+
+void Tests::testBackends()
+{
+	auto sourceBytes = sampleBytes(300000);
+	auto backends = QZBackend::availableBackends();
+	QVERIFY(backends.contains(QZBackend::zlib()));
+	QCOMPARE(QZBackend::findBackend(QZBackend::zlib()->name()),
+		QZBackend::zlib());
+	QVERIFY(!QZBackend::findBackend("unknown"));
+
+	for (auto encoder : backends)
+	{
+		for (int level : {Z_DEFAULT_COMPRESSION, Z_NO_COMPRESSION,
+				 Z_BEST_SPEED, Z_BEST_COMPRESSION})
+		{
+			QByteArray bytes(
+				int(encoder->compressBlockBound(size_t(sourceBytes.size()))),
+				Qt::Uninitialized);
+			auto size = encoder->compressBlock(level, sourceBytes.constData(),
+				size_t(sourceBytes.size()), bytes.data(), size_t(bytes.size()));
+			QVERIFY(size > 0);
+			bytes.resize(int(size));
+
+			for (auto decoder : backends)
+			{
+				QByteArray result(sourceBytes.size(), Qt::Uninitialized);
+				QVERIFY(decoder->decompressBlock(bytes.constData(),
+					size_t(bytes.size()), result.data(), size_t(result.size())));
+				QCOMPARE(result, sourceBytes);
+
+				// Size mismatch is an error
+				QVERIFY(!decoder->decompressBlock(bytes.constData(),
+					size_t(bytes.size()), result.data(),
+					size_t(result.size() - 1)));
+			}
+
+			QBuffer buffer(&bytes);
+			QVERIFY(buffer.open(QIODevice::ReadOnly));
+			QZDecompressor decompress(&buffer, sourceBytes.size());
+			QVERIFY(decompress.open(QIODevice::ReadOnly));
+			QCOMPARE(decompress.readAll(), sourceBytes);
+		}
+	}
+
+	QByteArray bytes = compressBytes(COMPRESS_Z, sourceBytes);
+	QByteArray result(sourceBytes.size(), Qt::Uninitialized);
+	for (auto decoder : backends)
+	{
+		QVERIFY(decoder->decompressBlock(bytes.constData(),
+			size_t(bytes.size()), result.data(), size_t(result.size())));
+		QCOMPARE(result, sourceBytes);
+	}
+}
+
+void Tests::testCompressBytes()
+{
+	auto sourceBytes = sampleBytes(300000);
+
+	auto bytes = QZCompressor::compressBytes(sourceBytes, Z_BEST_SPEED);
+	QVERIFY(!bytes.isEmpty());
+	QCOMPARE(QZDecompressor::decompressBytes(bytes), sourceBytes);
+	QCOMPARE(
+		QZDecompressor::decompressBytes(bytes, sourceBytes.size()), sourceBytes);
+	QVERIFY(QZDecompressor::decompressBytes(bytes, sourceBytes.size() - 1)
+				.isEmpty());
+	QVERIFY(QZDecompressor::decompressBytes(bytes.left(bytes.size() / 2))
+				.isEmpty());
+
+	bytes = compressBytes(COMPRESS_Z, sourceBytes);
+	QCOMPARE(QZDecompressor::decompressBytes(bytes), sourceBytes);
+
+	bytes = QZCompressor::compressBytes(QByteArray());
+	QVERIFY(!bytes.isEmpty());
+	QVERIFY(QZDecompressor::decompressBytes(bytes, 0).isEmpty());
+
+	bytes = QCCZCompressor::compressBytes(
+		sourceBytes, Z_BEST_COMPRESSION, 0x12345678);
+	QCOMPARE(bytes.left(4), QByteArray("CCZ!"));
+
+	quint32 userValue = 0;
+	QCOMPARE(QCCZDecompressor::decompressBytes(bytes, &userValue), sourceBytes);
+	QCOMPARE(userValue, quint32(0x12345678));
+
+	{
+		QBuffer buffer(&bytes);
+		QVERIFY(buffer.open(QIODevice::ReadOnly));
+		QCCZDecompressor decompress(&buffer);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QCOMPARE(decompress.userValue(), quint32(0x12345678));
+		QCOMPARE(decompress.readAll(), sourceBytes);
+	}
+
+	QVERIFY(QCCZDecompressor::decompressBytes(bytes.left(10)).isEmpty());
+	// Checksum mismatch
+	bytes[bytes.size() - 1] = char(~bytes.at(bytes.size() - 1));
+	QVERIFY(QCCZDecompressor::decompressBytes(bytes).isEmpty());
+
+	// Streamed version 2 and chunked version 3
+	for (int chunkSize : {0, 65536})
+	{
+		auto bytes = compressBytes(COMPRESS_CCZ, sourceBytes,
+			Z_DEFAULT_COMPRESSION, QByteArray(), QZStream::FORMAT_ZLIB, 0,
+			chunkSize);
+		QCOMPARE(QCCZDecompressor::decompressBytes(bytes), sourceBytes);
+	}
+}
+
+void Tests::testCCZCompressionTypes_data()
+{
+	QADD_COLUMN(int, cczCompression);
+	QADD_COLUMN(int, compressionLevel);
+
+	QTest::newRow("none") << (int) CCZ::COMPRESSION_NONE << -1;
+	QTest::newRow("zstd") << (int) CCZ::COMPRESSION_ZSTD << 3;
+	QTest::newRow("lz4") << (int) CCZ::COMPRESSION_LZ4 << -1;
+	QTest::newRow("lz4hc") << (int) CCZ::COMPRESSION_LZ4 << 9;
+}
+
+void Tests::testCCZCompressionTypes()
+{
+	QFETCH(int, cczCompression);
+	QFETCH(int, compressionLevel);
+
+	QVERIFY(CCZ::isCompressionSupported(CCZ::COMPRESSION_ZLIB));
+	QCOMPARE(CCZ::compressionType(CCZ::compressionName(cczCompression)),
+		cczCompression);
+	QCOMPARE(CCZ::compressionType("unknown"), -1);
+
+	if (!CCZ::isCompressionSupported(cczCompression))
+		QSKIP("Compression type is not built");
+
+	auto sourceBytes = sampleBytes(1000000);
+	for (int chunkSize : {0, 65536})
+	{
+		QByteArray bytes;
+		{
+			QBuffer buffer(&bytes);
+			QCCZCompressor compress(&buffer, compressionLevel);
+			compress.setCompressionType(cczCompression);
+			compress.setChunkSize(chunkSize);
+			compress.setUserValue(0x12345678);
+			QVERIFY(compress.open(QIODevice::WriteOnly));
+			QCOMPARE(compress.write(sourceBytes.left(100)), qint64(100));
+			QCOMPARE(compress.write(sourceBytes.mid(100)),
+				qint64(sourceBytes.size() - 100));
+			compress.close();
+			QVERIFY(!compress.hasError());
+		}
+
+		if (cczCompression != CCZ::COMPRESSION_NONE)
+			QVERIFY(bytes.size() < sourceBytes.size());
+		QCOMPARE(QCCZDecompressor::decompressBytes(bytes), sourceBytes);
+
+		QBuffer buffer(&bytes);
+		QVERIFY(buffer.open(QIODevice::ReadOnly));
+		QVERIFY(CCZ::validateHeader(&buffer));
+
+		QCCZDecompressor decompress(&buffer);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QCOMPARE(decompress.compressionType(), cczCompression);
+		QCOMPARE(decompress.userValue(), quint32(0x12345678));
+		QCOMPARE(decompress.size(), qint64(sourceBytes.size()));
+		QCOMPARE(decompress.readAll(), sourceBytes);
+
+		for (int pos : {500000, 10, 999990})
+		{
+			QVERIFY(decompress.seek(pos));
+			QCOMPARE(decompress.read(100), sourceBytes.mid(pos, 100));
+		}
+
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+	}
+}
+
+void Tests::testPresetDictionary()
+{
+	// Small assets of mostly the same content
+	auto common = sampleBytes(8000);
+	QList<QByteArray> samples;
+	for (int i = 0; i < 32; i++)
+	{
+		QByteArray sample("asset ");
+		sample.append(QByteArray::number(i));
+		sample.append(common);
+		for (int j = i * 13; j < sample.size(); j += 701)
+			sample[j] = char('A' + i);
+
+		samples.append(sample);
+	}
+
+	auto sourceBytes = samples.first();
+	QList<QByteArray> corpus;
+	for (int i = 1; i < samples.size(); i++)
+		corpus.append(samples.at(i));
+
+	auto dictionary = QZDictionary::train(corpus);
+	QVERIFY(!dictionary.isEmpty());
+	QVERIFY(dictionary.size() <= 32768);
+	QCOMPARE(QZDictionary::train(corpus, 1000).size(), 1000);
+	QVERIFY(QZDictionary::train(corpus.mid(0, 1)).isEmpty());
+
+	QByteArray plainBytes = QZCompressor::compressBytes(sourceBytes);
+	auto bytes = compressBytes(
+		COMPRESS_Z, sourceBytes, Z_BEST_COMPRESSION, dictionary);
+	QVERIFY(!bytes.isEmpty());
+	QVERIFY(bytes.size() < plainBytes.size() / 4);
+
+	{
+		QBuffer buffer(&bytes);
+		QZDecompressor decompress(&buffer, sourceBytes.size());
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		decompress.readAll();
+		QVERIFY(decompress.hasError());
+	}
+
+	{
+		QBuffer buffer(&bytes);
+		QZDecompressor decompress(&buffer, sourceBytes.size());
+		decompress.setDictionary(dictionary);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QCOMPARE(decompress.readAll(), sourceBytes);
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+	}
+
+	{
+		QBuffer buffer(&bytes);
+		QZDecompressor decompress(&buffer, sourceBytes.size());
+		decompress.setDictionary(corpus.first());
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		decompress.readAll();
+		QVERIFY(decompress.hasError());
+	}
+
+	QVERIFY(QZDecompressor::decompressBytes(bytes).isEmpty());
+	auto id = QZDictionary::registerDictionary(dictionary);
+	QCOMPARE(id, QZDictionary::idOf(dictionary));
+	QCOMPARE(QZDictionary::find(id), dictionary);
+	QCOMPARE(QZDecompressor::decompressBytes(bytes), sourceBytes);
+	QCOMPARE(
+		QZDecompressor::decompressBytes(bytes, sourceBytes.size()), sourceBytes);
+
+	// Checkpoints within the dictionary reach are not recorded
+	auto largeBytes = sampleBytes(300000);
+	auto largeCompressed = compressBytes(COMPRESS_Z, largeBytes,
+		Z_DEFAULT_COMPRESSION, largeBytes.right(32768));
+
+	{
+		QBuffer buffer(&largeCompressed);
+		QZDecompressor decompress(&buffer, largeBytes.size());
+		decompress.setDictionary(largeBytes.right(32768));
+		decompress.setCheckpointInterval(16384);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QCOMPARE(decompress.readAll(), largeBytes);
+		QVERIFY(decompress.checkpointCount() > 0);
+
+		for (int pos : {250000, 20000, 100, 150000})
+		{
+			QVERIFY(decompress.seek(pos));
+			QCOMPARE(decompress.read(1000), largeBytes.mid(pos, 1000));
+		}
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+	}
+
+	// Version 3 chunks are decoded with the registered dictionary
+	for (int chunkSize : {0, 1024})
+	{
+		auto cczBytes = compressBytes(COMPRESS_CCZ, sourceBytes,
+			Z_DEFAULT_COMPRESSION, dictionary, QZStream::FORMAT_ZLIB, 0,
+			chunkSize);
+		QCOMPARE(QCCZDecompressor::decompressBytes(cczBytes), sourceBytes);
+
+		QBuffer buffer(&cczBytes);
+		QCCZDecompressor decompress(&buffer);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QCOMPARE(decompress.readAll(), sourceBytes);
+	}
+
+	QZDictionary::unregisterDictionary(id);
+	QVERIFY(QZDictionary::find(id).isEmpty());
+	QVERIFY(QZDecompressor::decompressBytes(bytes).isEmpty());
+
+	{
+		QByteArray cczBytes;
+		QBuffer buffer(&cczBytes);
+		QCCZCompressor compress(&buffer);
+		compress.setCompressionType(CCZ::COMPRESSION_ZSTD);
+		compress.setDictionary(dictionary);
+		QVERIFY(!compress.open(QIODevice::WriteOnly));
+	}
+}
+
+void Tests::testParallelDeflate()
+{
+	auto sourceBytes = sampleBytes(1000000);
+	auto dictionary = sourceBytes.mid(500000, 20000);
+
+	auto compress = [&sourceBytes](
+						int blockSize, const QByteArray &dictionary) {
+		QByteArray bytes;
+		QBuffer buffer(&bytes);
+		QZCompressor compress(&buffer);
+		compress.setParallelBlockSize(blockSize);
+		compress.setDictionary(dictionary);
+		if (!compress.open(QIODevice::WriteOnly))
+			return QByteArray();
+
+		for (int i = 0; i < sourceBytes.size(); i += 77777)
+		{
+			auto block = sourceBytes.mid(i, 77777);
+			if (compress.write(block) != block.size())
+				return QByteArray();
+		}
+
+		if (compress.size() != sourceBytes.size())
+			return QByteArray();
+
+		compress.close();
+		return compress.hasError() ? QByteArray() : bytes;
+	};
+
+	auto pool = QThreadPool::globalInstance();
+	int maxThreadCount = pool->maxThreadCount();
+	for (int blockSize : {1000, 65536, 2000000})
+	{
+		auto bytes = compress(blockSize, QByteArray());
+		QVERIFY(!bytes.isEmpty());
+		QCOMPARE(QZDecompressor::decompressBytes(bytes, sourceBytes.size()),
+			sourceBytes);
+
+		// Stock zlib reads the joined stream
+		QByteArray uncompressed(sourceBytes.size(), Qt::Uninitialized);
+		uLongf uncompressedSize = uLongf(uncompressed.size());
+		QCOMPARE(uncompress(reinterpret_cast<Bytef *>(uncompressed.data()),
+					 &uncompressedSize,
+					 reinterpret_cast<const Bytef *>(bytes.constData()),
+					 uLong(bytes.size())),
+			Z_OK);
+		QCOMPARE(uncompressed, sourceBytes);
+
+		pool->setMaxThreadCount(1);
+		QCOMPARE(compress(blockSize, QByteArray()), bytes);
+		pool->setMaxThreadCount(maxThreadCount);
+	}
+
+	auto bytes = compress(65536, dictionary);
+	QVERIFY(!bytes.isEmpty());
+	{
+		QBuffer buffer(&bytes);
+		QZDecompressor decompress(&buffer, sourceBytes.size());
+		decompress.setDictionary(dictionary);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QCOMPARE(decompress.readAll(), sourceBytes);
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+	}
+
+	auto cczBytes = compressBytes(COMPRESS_CCZ, sourceBytes,
+		Z_DEFAULT_COMPRESSION, QByteArray(), QZStream::FORMAT_ZLIB, 65536,
+		300000);
+	QCOMPARE(QCCZDecompressor::decompressBytes(cczBytes), sourceBytes);
+}
+
+void Tests::testInputBuffer()
+{
+	QTemporaryDir dir;
+	QFile file(QDir(dir.path()).filePath("test.z"));
+	QVERIFY(file.open(QIODevice::WriteOnly));
+
+	QByteArray expected;
+	{
+		QBuffer expectedBuffer(&expected);
+		QVERIFY(expectedBuffer.open(QIODevice::WriteOnly));
+		QDataStream expectedStream(&expectedBuffer);
+		QZCompressor compress(&file);
+		compress.setInputBufferSize(4096);
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+		QCOMPARE(compress.write(nullptr, 0), qint64(0));
+
+		QDataStream stream(&compress);
+		for (int i = 0; i < 100; i++)
+		{
+			stream << qint32(i) << quint8(i) << quint16(i * 3);
+			expectedStream << qint32(i) << quint8(i) << quint16(i * 3);
+		}
+
+		// Staged input is counted but not compressed yet
+		QCOMPARE(compress.size(), qint64(expected.size()));
+		QCOMPARE(file.pos(), qint64(0));
+
+		for (int i = 0; i < 100000; i++)
+		{
+			stream << qint32(i) << quint8(i) << quint16(i * 3);
+			expectedStream << qint32(i) << quint8(i) << quint16(i * 3);
+		}
+
+		// Large writes bypass the buffer
+		auto sourceBytes = sampleBytes(100000);
+		QCOMPARE(compress.write(sourceBytes), qint64(sourceBytes.size()));
+		expectedBuffer.write(sourceBytes);
+		stream << quint8(1);
+		expectedStream << quint8(1);
+
+		QCOMPARE(compress.size(), qint64(expected.size()));
+		compress.close();
+		QVERIFY(!compress.hasError());
+	}
+	file.close();
+
+	QVERIFY(file.open(QIODevice::ReadOnly));
+	QCOMPARE(QZDecompressor::decompressBytes(file.readAll(), expected.size()),
+		expected);
+	file.close();
+
+	QByteArray cczBytes;
+	{
+		QBuffer buffer(&cczBytes);
+		QCCZCompressor compress(&buffer);
+		compress.setChunkSize(1000);
+		compress.setInputBufferSize(300);
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+		for (int i = 0; i < expected.size(); i += 7)
+		{
+			auto block = expected.mid(i, 7);
+			QCOMPARE(compress.write(block), qint64(block.size()));
+		}
+		compress.close();
+		QVERIFY(!compress.hasError());
+	}
+	QCOMPARE(QCCZDecompressor::decompressBytes(cczBytes), expected);
+}
+
+void Tests::testFlush()
+{
+	auto sourceBytes = sampleBytes(300000);
 
-	QByteArray empty(256, 0);
-	QByteArray random(512, Qt::Uninitialized);
+	for (int parallelBlockSize : {0, 65536})
+	{
+		for (int mode : {Z_SYNC_FLUSH, Z_FULL_FLUSH})
+		{
+			PipeDevice target;
+			QVERIFY(target.open(QIODevice::ReadWrite));
+			QZCompressor compress(&target);
+			compress.setParallelBlockSize(parallelBlockSize);
+			QVERIFY(compress.open(QIODevice::WriteOnly));
 
-	QTest::newRow("empty_z") << empty << (int) COMPRESS_Z;
-	QTest::newRow("random_z") << random << (int) COMPRESS_Z;
-	QTest::newRow("empty_ccz") << empty << (int) COMPRESS_CCZ;
-	QTest::newRow("random_ccz") << random << (int) COMPRESS_CCZ;
+			PipeDevice source;
+			QVERIFY(source.open(QIODevice::ReadOnly));
+			QZDecompressor decompress(&source);
+			QVERIFY(decompress.open(QIODevice::ReadOnly));
+
+			// Everything written so far decodes after a flush
+			for (int i = 0; i < sourceBytes.size(); i += 100000)
+			{
+				auto block = sourceBytes.mid(i, 100000);
+				QCOMPARE(compress.write(block), qint64(block.size()));
+				QVERIFY(compress.flush(mode));
+				QVERIFY(compress.flush(mode));
+				source.feed(target.readAll());
+				QCOMPARE(decompress.read(block.size()), block);
+			}
+
+			compress.close();
+			QVERIFY(!compress.hasError());
+			source.feed(target.readAll());
+			source.finish();
+			QVERIFY(decompress.readAll().isEmpty());
+			QVERIFY(decompress.atEnd());
+			QVERIFY(!decompress.hasError());
+		}
+	}
+
+	PipeDevice target;
+	QVERIFY(target.open(QIODevice::ReadWrite));
+	QZCompressor compress(&target);
+	compress.setInputBufferSize(4096);
+	compress.setAutoFlushBytes(1000);
+	QVERIFY(compress.open(QIODevice::WriteOnly));
+	for (int i = 0; i < 9; i++)
+	{
+		QCOMPARE(compress.write(sourceBytes.mid(i * 100, 100)), qint64(100));
+	}
+	QCOMPARE(target.bytesAvailable(), qint64(0));
+	QCOMPARE(compress.write(sourceBytes.mid(900, 100)), qint64(100));
+	QVERIFY(target.bytesAvailable() > 0);
+	compress.close();
+	QVERIFY(!compress.hasError());
+	QCOMPARE(QZDecompressor::decompressBytes(target.readAll(), 1000),
+		sourceBytes.left(1000));
 }
 
-void Tests::test()
+void Tests::testCompressorPresets()
 {
-	QFETCH(QByteArray, sourceBytes);
-	QFETCH(int, compressionType);
+	auto sourceBytes = sampleBytes(200000);
+
+	auto names = QZCompressor::presetNames();
+	QVERIFY(names.contains("default"));
+	QVERIFY(names.contains("fast-rle"));
+	QVERIFY(names.contains("low-memory"));
+	QVERIFY(names.contains("max-ratio"));
+
+	for (auto &name : names)
+	{
+		for (int parallelBlockSize : {0, 50000})
+		{
+			QByteArray bytes;
+			QBuffer buffer(&bytes);
+			QZCompressor compress(&buffer);
+			QVERIFY(compress.setPreset(name));
+			compress.setParallelBlockSize(parallelBlockSize);
+			QVERIFY(compress.open(QIODevice::WriteOnly));
+			QCOMPARE(compress.write(sourceBytes), qint64(sourceBytes.size()));
+			compress.close();
+			QVERIFY(!compress.hasError());
+
+			QByteArray uncompressed(sourceBytes.size(), Qt::Uninitialized);
+			uLongf uncompressedSize = uLongf(uncompressed.size());
+			QCOMPARE(uncompress(reinterpret_cast<Bytef *>(uncompressed.data()),
+						 &uncompressedSize,
+						 reinterpret_cast<const Bytef *>(bytes.constData()),
+						 uLong(bytes.size())),
+				Z_OK);
+			QCOMPARE(uncompressed, sourceBytes);
+		}
+	}
+
+	QZCompressor compress;
+	QVERIFY(!compress.setPreset("unknown"));
+	QVERIFY(compress.setPreset("fast-rle"));
+	QCOMPARE(compress.strategy(), int(Z_RLE));
+	QCOMPARE(compress.compressionLevel(), int(Z_BEST_SPEED));
 
 	QByteArray bytes;
+	{
+		QBuffer buffer(&bytes);
+		QZCompressor compress(&buffer);
+		QVERIFY(compress.setPreset("low-memory"));
+		QVERIFY(compress.windowBits() < MAX_WBITS);
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+		QCOMPARE(compress.write(sourceBytes), qint64(sourceBytes.size()));
+		compress.setStrategy(Z_FILTERED);
+		QCOMPARE(compress.write(sourceBytes), qint64(sourceBytes.size()));
+		compress.close();
+		QVERIFY(!compress.hasError());
+	}
 
+	// Inflate window must hold the deflate window
+	for (int windowBits : {9, 12})
 	{
 		QBuffer buffer(&bytes);
-		QScopedPointer<QZStream> compress(newCompressor(compressionType));
-		QVERIFY(nullptr != compress);
-		compress->setIODevice(&buffer);
-		QVERIFY(compress->open(QIODevice::WriteOnly));
-		QVERIFY(compress->isWritable() == buffer.isWritable());
-		QVERIFY(compress->isReadable() == buffer.isReadable());
-		QVERIFY(!compress->isReadable());
-		QVERIFY(compress->isWritable());
-		QCOMPARE(compress->size(), 0);
-		QCOMPARE(compress->write(sourceBytes), sourceBytes.size());
-		QCOMPARE(compress->size(), sourceBytes.size());
-		QRegularExpression seekRE("QIODevice::seek");
-		QTest::ignoreMessage(QtWarningMsg, seekRE);
-		QVERIFY(!compress->seek(sourceBytes.size()));
-		QTest::ignoreMessage(QtWarningMsg, seekRE);
-		QVERIFY(!compress->seek(0));
-		compress->close();
-		QVERIFY(!compress->hasError());
-		QVERIFY(buffer.isOpen());
+		QZDecompressor decompress(&buffer, sourceBytes.size() * 2);
+		decompress.setWindowBits(windowBits);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		auto uncompressed = decompress.readAll();
+		QCOMPARE(decompress.hasError(), windowBits == 9);
+		if (!decompress.hasError())
+		{
+			QCOMPARE(uncompressed, sourceBytes + sourceBytes);
+		}
+	}
+
+	// Parameter changes may need room for the pending block
+	auto largeBytes = sampleBytes(2 * 1024 * 1024);
+	for (int writeSize : {1000, 7777, 30000, 65536})
+	{
+		QByteArray largeCompressed;
+		QBuffer buffer(&largeCompressed);
+		QZCompressor compress(&buffer, Z_BEST_SPEED);
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+		int step = 0;
+		for (int i = 0; i < largeBytes.size(); i += writeSize)
+		{
+			auto block = largeBytes.mid(i, writeSize);
+			QCOMPARE(compress.write(block), qint64(block.size()));
+			compress.setStrategy(step % 2 ? Z_DEFAULT_STRATEGY : Z_FILTERED);
+			if (step % 3 == 0)
+				compress.setCompressionLevel(step % 2 ? 1 : 4);
+			QVERIFY(!compress.hasError());
+			step++;
+		}
+		compress.close();
+		QVERIFY(!compress.hasError());
+		QCOMPARE(QZDecompressor::decompressBytes(
+					 largeCompressed, largeBytes.size()),
+			largeBytes);
 	}
+}
+
+void Tests::testAdaptiveLevel_data()
+{
+	QADD_COLUMN(int, parallelBlockSize);
+
+	QTest::newRow("serial") << 0;
+	QTest::newRow("parallel") << 65536;
+}
+
+void Tests::testAdaptiveLevel()
+{
+	QFETCH(int, parallelBlockSize);
+
+	auto sourceBytes = sampleBytes(3 * 1024 * 1024);
 
+	// Unreachable targets lower the level, trivial ones raise it.
+	// Output fits the buffer, so deflate is the bottleneck.
+	for (qint64 target : {Q_INT64_C(1) << 50, Q_INT64_C(1)})
 	{
+		QByteArray bytes;
 		QBuffer buffer(&bytes);
-		QScopedPointer<QZStream> decompress(
-			newDecompressor(compressionType, sourceBytes.size()));
-		QVERIFY(nullptr != decompress);
-		decompress->setIODevice(&buffer);
-		QVERIFY(decompress->open(QIODevice::ReadOnly));
-		QVERIFY(decompress->isWritable() == buffer.isWritable());
-		QVERIFY(decompress->isReadable() == buffer.isReadable());
-		QVERIFY(decompress->isReadable());
-		QVERIFY(!decompress->isWritable());
-		QCOMPARE(decompress->pos(), 0);
-		QCOMPARE(decompress->peek(sourceBytes.size()), sourceBytes);
-		QCOMPARE(decompress->pos(), 0);
-		QCOMPARE(decompress->readAll(), sourceBytes);
-		QCOMPARE(decompress->pos(), sourceBytes.size());
-		QVERIFY(decompress->seek(1));
-		QCOMPARE(decompress->pos(), 1);
-		auto uncompressed = decompress->readAll();
-		QCOMPARE(uncompressed,
-			QByteArray::fromRawData(
-				&sourceBytes.data()[1], uncompressed.size()));
+		SteppingClockCompressor compress(&buffer);
+		compress.setBufferSize(sourceBytes.size());
+		compress.setParallelBlockSize(parallelBlockSize);
+		compress.setTargetThroughput(target);
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+		for (int i = 0; i < sourceBytes.size(); i += 65536)
+		{
+			auto block = sourceBytes.mid(i, 65536);
+			QCOMPARE(compress.write(block), qint64(block.size()));
+		}
+		compress.close();
+		QVERIFY(!compress.hasError());
+		if (target == 1)
+			QVERIFY(compress.effectiveLevel() > 6);
+		else
+			QVERIFY(compress.effectiveLevel() < 6);
 
-		QCOMPARE(decompress->pos(), sourceBytes.size());
-		QVERIFY(decompress->seek(0));
-		QVERIFY(decompress->seek(sourceBytes.size() + 1));
-		QCOMPARE(decompress->pos(), sourceBytes.size() + 1);
-		QRegularExpression readRE("QIODevice::read");
-		QTest::ignoreMessage(QtWarningMsg, readRE);
-		QVERIFY(decompress->readAll().isEmpty());
+		QCOMPARE(QZDecompressor::decompressBytes(bytes, sourceBytes.size()),
+			sourceBytes);
+
+		// The configured level is kept for the next open
+		QCOMPARE(compress.compressionLevel(), int(Z_DEFAULT_COMPRESSION));
+		buffer.setData(QByteArray());
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+		QCOMPARE(compress.effectiveLevel(), int(Z_DEFAULT_COMPRESSION));
+		compress.close();
+	}
+}
+
+void Tests::testMemoryFootprint()
+{
+	auto sourceBytes = sampleBytes(300000);
+	auto totalFootprint = QZStream::totalMemoryFootprint();
+
+	QByteArray bytes;
+	{
+		QBuffer buffer(&bytes);
+		QZCompressor compress(&buffer);
+		QCOMPARE(compress.memoryFootprint(), qint64(0));
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+		QCOMPARE(compress.write(sourceBytes), qint64(sourceBytes.size()));
+
+		// Buffer, window, hash tables and pending output
+		auto footprint = compress.memoryFootprint();
+		QVERIFY(footprint > 256 * 1024);
+		QCOMPARE(QZStream::totalMemoryFootprint() - totalFootprint, footprint);
+
+		QByteArray smallBytes;
+		QBuffer smallBuffer(&smallBytes);
+		QZCompressor smallCompress(&smallBuffer);
+		smallCompress.setMemoryBudget(64 * 1024);
+		QVERIFY(smallCompress.open(QIODevice::WriteOnly));
+		// Effective values are per open, the settings are kept
+		QCOMPARE(smallCompress.bufferSize(), compress.bufferSize());
+		QCOMPARE(smallCompress.memLevel(), compress.memLevel());
+		QCOMPARE(smallCompress.windowBits(), compress.windowBits());
+		QCOMPARE(smallCompress.write(sourceBytes), qint64(sourceBytes.size()));
+		QVERIFY(smallCompress.memoryFootprint() < 80 * 1024);
+		QCOMPARE(QZStream::totalMemoryFootprint() - totalFootprint,
+			footprint + smallCompress.memoryFootprint());
+		smallCompress.close();
+		QVERIFY(!smallCompress.hasError());
+		QCOMPARE(QZDecompressor::decompressBytes(smallBytes, sourceBytes.size()),
+			sourceBytes);
+
+		compress.close();
+		QVERIFY(!compress.hasError());
+	}
+	QCOMPARE(QZStream::totalMemoryFootprint(), totalFootprint);
+
+	{
+		// Default window stream, the inflate window is never shrunk
+		QBuffer buffer(&bytes);
+		QZDecompressor decompress(&buffer, sourceBytes.size());
+		decompress.setMemoryBudget(48 * 1024);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QCOMPARE(decompress.windowBits(), int(MAX_WBITS));
+		QCOMPARE(decompress.cacheSize(), 32768);
+		QCOMPARE(decompress.readAll(), sourceBytes);
+		QVERIFY(decompress.memoryFootprint() <= 56 * 1024);
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+
+		decompress.setMemoryBudget(12 * 1024);
+		QVERIFY(!decompress.open(QIODevice::ReadOnly));
+		QVERIFY(decompress.hasError());
+		QCOMPARE(decompress.cacheSize(), 32768);
+	}
+	QCOMPARE(QZStream::totalMemoryFootprint(), totalFootprint);
+}
+
+void Tests::testDeflateFormats_data()
+{
+	QADD_COLUMN(int, format);
+	QADD_COLUMN(int, parallelBlockSize);
+	QADD_COLUMN(bool, useDictionary);
+
+	QTest::newRow("zlib") << (int) QZStream::FORMAT_ZLIB << 0 << false;
+	QTest::newRow("gzip") << (int) QZStream::FORMAT_GZIP << 0 << false;
+	QTest::newRow("raw") << (int) QZStream::FORMAT_RAW << 0 << false;
+	QTest::newRow("raw_dictionary")
+		<< (int) QZStream::FORMAT_RAW << 0 << true;
+	QTest::newRow("zlib_parallel")
+		<< (int) QZStream::FORMAT_ZLIB << 65536 << false;
+	QTest::newRow("gzip_parallel")
+		<< (int) QZStream::FORMAT_GZIP << 65536 << false;
+	QTest::newRow("raw_parallel")
+		<< (int) QZStream::FORMAT_RAW << 65536 << true;
+}
+
+void Tests::testDeflateFormats()
+{
+	QFETCH(int, format);
+	QFETCH(int, parallelBlockSize);
+	QFETCH(bool, useDictionary);
 
+	auto sourceBytes = sampleBytes(300000);
+	QByteArray dictionary;
+	if (useDictionary)
+		dictionary = sourceBytes.mid(100000, 20000);
+
+	auto bytes = compressBytes(COMPRESS_Z, sourceBytes, Z_DEFAULT_COMPRESSION,
+		dictionary, format, parallelBlockSize);
+	QVERIFY(!bytes.isEmpty());
+
+	// Stock zlib reads the framing
+	int windowBits = MAX_WBITS;
+	if (format == QZStream::FORMAT_GZIP)
+		windowBits += 16;
+	else if (format == QZStream::FORMAT_RAW)
+		windowBits = -windowBits;
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	QCOMPARE(inflateInit2(&stream, windowBits), Z_OK);
+	if (format == QZStream::FORMAT_RAW && useDictionary)
+	{
+		QCOMPARE(inflateSetDictionary(&stream,
+					 reinterpret_cast<const Bytef *>(dictionary.constData()),
+					 uInt(dictionary.size())),
+			Z_OK);
+	}
+
+	QByteArray uncompressed(sourceBytes.size() + 1, Qt::Uninitialized);
+	stream.next_in = reinterpret_cast<const Bytef *>(bytes.constData());
+	stream.avail_in = uInt(bytes.size());
+	stream.next_out = reinterpret_cast<Bytef *>(uncompressed.data());
+	stream.avail_out = uInt(uncompressed.size());
+	int code = inflate(&stream, Z_FINISH);
+	auto totalIn = stream.total_in;
+	uncompressed.resize(int(stream.total_out));
+	inflateEnd(&stream);
+	QCOMPARE(code, Z_STREAM_END);
+	QCOMPARE(totalIn, uLong(bytes.size()));
+	QCOMPARE(uncompressed, sourceBytes);
+
+	QList<int> readFormats;
+	readFormats << format;
+	if (format != QZStream::FORMAT_RAW)
+		readFormats << QZStream::FORMAT_AUTO;
+
+	for (int readFormat : readFormats)
+	{
+		QBuffer buffer(&bytes);
+		QZDecompressor decompress(&buffer, sourceBytes.size());
+		decompress.setFormat(readFormat);
+		decompress.setDictionary(dictionary);
+		decompress.setCheckpointInterval(65536);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QCOMPARE(decompress.readAll(), sourceBytes);
+		QVERIFY(decompress.checkpointCount() > 0);
+
+		// Checkpoints continue the stream as raw deflate data
+		QVERIFY(decompress.seek(250000));
+		QCOMPARE(decompress.read(1000), sourceBytes.mid(250000, 1000));
+		QVERIFY(decompress.seek(1000));
+		QCOMPARE(decompress.read(1000), sourceBytes.mid(1000, 1000));
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+	}
+}
+
+void Tests::testFormatDetection()
+{
+	auto sourceBytes = sampleBytes(100000);
+
+	auto compress = [&sourceBytes](QZCompressor &compress) {
+		QByteArray bytes;
+		QBuffer buffer(&bytes);
+		compress.setIODevice(&buffer);
+		if (!compress.open(QIODevice::WriteOnly))
+			return QByteArray();
+
+		compress.write(sourceBytes);
+		compress.close();
+		return compress.hasError() ? QByteArray() : bytes;
+	};
+
+	QZCompressor zlibCompress;
+	QZCompressor gzipCompress;
+	gzipCompress.setFormat(QZStream::FORMAT_GZIP);
+	QCCZCompressor cczCompress;
+
+	struct Sample
+	{
+		QByteArray bytes;
+		bool ccz;
+	};
+
+	Sample samples[] = {
+		{ compress(zlibCompress), false },
+		{ compress(gzipCompress), false },
+		{ compress(cczCompress), true },
+	};
+
+	QVERIFY(samples[1].bytes.startsWith("\x1F\x8B"));
+	for (auto &sample : samples)
+	{
+		QVERIFY(!sample.bytes.isEmpty());
+
+		QBuffer buffer(&sample.bytes);
+		QVERIFY(buffer.open(QIODevice::ReadOnly));
+		QScopedPointer<QZDecompressor> decompress(
+			CCZ::createDecompressor(&buffer));
+		QCOMPARE(bool(qobject_cast<QCCZDecompressor *>(decompress.data())),
+			sample.ccz);
+		QVERIFY(decompress->open(QIODevice::ReadOnly));
+		QCOMPARE(decompress->readAllDecompressed(), sourceBytes);
 		decompress->close();
 		QVERIFY(!decompress->hasError());
-		QVERIFY(buffer.isOpen());
+	}
+
+	// Formats the data cannot carry
+	gzipCompress.setDictionary(sourceBytes.left(1000));
+	QVERIFY(compress(gzipCompress).isEmpty());
+
+	cczCompress.setFormat(QZStream::FORMAT_GZIP);
+	QVERIFY(compress(cczCompress).isEmpty());
+
+	QZCompressor autoCompress;
+	autoCompress.setFormat(QZStream::FORMAT_AUTO);
+	QCOMPARE(autoCompress.format(), int(QZStream::FORMAT_ZLIB));
+}
+
+void Tests::testStatistics()
+{
+	auto sourceBytes = sampleBytes(300000);
+
+	QByteArray bytes;
+	{
+		QBuffer buffer(&bytes);
+		QZCompressor compress(&buffer);
+		compress.setStatisticsEnabled(true);
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+		QCOMPARE(compress.write(sourceBytes.left(100000)), qint64(100000));
+		QVERIFY(compress.flush());
+		QCOMPARE(compress.write(sourceBytes.mid(100000)),
+			qint64(sourceBytes.size() - 100000));
+		compress.close();
+		QVERIFY(!compress.hasError());
+
+		auto &statistics = compress.statistics();
+		QCOMPARE(statistics.uncompressedBytes, qint64(sourceBytes.size()));
+		QCOMPARE(statistics.compressedBytes, qint64(bytes.size()));
+		QVERIFY(statistics.codecTime > 0);
+		QCOMPARE(statistics.flushCount, qint64(1));
+		QCOMPARE(statistics.restartCount, qint64(0));
+	}
+
+	QBuffer buffer(&bytes);
+	QZDecompressor decompress(&buffer, sourceBytes.size());
+	QVERIFY(decompress.open(QIODevice::ReadOnly));
+	QCOMPARE(decompress.read(1000), sourceBytes.left(1000));
+	decompress.close();
+
+	// Nothing is counted while disabled
+	auto &statistics = decompress.statistics();
+	QCOMPARE(statistics.compressedBytes, qint64(0));
+	QCOMPARE(statistics.uncompressedBytes, qint64(0));
+	QCOMPARE(statistics.seekCount, qint64(0));
+
+	decompress.setStatisticsEnabled(true);
+	decompress.setDirectInputEnabled(false);
+	QVERIFY(decompress.open(QIODevice::ReadOnly));
+	QCOMPARE(decompress.readAll(), sourceBytes);
+	QCOMPARE(statistics.compressedBytes, qint64(bytes.size()));
+	QCOMPARE(statistics.uncompressedBytes, qint64(sourceBytes.size()));
+	QVERIFY(statistics.codecTime > 0);
+	QVERIFY(statistics.seekCount > 0);
+	QCOMPARE(statistics.restartCount, qint64(0));
+
+	QVERIFY(decompress.seek(1000));
+	QCOMPARE(decompress.read(1000), sourceBytes.mid(1000, 1000));
+	QCOMPARE(statistics.restartCount, qint64(1));
+	QVERIFY(statistics.uncompressedBytes > qint64(sourceBytes.size() + 1000));
+	decompress.close();
+
+	decompress.resetStatistics();
+	QCOMPARE(statistics.restartCount, qint64(0));
+	QCOMPARE(statistics.ioTime, qint64(0));
+}
+
+void Tests::testCCZStored()
+{
+	auto sourceBytes = sampleBytes(100000);
+	QByteArray bytes;
+	{
+		QBuffer buffer(&bytes);
+		QCCZCompressor compress(&buffer);
+		compress.setCompressionType(CCZ::COMPRESSION_NONE);
+		compress.setUserValue(0x12345678);
+		QVERIFY(compress.open(QIODevice::WriteOnly));
+		QCOMPARE(compress.write(sourceBytes), qint64(sourceBytes.size()));
+		compress.close();
+		QVERIFY(!compress.hasError());
+	}
+
+	QCOMPARE(bytes.size(), sourceBytes.size() + 16);
+	QCOMPARE(bytes.mid(16), sourceBytes);
+
+	// Data may follow the payload
+	bytes.append("tail");
+
+	QTemporaryDir dir;
+	QFile file(QDir(dir.path()).filePath("test.ccz"));
+	QVERIFY(file.open(QIODevice::WriteOnly));
+	QCOMPARE(file.write(bytes), bytes.size());
+	file.close();
+
+	QBuffer buffer(&bytes);
+	for (QIODevice *source : {static_cast<QIODevice *>(&file),
+			 static_cast<QIODevice *>(&buffer)})
+	{
+		QVERIFY(source->open(QIODevice::ReadOnly));
+		for (bool directInput : {true, false})
+		{
+			QVERIFY(source->seek(0));
+			QCCZDecompressor decompress(source);
+			decompress.setDirectInputEnabled(directInput);
+			QVERIFY(decompress.open(QIODevice::ReadOnly));
+			QCOMPARE(decompress.compressionType(), int(CCZ::COMPRESSION_NONE));
+			QCOMPARE(decompress.userValue(), quint32(0x12345678));
+			QCOMPARE(decompress.size(), qint64(sourceBytes.size()));
+
+			auto data = decompress.storedData();
+			QCOMPARE(data != nullptr, directInput);
+			if (data)
+			{
+				QCOMPARE(QByteArray(data, sourceBytes.size()), sourceBytes);
+			}
+
+			QCOMPARE(decompress.readAll(), sourceBytes);
+			QVERIFY(decompress.atEnd());
+			QVERIFY(decompress.seek(5000));
+			QCOMPARE(decompress.read(100), sourceBytes.mid(5000, 100));
+
+			decompress.close();
+			QVERIFY(!decompress.hasError());
+			QCOMPARE(source->read(4), QByteArray("tail"));
+		}
+		source->close();
+	}
+
+	PipeDevice pipe;
+	QVERIFY(pipe.open(QIODevice::ReadOnly));
+	QCCZDecompressor decompress(&pipe);
+	pipe.feed(bytes);
+	pipe.finish();
+	QVERIFY(decompress.open(QIODevice::ReadOnly));
+	QVERIFY(!decompress.storedData());
+	QCOMPARE(decompress.readAll(), sourceBytes);
+}
+
+void Tests::testCCZStreamingTarget()
+{
+	auto sourceBytes = sampleBytes(300000);
+
+	QTemporaryDir dir;
+	QFile file(QDir(dir.path()).filePath("test.ccz"));
+	for (int chunkSize : {0, 65536})
+	{
+		// Sequential targets get the whole data on close()
+		PipeDevice pipe;
+		QVERIFY(pipe.open(QIODevice::ReadWrite));
+		{
+			QCCZCompressor compress(&pipe);
+			compress.setChunkSize(chunkSize);
+			compress.setUserValue(0x12345678);
+			QVERIFY(compress.open(QIODevice::WriteOnly));
+			QCOMPARE(compress.write(sourceBytes), qint64(sourceBytes.size()));
+			compress.close();
+			QVERIFY(!compress.hasError());
+		}
+		auto pipeBytes = pipe.readAll();
+		QVERIFY(!pipeBytes.isEmpty());
+
+		// Random access targets get a patched header
+		QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+		QCOMPARE(file.write("head"), qint64(4));
+		{
+			QCCZCompressor compress(&file);
+			compress.setChunkSize(chunkSize);
+			compress.setUserValue(0x12345678);
+			QVERIFY(compress.open(QIODevice::WriteOnly));
+			for (int i = 0; i < sourceBytes.size(); i += 10000)
+			{
+				auto block = sourceBytes.mid(i, 10000);
+				QCOMPARE(compress.write(block), qint64(block.size()));
+			}
+			compress.close();
+			QVERIFY(!compress.hasError());
+		}
+		QCOMPARE(file.pos(), qint64(4 + pipeBytes.size()));
+		QCOMPARE(file.write("tail"), qint64(4));
+		file.close();
+
+		QVERIFY(file.open(QIODevice::ReadOnly));
+		auto fileBytes = file.readAll();
+		QCOMPARE(fileBytes, QByteArray("head") + pipeBytes + "tail");
+
+		QVERIFY(file.seek(4));
+		QCCZDecompressor decompress(&file);
+		QVERIFY(decompress.open(QIODevice::ReadOnly));
+		QCOMPARE(decompress.userValue(), quint32(0x12345678));
+		QCOMPARE(decompress.size(), qint64(sourceBytes.size()));
+		QCOMPARE(decompress.readAll(), sourceBytes);
+		decompress.close();
+		QVERIFY(!decompress.hasError());
+		file.close();
+
+		// Appending targets ignore seeks, data is written on close()
+		QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Append));
+		{
+			QCCZCompressor compress(&file);
+			compress.setChunkSize(chunkSize);
+			compress.setUserValue(0x12345678);
+			QVERIFY(compress.open(QIODevice::WriteOnly));
+			QCOMPARE(compress.write(sourceBytes), qint64(sourceBytes.size()));
+			compress.close();
+			QVERIFY(!compress.hasError());
+		}
+		file.close();
+
+		QVERIFY(file.open(QIODevice::ReadOnly));
+		QCOMPARE(file.readAll(), fileBytes + pipeBytes);
+		file.close();
 	}
 }
 
@@ -124,6 +1794,49 @@ QZStream *Tests::newDecompressor(int type, int uncompressedSize)
 	return nullptr;
 }
 
+QByteArray Tests::sampleBytes(int size)
+{
+	static const char *words[] = {"alpha ", "beta ", "gamma ", "delta ",
+		"epsilon ", "zeta ", "eta ", "theta ", "iota ", "kappa\n"};
+
+	QByteArray result;
+	result.reserve(size);
+
+	quint32 seed = 12345;
+	while (result.size() < size)
+	{
+		seed = seed * 1103515245 + 12345;
+		result.append(words[(seed >> 16) % 10]);
+		result.append(char(seed >> 24));
+	}
+	result.truncate(size);
+	return result;
+}
+
+QByteArray Tests::compressBytes(int type, const QByteArray &bytes,
+	int compressionLevel, const QByteArray &dictionary, int format,
+	int parallelBlockSize, int chunkSize)
+{
+	QByteArray result;
+	QBuffer buffer(&result);
+	QScopedPointer<QZStream> stream(newCompressor(type));
+	auto compress = static_cast<QZCompressor *>(stream.data());
+	compress->setIODevice(&buffer);
+	compress->setCompressionLevel(compressionLevel);
+	compress->setDictionary(dictionary);
+	compress->setFormat(format);
+	compress->setParallelBlockSize(parallelBlockSize);
+	if (type == COMPRESS_CCZ)
+		static_cast<QCCZCompressor *>(compress)->setChunkSize(chunkSize);
+
+	if (!compress->open(QIODevice::WriteOnly))
+		return QByteArray();
+
+	bool written = compress->write(bytes) == bytes.size();
+	compress->close();
+	return written && !compress->hasError() ? result : QByteArray();
+}
+
 const QImage &Tests::testImage()
 {
 	static QImage result;
@@ -240,3 +1953,70 @@ void Tests::testImageFormatPluginBufferReadWrite()
 		buffer.close();
 	}
 }
+
+void Tests::testImageFormatPluginCompressionTypes_data()
+{
+	QADD_COLUMN(int, cczCompression);
+
+	QTest::newRow("none") << (int) CCZ::COMPRESSION_NONE;
+	QTest::newRow("zstd") << (int) CCZ::COMPRESSION_ZSTD;
+	QTest::newRow("lz4") << (int) CCZ::COMPRESSION_LZ4;
+}
+
+void Tests::testImageFormatPluginCompressionTypes()
+{
+	QFETCH(int, cczCompression);
+
+	if (!CCZ::isCompressionSupported(cczCompression))
+		QSKIP("Compression type is not built");
+
+	auto name = QString::fromLatin1(CCZ::compressionName(cczCompression));
+
+	QBuffer buffer;
+	{
+		buffer.open(QBuffer::WriteOnly);
+		QImageWriter writer(&buffer, "ccz");
+		writer.setSubType("png");
+		writer.setCompression(50);
+		writer.setText("CCZ-Compression", name);
+		QVERIFY(writer.write(testImage()));
+		buffer.close();
+	}
+
+	QCOMPARE(int(buffer.data().at(5)), cczCompression);
+
+	buffer.open(QBuffer::ReadOnly);
+	QImageReader reader(&buffer);
+	QCOMPARE(reader.format(), QByteArrayLiteral("ccz"));
+	QCOMPARE(reader.text("CCZ-Compression"), name);
+	QCOMPARE(reader.read().size(), testImage().size());
+}
+
+void Tests::testImageFormatPluginPresets()
+{
+	for (auto &name : QZCompressor::presetNames())
+	{
+		QBuffer buffer;
+		{
+			buffer.open(QBuffer::WriteOnly);
+			QImageWriter writer(&buffer, "ccz");
+			writer.setSubType("bmp");
+			writer.setText("CCZ-Preset", QString::fromLatin1(name));
+			QVERIFY(writer.write(testImage()));
+			buffer.close();
+		}
+
+		buffer.open(QBuffer::ReadOnly);
+		QImageReader reader(&buffer);
+		QCOMPARE(reader.format(), QByteArrayLiteral("ccz"));
+		QVERIFY(reader.text("CCZ-Preset").isEmpty());
+		QCOMPARE(reader.read().size(), testImage().size());
+	}
+
+	QBuffer buffer;
+	buffer.open(QBuffer::WriteOnly);
+	QImageWriter writer(&buffer, "ccz");
+	writer.setSubType("bmp");
+	writer.setText("CCZ-Preset", "unknown");
+	QVERIFY(!writer.write(testImage()));
+}
@@ -2,7 +2,7 @@
 
 #include <QObject>
 
-class QZStream;
+#include "QZStream.h"
 
 class Tests : public QObject
 {
@@ -11,10 +11,40 @@ class Tests : public QObject
 private slots:
 	void test_data();
 	void test();
+	void testSeekIndex();
+	void testSmallReads();
+	void testDirectInput_data();
+	void testDirectInput();
+	void testAllocator();
+	void testReadAhead();
+	void testChunkedCCZ();
+	void testSequentialSource();
+	void testReadAllDecompressed();
+	void testBackends();
+	void testCompressBytes();
+	void testCCZCompressionTypes_data();
+	void testCCZCompressionTypes();
+	void testPresetDictionary();
+	void testParallelDeflate();
+	void testInputBuffer();
+	void testFlush();
+	void testCompressorPresets();
+	void testAdaptiveLevel_data();
+	void testAdaptiveLevel();
+	void testMemoryFootprint();
+	void testDeflateFormats_data();
+	void testDeflateFormats();
+	void testFormatDetection();
+	void testStatistics();
+	void testCCZStored();
+	void testCCZStreamingTarget();
 	void testImageFormatPluginInit();
 	void testImageFormatPluginFileSaveLoad();
 	void testImageFormatPluginFileReadWrite();
 	void testImageFormatPluginBufferReadWrite();
+	void testImageFormatPluginCompressionTypes_data();
+	void testImageFormatPluginCompressionTypes();
+	void testImageFormatPluginPresets();
 
 private:
 	enum
@@ -26,4 +56,12 @@ private:
 	static QZStream *newCompressor(int type);
 	static QZStream *newDecompressor(int type, int uncompressedSize);
 	static const QImage &testImage();
+	static QByteArray sampleBytes(int size);
+	// Whole data written at once, a null array on errors.
+	// Chunks apply to CCZ streams only.
+	static QByteArray compressBytes(int type, const QByteArray &bytes,
+		int compressionLevel = Z_BEST_COMPRESSION,
+		const QByteArray &dictionary = QByteArray(),
+		int format = QZStream::FORMAT_ZLIB, int parallelBlockSize = 0,
+		int chunkSize = 0);
 };
@@ -2,12 +2,113 @@
 
 #include <QtTest>
 #include "Tests.h"
+#include "QZBackend.h"
 
 #ifdef CCZ_IMAGEFORMAT_STATIC
 #include <QtPlugin>
 Q_IMPORT_PLUGIN(QCCZImageContainerPlugin)
 #endif
 
+namespace
+{
+// Tests of the whole buffer paths a backend implements
+const char *const BACKEND_TESTS[] = {"testCompressBytes", "testChunkedCCZ",
+	"testCCZCompressionTypes", "testPresetDictionary"};
+
+// Options of QTest::qExec() followed by a value
+const char *const VALUE_OPTIONS[] = {"-o", "-maxwarnings", "-eventdelay",
+	"-keydelay", "-mousedelay", "-perfcounter", "-minimumvalue",
+	"-minimumtotal", "-iterations", "-median", "-seed"};
+
+bool takesValue(const QString &option)
+{
+	for (auto valueOption : VALUE_OPTIONS)
+	{
+		if (option == QLatin1String(valueOption))
+			return true;
+	}
+
+	return false;
+}
+
+bool isBackendTest(const QString &function)
+{
+	// Functions may be selected with a data tag
+	auto name = function.left(function.indexOf(QLatin1Char(':')));
+	for (auto test : BACKEND_TESTS)
+	{
+		if (name == QLatin1String(test))
+			return true;
+	}
+
+	return false;
+}
+
+// Output file of -o gets the backend name before its extension
+QString backendOutput(QString output, const QByteArray &backendName)
+{
+	auto end = output.indexOf(QLatin1Char(','));
+	if (end < 0)
+		end = output.size();
+
+	if (output.left(end) != QLatin1String("-"))
+	{
+		auto dot = output.lastIndexOf(QLatin1Char('.'), end - 1);
+		auto slash = output.lastIndexOf(QLatin1Char('/'), end - 1);
+		output.insert(
+			dot > slash ? dot : end, QString::fromLatin1("-" + backendName));
+	}
+
+	return output;
+}
+
+// Functions selected by the caller are kept if they are backend
+// tests, without a selection all backend tests run. Returns an
+// empty list when nothing of the selection is backend specific.
+QStringList backendArguments(
+	const QStringList &arguments, const QByteArray &backendName)
+{
+	QStringList result;
+	bool selected = false;
+	bool backendSelected = false;
+	for (int i = 0; i < arguments.size(); i++)
+	{
+		auto argument = arguments.at(i);
+		if (i == 0 || argument.startsWith(QLatin1Char('-')))
+		{
+			result.append(argument);
+			if (i > 0 && takesValue(argument) && i + 1 < arguments.size())
+			{
+				auto value = arguments.at(++i);
+				if (argument == QLatin1String("-o"))
+					value = backendOutput(value, backendName);
+
+				result.append(value);
+			}
+
+			continue;
+		}
+
+		selected = true;
+		if (isBackendTest(argument))
+		{
+			backendSelected = true;
+			result.append(argument);
+		}
+	}
+
+	if (selected)
+		return backendSelected ? result : QStringList();
+
+	for (auto test : BACKEND_TESTS)
+	{
+		result.append(QLatin1String(test));
+	}
+
+	return result;
+}
+} // namespace
+
 int main(int argc, char *argv[])
 {
 	qDebug() << "Init tests...";
@@ -16,5 +117,29 @@ int main(int argc, char *argv[])
 
 	Tests tests;
 
-	return QTest::qExec(&tests, argc, argv);
+	QStringList arguments;
+	for (int i = 0; i < argc; i++)
+	{
+		arguments.append(QString::fromLocal8Bit(argv[i]));
+	}
+
+	// Streams always use zlib, so only the backend specific
+	// tests run again with the other backends
+	int result = QTest::qExec(&tests, arguments);
+	for (auto backend : QZBackend::availableBackends())
+	{
+		if (backend == QZBackend::zlib())
+			continue;
+
+		auto testArguments = backendArguments(arguments, backend->name());
+		if (testArguments.isEmpty())
+			continue;
+
+		qDebug() << "Backend:" << backend->name();
+		QZBackend::setDefaultBackend(backend);
+		result |= QTest::qExec(&tests, testArguments);
+	}
+
+	QZBackend::setDefaultBackend(nullptr);
+	return result;
 }